@@ -0,0 +1,36 @@
+/* bastext.h
+ * - interface of the bastext conversion library, libbastext.a
+ * $Id$
+ */
+
+#ifndef __BASTEXT_H
+#define __BASTEXT_H
+
+/* Converting in memory:
+ *  - set up a context_t with initcontext, and set its options
+ *  - binary to text: prg2txt appends the listing of a program file image
+ *    to a membuf_t, t64img2txt the listings of the programs in a T64
+ *    archive image
+ *  - text to binary: txt2prg tokenizes the programs in a text into a list
+ *    of program_t, released with freeprograms; tokenizeprg tokenizes a
+ *    single listing into a program file image in a membuf_t
+ *  - binary to binary: prg2prg translates a program file image into the
+ *    BASIC dialect forced in the context, as a program_t; xlateprg
+ *    translates a program into a membuf_t, from and to given dialects
+ *  - the messages collected in the context, and its error count, tell
+ *    what went wrong; release them with freecontext
+ *  - to collect statistics, point the context's stats_p to a stats_t
+ *    cleared with initstats
+ * The routines never exit, except when out of memory in membuf_t. Threads
+ * may convert at the same time, using separate contexts.
+ */
+
+#include "tokenize.h"
+#include "membuf.h"
+#include "context.h"
+#include "stats.h"
+#include "inmode.h"
+#include "outmode.h"
+#include "xlate.h"
+
+#endif
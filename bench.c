@@ -0,0 +1,320 @@
+/* bench.c
+ * - benchmarks the conversion routines on generated listings of every
+ *   BASIC dialect, reporting MB/s and lines/s
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __EMX__
+# include <getopt.h>
+#else
+# include <unistd.h>
+#endif
+
+#include "bastext.h"
+#include "corpus.h"
+
+#define FALSE 0
+#define TRUE 1
+
+/* Number of programs in the benchmarked T64 archive */
+#define T64PROGRAMS 16
+
+/* Temporary T64 archive */
+#define T64NAME "benchmrk.t64"
+
+/* Data benchmarked for one dialect */
+typedef struct benchdata_s {
+	basic_t		mode;
+	int			adr;			/* start address */
+	membuf_t	listing;		/* generated listing */
+	char		**lines_pp;		/* lines of listing, null terminated */
+	membuf_t	image;			/* tokenized program file image */
+	const char	**tokenized_pp;	/* lines of image, after next-line
+								   pointer */
+	long		t64size;		/* size of T64 archive */
+	int			lines;			/* number of lines */
+	context_t	ctx;			/* messages are thrown away */
+} benchdata_t;
+
+/* Values for bench_t.measure */
+#define MEASURE_TEXT 0			/* size of listing */
+#define MEASURE_PRG 1			/* size of program file */
+#define MEASURE_T64 2			/* size of T64 archive */
+
+/* Benchmark */
+typedef struct bench_s {
+	const char	*name_p;
+	void		(*run_p)(benchdata_t *);
+	int			measure;		/* data size to measure, MEASURE_ value */
+	int			programs;		/* number of programs converted per run */
+} bench_t;
+
+/* Result of the last run, kept so that the work can't be optimized away */
+static unsigned long	sink;
+
+/* runtokenize
+ * - tokenizes each line of the listing
+ */
+static void runtokenize(benchdata_t *data_p)
+{
+	char	buf[TOKENIZEDSIZE(512)];
+	int		i, length;
+
+	for (i = 0; i < data_p->lines; i ++) {
+		tokenize(&data_p->ctx, data_p->lines_pp[i], buf, &length,
+		         data_p->mode);
+		sink += length;
+	}
+}
+
+/* rundetokenize
+ * - detokenizes each line of the program
+ */
+static void rundetokenize(benchdata_t *data_p)
+{
+	char	text[4096];
+	int		i;
+
+	for (i = 0; i < data_p->lines; i ++) {
+		detokenize(NULL, data_p->tokenized_pp[i], text, data_p->mode,
+		           FALSE);
+		sink += text[0];
+	}
+}
+
+/* runinconvert
+ * - converts the program file image to text
+ */
+static void runinconvert(benchdata_t *data_p)
+{
+	membuf_t	output;
+
+	mbinit(&output);
+	prg2txt(&data_p->ctx, (const unsigned char *) data_p->image.data_p,
+	        data_p->image.length, "bench.prg", &output);
+	sink += output.length;
+	mbfree(&output);
+}
+
+/* runoutconvert
+ * - tokenizes the listing into a program file image
+ */
+static void runoutconvert(benchdata_t *data_p)
+{
+	membuf_t	output;
+
+	mbinit(&output);
+	tokenizeprg(&data_p->ctx, data_p->listing.data_p, data_p->listing.length,
+	            data_p->adr, data_p->mode, &output);
+	sink += output.length;
+	mbfree(&output);
+}
+
+/* runt64
+ * - converts all programs in the T64 archive to text
+ */
+static void runt64(benchdata_t *data_p)
+{
+	membuf_t	output;
+
+	mbinit(&output);
+	t642txt(&data_p->ctx, T64NAME, &output);
+	sink += output.length;
+	mbfree(&output);
+}
+
+static const bench_t benches[] = {
+	{ "tokenize",   runtokenize,   MEASURE_TEXT, 1 },
+	{ "detokenize", rundetokenize, MEASURE_PRG,  1 },
+	{ "inconvert",  runinconvert,  MEASURE_PRG,  1 },
+	{ "outconvert", runoutconvert, MEASURE_TEXT, 1 },
+	{ "t64",        runt64,        MEASURE_T64,  T64PROGRAMS },
+	{ NULL }
+};
+
+/* preparedata
+ * - generates and tokenizes the listing of a dialect, and writes it to a
+ *   T64 archive
+ * in:	data_p - data to fill in
+ *		mode - BASIC dialect
+ *		lines - number of lines
+ *		mix_p - make-up of listing
+ *		seed - random seed
+ * out:	none
+ */
+static void preparedata(benchdata_t *data_p, basic_t mode, int lines,
+                        const corpusmix_t *mix_p, unsigned long seed)
+{
+	program_t	*programs_p = NULL, *program_p;
+	char		*c_p;
+	size_t		pos;
+	int			i;
+	FILE		*t64;
+
+	data_p->mode = mode;
+	data_p->adr = corpusaddress(mode);
+	data_p->lines = lines;
+	initcontext(&data_p->ctx);
+	data_p->ctx.allfiles = TRUE;
+
+	/* Listing, and its lines */
+	mbinit(&data_p->listing);
+	makelisting(&data_p->listing, mode, lines, mix_p, seed);
+	data_p->lines_pp = malloc(lines * sizeof(char *));
+	c_p = malloc(data_p->listing.length + 1);
+	if (!data_p->lines_pp || !c_p) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memcpy(c_p, data_p->listing.data_p, data_p->listing.length);
+	c_p[data_p->listing.length] = 0;
+	for (i = 0; i < lines; i ++) {
+		data_p->lines_pp[i] = c_p;
+		c_p = strchr(c_p, '\n');
+		*(c_p ++) = 0;
+	}
+
+	/* Program, and its lines */
+	mbinit(&data_p->image);
+	tokenizeprg(&data_p->ctx, data_p->listing.data_p,
+	            data_p->listing.length, data_p->adr, mode, &data_p->image);
+	if (data_p->adr + data_p->image.length > 0x10000) {
+		fprintf(stderr, "Program too large for %s, use fewer lines\n",
+		        dialectnames[mode]);
+		exit(1);
+	}
+	data_p->tokenized_pp = malloc(lines * sizeof(char *));
+	if (!data_p->tokenized_pp) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	pos = 2;
+	for (i = 0; i < lines; i ++) {
+		data_p->tokenized_pp[i] = data_p->image.data_p + pos + 2;
+		pos += 2 + strlen(data_p->image.data_p + pos + 4) + 3;
+	}
+
+	/* T64 archive with copies of the program */
+	for (i = 0; i < T64PROGRAMS; i ++) {
+		program_p = malloc(sizeof(program_t));
+		if (!program_p) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		sprintf(program_p->filename, "bench%d.prg", i);
+		program_p->adr = data_p->adr;
+		program_p->endadr = data_p->adr + data_p->image.length - 3;
+		mbinit(&program_p->data);
+		mbwrite(&program_p->data, data_p->image.data_p,
+		        data_p->image.length);
+		program_p->next_p = programs_p;
+		programs_p = program_p;
+	}
+	remove(T64NAME);
+	data_p->ctx.t64name = T64NAME;
+	writebundle(&data_p->ctx, programs_p);
+	t64 = fopen(T64NAME, "rb");
+	if (!t64) {
+		fprintf(stderr, "Unable to open %s\n", T64NAME);
+		exit(1);
+	}
+	fseek(t64, 0, SEEK_END);
+	data_p->t64size = ftell(t64);
+	fclose(t64);
+
+	data_p->ctx.messages.length = 0;
+}
+
+/* freedata
+ * - releases the data of a dialect
+ * in:	data_p - data to release
+ * out:	none
+ */
+static void freedata(benchdata_t *data_p)
+{
+	free(data_p->lines_pp[0]);
+	free(data_p->lines_pp);
+	free(data_p->tokenized_pp);
+	mbfree(&data_p->listing);
+	mbfree(&data_p->image);
+	freecontext(&data_p->ctx);
+	remove(T64NAME);
+}
+
+/* main
+ * - runs each benchmark on each dialect, for at least the given time
+ */
+int main(int argc, char *argv[])
+{
+	benchdata_t		data;
+	const bench_t	*bench_p;
+	corpusmix_t		mix = defaultmix;
+	int				option, mode, lines = 500, runs;
+	unsigned long	seed = 1;
+	double			mintime = 0.5, elapsed, bytes;
+	clock_t			start;
+
+	while (-1 != (option = getopt(argc, argv, "l:t:r:k:q:e:h?"))) {
+		switch (option) {
+			case 'l':	lines = atoi(optarg);				break;
+			case 't':	mintime = atof(optarg);				break;
+			case 'r':	seed = strtoul(optarg, NULL, 10);	break;
+			case 'k':	mix.statements = atoi(optarg);		break;
+			case 'q':	mix.strings = atoi(optarg);			break;
+			case 'e':	mix.escapes = atoi(optarg);			break;
+
+			default:
+				fprintf(stderr, "Usage: %s [options]\n"
+				                "  -l n\tLines per listing (500)\n"
+				                "  -t s\tLeast time per benchmark (0.5)\n"
+				                "  -r n\tRandom seed (1)\n"
+				                "  -k n\tMost statements per line (4)\n"
+				                "  -q n\tPercentage of statements with "
+				                "strings (30)\n"
+				                "  -e n\tPercentage of string characters "
+				                "that are escapes (10)\n",
+				        argv[0]);
+				return 1;
+		}
+	}
+	if (lines < 1 || lines > 6399 || mix.statements < 1 || mintime <= 0) {
+		fprintf(stderr, "Invalid benchmark parameters\n");
+		return 1;
+	}
+
+	printf("%-11s %-11s %10s %12s\n", "dialect", "benchmark", "MB/s",
+	       "lines/s");
+	for (mode = Basic2; mode <= VicSuper; mode ++) {
+		preparedata(&data, mode, lines, &mix, seed);
+
+		for (bench_p = benches; bench_p->name_p; bench_p ++) {
+			/* Run until enough time has passed to measure */
+			runs = 0;
+			start = clock();
+			do {
+				bench_p->run_p(&data);
+				data.ctx.messages.length = 0;
+				runs ++;
+				elapsed = (double) (clock() - start) / CLOCKS_PER_SEC;
+			} while (elapsed < mintime);
+
+			switch (bench_p->measure) {
+				case MEASURE_TEXT:	bytes = data.listing.length;	break;
+				case MEASURE_PRG:	bytes = data.image.length;		break;
+				default:			bytes = data.t64size;			break;
+			}
+
+			printf("%-11s %-11s %10.2f %12.0f\n", dialectnames[mode],
+			       bench_p->name_p, bytes * runs / elapsed / 1e6,
+			       (double) lines * bench_p->programs * runs / elapsed);
+		}
+
+		freedata(&data);
+	}
+
+	return sink == 1;	/* never true, but keeps sink in use */
+}
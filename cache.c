@@ -0,0 +1,230 @@
+/* cache.c
+ * - cache of converted listings (--cache), keyed by the program and the
+ *   options it was converted with
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "image.h"
+#include "membuf.h"
+#include "context.h"
+#include "stats.h"
+#include "version.h"
+
+#define FALSE 0
+#define TRUE 1
+
+/* First line of a cache entry, entries of other versions are not used */
+#define ENTRYMAGIC PROGNAME " cache"
+
+/* Longest header of a cache entry */
+#define HEADERSIZE 512
+
+/* Cache entry layout:
+ *  ENTRYMAGIC
+ *  adr strict allfiles detect rc prglength titlelength textlength
+ *      messagelength errors
+ *  lines programs escapes errors tokens[NUMTOKENTABLES]
+ * each on a line of its own, followed by the program, the title, the
+ * listing and the messages. The program and the title are compared on
+ * lookup, so that different programs with the same hash are never mixed
+ * up.
+ */
+
+/* hashbytes
+ * - adds data to a 32-bit FNV-1a hash
+ * in:	hash - hash so far, HASHSEED1 or HASHSEED2 to start
+ *		data_p - data to add
+ *		length - length of data
+ * out:	new hash
+ */
+unsigned long hashbytes(unsigned long hash, const void *data_p,
+                        size_t length)
+{
+	const unsigned char	*byte_p = data_p;
+
+	while (length --) {
+		hash = ((hash ^ *(byte_p ++)) * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	return hash;
+}
+
+/* cachename
+ * - builds the file name of the cache entry of a program
+ * in:	name - buffer to build the name in, null terminated
+ *		ctx_p - conversion context
+ *		prg_p - BASIC program, following the start address
+ *		length - length of BASIC program
+ *		title - program title
+ *		adr - address of BASIC start
+ * out:	none
+ */
+static void cachename(membuf_t *name, const context_t *ctx_p,
+                      const unsigned char *prg_p, size_t length,
+                      const char *title, int adr)
+{
+	char			key[64];
+	unsigned long	hash1 = HASHSEED1, hash2 = HASHSEED2;
+
+	/* Two 32-bit hashes of everything the listing depends on */
+	sprintf(key, "%s %d %d %d %d ", PROGNAME, adr, ctx_p->strict,
+	        ctx_p->allfiles, ctx_p->detect);
+	hash1 = hashbytes(hash1, key, strlen(key));
+	hash1 = hashbytes(hash1, title, strlen(title) + 1);
+	hash1 = hashbytes(hash1, prg_p, length);
+	hash2 = hashbytes(hash2, prg_p, length);
+	hash2 = hashbytes(hash2, key, strlen(key));
+	hash2 = hashbytes(hash2, title, strlen(title) + 1);
+
+	name->length = 0;
+	mbprintf(name, "%s/%08lx%08lx.txt", ctx_p->cachedir, hash1, hash2);
+}
+
+/* loadcached
+ * - looks up the listing of a program in the cache
+ * in:	ctx_p - conversion context, given the messages, errors and
+ *		        statistics of the cached conversion
+ *		prg_p - BASIC program, following the start address
+ *		length - length of BASIC program
+ *		title - program title
+ *		adr - address of BASIC start
+ *		output - buffer to add the listing to
+ *		rc_p - pointer to where to put the result of the conversion
+ * out:	zero if the listing was found
+ */
+int loadcached(context_t *ctx_p, const unsigned char *prg_p, size_t length,
+               const char *title, int adr, membuf_t *output, int *rc_p)
+{
+	membuf_t		name;
+	image_t			entry;
+	char			header[HEADERSIZE + 1], *line_p;
+	const char		*newline_p, *data_p;
+	int				eadr, estrict, eallfiles, edetect, erc, i, n;
+	unsigned long	prglength, titlelength, textlength, msglength;
+	unsigned long	counts[4], tokens[NUMTOKENTABLES];
+	unsigned		errors;
+	size_t			headerlength = 0;
+	int				found = FALSE;
+
+	mbinit(&name);
+	cachename(&name, ctx_p, prg_p, length, title, adr);
+	if (loadimage(name.data_p, &entry)) {
+		mbfree(&name);
+		return 1;
+	}
+	mbfree(&name);
+
+	/* The header is three lines */
+	data_p = (const char *) entry.data_p;
+	for (i = 0; i < 3; i ++) {
+		newline_p = memchr(data_p + headerlength, '\n',
+		                   (entry.length < HEADERSIZE ? entry.length
+		                                              : HEADERSIZE)
+		                   - headerlength);
+		if (!newline_p)	break;
+		headerlength = newline_p + 1 - data_p;
+	}
+	if (3 == i) {
+		memcpy(header, data_p, headerlength);
+		header[headerlength] = 0;
+		line_p = strchr(header, '\n') + 1;
+		line_p[-1] = 0;
+		found = 0 == strcmp(header, ENTRYMAGIC) &&
+		        10 == sscanf(line_p, "%d %d %d %d %d %lu %lu %lu %lu %u",
+		                     &eadr, &estrict, &eallfiles, &edetect, &erc,
+		                     &prglength, &titlelength, &textlength,
+		                     &msglength, &errors);
+
+		/* Statistics of the conversion */
+		line_p = strchr(line_p, '\n') + 1;
+		for (i = 0; found && i < 4 + NUMTOKENTABLES; i ++) {
+			found = 1 == sscanf(line_p, "%lu%n",
+			                    i < 4 ? &counts[i] : &tokens[i - 4], &n);
+			line_p += n;
+		}
+	}
+
+	/* Check that it is the same program, converted the same way */
+	found = found && eadr == adr && estrict == ctx_p->strict &&
+	        eallfiles == ctx_p->allfiles && edetect == ctx_p->detect &&
+	        prglength == length && titlelength == strlen(title) &&
+	        headerlength + prglength + titlelength + textlength + msglength
+	        == entry.length &&
+	        0 == memcmp(data_p + headerlength, prg_p, length) &&
+	        0 == memcmp(data_p + headerlength + length, title, titlelength);
+
+	if (found) {
+		data_p += headerlength + prglength + titlelength;
+		mbwrite(output, data_p, textlength);
+		mbwrite(&ctx_p->messages, data_p + textlength, msglength);
+		ctx_p->errors += errors;
+		if (ctx_p->stats_p) {
+			ctx_p->stats_p->lines += counts[0];
+			ctx_p->stats_p->programs += counts[1];
+			ctx_p->stats_p->escapes += counts[2];
+			ctx_p->stats_p->errors += counts[3];
+			for (i = 0; i < NUMTOKENTABLES; i ++) {
+				ctx_p->stats_p->tokens[i] += tokens[i];
+			}
+		}
+		*rc_p = erc;
+	}
+
+	freeimage(&entry);
+	return !found;
+}
+
+/* storecached
+ * - stores the listing of a program in the cache, failing silently
+ * in:	ctx_p - context of the conversion, with its messages, errors and
+ *		        statistics only
+ *		prg_p - BASIC program, following the start address
+ *		length - length of BASIC program
+ *		title - program title
+ *		adr - address of BASIC start
+ *		text_p - listing
+ *		textlength - length of listing
+ *		rc - result of the conversion
+ * out:	none
+ */
+void storecached(const context_t *ctx_p, const unsigned char *prg_p,
+                 size_t length, const char *title, int adr,
+                 const char *text_p, size_t textlength, int rc)
+{
+	membuf_t		name, entry;
+	const stats_t	*stats_p = ctx_p->stats_p;
+	int				i;
+
+	if (!stats_p)	return;
+
+	/* Build the entry */
+	mbinit(&entry);
+	mbprintf(&entry, "%s\n%d %d %d %d %d %lu %lu %lu %lu %u\n"
+	                 "%lu %lu %lu %lu",
+	         ENTRYMAGIC, adr, ctx_p->strict, ctx_p->allfiles, ctx_p->detect,
+	         rc, (unsigned long) length, (unsigned long) strlen(title),
+	         (unsigned long) textlength,
+	         (unsigned long) ctx_p->messages.length, ctx_p->errors,
+	         stats_p->lines, stats_p->programs, stats_p->escapes,
+	         stats_p->errors);
+	for (i = 0; i < NUMTOKENTABLES; i ++) {
+		mbprintf(&entry, " %lu", stats_p->tokens[i]);
+	}
+	mbputc(&entry, '\n');
+	mbwrite(&entry, prg_p, length);
+	mbputs(&entry, title);
+	mbwrite(&entry, text_p, textlength);
+	mbwrite(&entry, ctx_p->messages.data_p, ctx_p->messages.length);
+
+	/* Other conversions must never see half an entry */
+	mbinit(&name);
+	cachename(&name, ctx_p, prg_p, length, title, adr);
+	saveimage(name.data_p, entry.data_p, entry.length, ctx_p->filemode);
+
+	mbfree(&name);
+	mbfree(&entry);
+}
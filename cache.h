@@ -0,0 +1,25 @@
+/* cache.h
+ * $Id$
+ */
+
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include "membuf.h"
+#include "context.h"
+
+/* Starting values for hashbytes, two hashes of the same data started
+ * with each make a 64-bit hash
+ */
+#define HASHSEED1 2166136261UL
+#define HASHSEED2 0x5BD1E995UL
+
+unsigned long hashbytes(unsigned long hash, const void *data_p,
+                        size_t length);
+int loadcached(context_t *ctx_p, const unsigned char *prg_p, size_t length,
+               const char *title, int adr, membuf_t *output, int *rc_p);
+void storecached(const context_t *ctx_p, const unsigned char *prg_p,
+                 size_t length, const char *title, int adr,
+                 const char *text_p, size_t textlength, int rc);
+
+#endif
@@ -0,0 +1,143 @@
+/* context.c
+ * - conversion contexts, holding options and diagnostics
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "context.h"
+
+#define FALSE 0
+#define TRUE 1
+
+/* Longest message reported, longer messages are cut */
+#define MAXMESSAGE 1024
+
+/* initcontext
+ * - initializes a context with the default options and no messages
+ * in:	ctx_p - context to initialize
+ * out:	none
+ */
+void initcontext(context_t *ctx_p)
+{
+	ctx_p->allfiles = FALSE;
+	ctx_p->strict = FALSE;
+	ctx_p->detect = FALSE;
+	ctx_p->threads = 1;
+	ctx_p->force = Any;
+	ctx_p->t64name = NULL;
+	ctx_p->replace = FALSE;
+	ctx_p->incremental = FALSE;
+	ctx_p->outdir = NULL;
+	ctx_p->stats_p = NULL;
+	ctx_p->cachedir = NULL;
+	ctx_p->filemode = 0600;
+	mbinit(&ctx_p->messages);
+	ctx_p->errors = 0;
+
+	/* The detokenizer tables are shared by all contexts */
+	initdetokenize();
+}
+
+/* freecontext
+ * - releases the messages of a context
+ * in:	ctx_p - context to release
+ * out:	none
+ */
+void freecontext(context_t *ctx_p)
+{
+	mbfree(&ctx_p->messages);
+}
+
+/* forkcontext
+ * - sets up a context for a part of a conversion, which may run on another
+ *   thread, with the same options but its own messages and statistics
+ * in:	child_p - context to set up, released with freecontext
+ *		parent_p - context of the whole conversion
+ *		stats_p - statistics for the part, used if the parent collects
+ *		          statistics
+ * out:	none
+ */
+void forkcontext(context_t *child_p, const context_t *parent_p,
+                 stats_t *stats_p)
+{
+	*child_p = *parent_p;
+	mbinit(&child_p->messages);
+	child_p->errors = 0;
+	initstats(stats_p);
+	if (parent_p->stats_p)	stats_p->timing = parent_p->stats_p->timing;
+	child_p->stats_p = parent_p->stats_p ? stats_p : NULL;
+}
+
+/* mergecontext
+ * - adds the messages, errors and statistics of a forked context to the
+ *   context it was forked from
+ * in:	parent_p - context of the whole conversion
+ *		child_p - context of the part
+ * out:	none
+ */
+void mergecontext(context_t *parent_p, const context_t *child_p)
+{
+	mbwrite(&parent_p->messages, child_p->messages.data_p,
+	        child_p->messages.length);
+	parent_p->errors += child_p->errors;
+	if (parent_p->stats_p && child_p->stats_p) {
+		addstats(parent_p->stats_p, child_p->stats_p);
+	}
+}
+
+/* addmessage
+ * - adds a formatted message to a context, or writes it to stderr
+ * in:	ctx_p - context, NULL for stderr
+ *		format_p - printf format
+ *		args - arguments for format
+ * out:	none
+ */
+static void addmessage(context_t *ctx_p, const char *format_p, va_list args)
+{
+	char	text[MAXMESSAGE];
+
+	vsnprintf(text, sizeof(text), format_p, args);
+	if (ctx_p) {
+		mbputs(&ctx_p->messages, text);
+	}
+	else {
+		fputs(text, stderr);
+	}
+}
+
+/* report
+ * - reports a message, such as a warning or progress information
+ * in:	ctx_p - context, NULL for stderr
+ *		format_p - printf format
+ * out:	none
+ */
+void report(context_t *ctx_p, const char *format_p, ...)
+{
+	va_list	args;
+
+	va_start(args, format_p);
+	addmessage(ctx_p, format_p, args);
+	va_end(args);
+}
+
+/* reporterror
+ * - reports an error that stopped a conversion
+ * in:	ctx_p - context, NULL for stderr
+ *		format_p - printf format
+ * out:	none
+ */
+void reporterror(context_t *ctx_p, const char *format_p, ...)
+{
+	va_list	args;
+
+	va_start(args, format_p);
+	addmessage(ctx_p, format_p, args);
+	va_end(args);
+
+	if (ctx_p) {
+		ctx_p->errors ++;
+		if (ctx_p->stats_p)	ctx_p->stats_p->errors ++;
+	}
+}
@@ -0,0 +1,55 @@
+/* context.h
+ * $Id$
+ */
+
+#ifndef __CONTEXT_H
+#define __CONTEXT_H
+
+#include "tokenize.h"
+#include "membuf.h"
+#include "stats.h"
+
+/* Conversion context
+ * - the options and diagnostics of a conversion. Conversions running at
+ *   the same time must use separate contexts. Routines taking a context
+ *   also accept NULL, meaning default options with diagnostics written
+ *   straight to stderr
+ */
+typedef struct context_s {
+	/* Options */
+	int			allfiles;	/* in: convert unrecognized start addresses */
+	int			strict;		/* in: strict tok64 compatibility */
+	int			detect;		/* in: detect BASIC mode from the tokens */
+	int			threads;	/* in: worker threads for one large program */
+	basic_t		force;		/* out: BASIC mode, Any for autodetect;
+							   cross: BASIC mode to convert to */
+	const char	*t64name;	/* out/cross: T64 archive to write programs to,
+							   NULL for separate PRG files */
+	int			replace;	/* out/cross: replace programs of the same
+							   name in the T64 archive */
+	const char	*outdir;	/* cross: directory to write programs to,
+							   NULL for the current directory */
+	int			incremental;/* out: tokenize changed lines only, keeping
+							   a sidecar file of each text file */
+	stats_t		*stats_p;	/* in/out: statistics to add to, NULL for
+							   none */
+	const char	*cachedir;	/* in: directory of cached listings, NULL
+							   for none */
+	int			filemode;	/* in/out: mode of the cache and sidecar
+							   files written, see readfilemode */
+
+	/* Diagnostics */
+	membuf_t	messages;	/* messages, each ended by a newline */
+	unsigned	errors;		/* number of errors that stopped a
+							   conversion */
+} context_t;
+
+void initcontext(context_t *ctx_p);
+void freecontext(context_t *ctx_p);
+void forkcontext(context_t *child_p, const context_t *parent_p,
+                 stats_t *stats_p);
+void mergecontext(context_t *parent_p, const context_t *child_p);
+void report(context_t *ctx_p, const char *format_p, ...);
+void reporterror(context_t *ctx_p, const char *format_p, ...);
+
+#endif
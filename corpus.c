@@ -0,0 +1,206 @@
+/* corpus.c
+ * - generates BASIC listings for benchmarking, from the keyword tables in
+ *   tokens.c (the same seed always gives the same listing)
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "corpus.h"
+#include "tokens.h"
+
+#define FALSE 0
+#define TRUE 1
+
+/* Line length after which no more statements are added */
+#define MAXLINE 160
+
+/* Mix of keywords, strings and escapes typical for programs of the time */
+const corpusmix_t defaultmix = { 4, 30, 10 };
+
+/* Names of the BASIC dialects, indexed by basic_t */
+const char *dialectnames[] = {
+	"any", "basic2", "graphics52", "tfc3", "basic7", "basic71", "basic35",
+	"basic4", "vicsuper"
+};
+
+/* Random number generator state, a linear congruential generator that
+ * gives the same numbers on all platforms
+ */
+typedef struct random_s {
+	unsigned long	state;
+} random_t;
+
+/* nextrandom
+ * - draws a random number
+ * in:	random_p - generator state
+ *		range - number of possible values
+ * out:	number from 0 to range - 1
+ */
+static int nextrandom(random_t *random_p, int range)
+{
+	random_p->state = (random_p->state * 1103515245UL + 12345UL) &
+	                  0xFFFFFFFFUL;
+	return (int) ((random_p->state >> 16) % range);
+}
+
+/* corpusaddress
+ * - gives the usual start address of programs in a BASIC dialect
+ * in:	mode - BASIC dialect
+ * out:	start address
+ */
+int corpusaddress(basic_t mode)
+{
+	switch (mode) {
+		case Graphics52:	return 0x0401;
+		case TFC3:			return 0x0801;
+		case Basic7:		return 0x4001;
+		case Basic71:		return 0x1C01;
+		case Basic35:		return 0x1001;	/* C16/+4 */
+		case Basic4:		return 0x0401;	/* PET */
+		case VicSuper:		return 0x1201;	/* VIC-20 +8K */
+		default:			return 0x0801;
+	}
+}
+
+/* pickkeyword
+ * - picks a keyword of a BASIC dialect, extension keywords as often as
+ *   the C64 BASIC 2.0 ones, operators are left out
+ * in:	random_p - generator state
+ *		mode - BASIC dialect
+ * out:	keyword text
+ */
+static const char *pickkeyword(random_t *random_p, basic_t mode)
+{
+	const tokenseg_t	*segs_p = dialects[mode], *seg_p;
+	const char			*text_p;
+	int					numsegs;
+
+	for (numsegs = 0; segs_p[numsegs].table_p; numsegs ++);
+
+	do {
+		seg_p = &segs_p[nextrandom(random_p, numsegs)];
+		text_p = seg_p->table_p[seg_p->first +
+		                        nextrandom(random_p,
+		                                   seg_p->last - seg_p->first + 1)];
+	} while (*text_p < 'A' || *text_p > 'Z');	/* unused or operator */
+
+	return text_p;
+}
+
+/* pickescape
+ * - picks a PETSCII escape name
+ * in:	random_p - generator state
+ * out:	escape name
+ */
+static const char *pickescape(random_t *random_p)
+{
+	const char	*name_p;
+
+	/* Only real names, not single characters or numbers, and not null
+	 * which can't be written
+	 */
+	do {
+		name_p = petscii[1 + nextrandom(random_p, 255)];
+	} while (!name_p[1] || (name_p[0] >= '0' && name_p[0] <= '9'));
+
+	return name_p;
+}
+
+/* putstring
+ * - writes a quoted string
+ * in:	output - buffer to write to
+ *		random_p - generator state
+ *		mix_p - make-up of listing
+ * out:	none
+ */
+static void putstring(membuf_t *output, random_t *random_p,
+                      const corpusmix_t *mix_p)
+{
+	static const char	text[] = "abcdefghijklmnopqrstuvwxyz      0123456789"
+	                             ".,:;!?-+*/=()";
+	int					length, i;
+
+	mbputc(output, '"');
+	length = 1 + nextrandom(random_p, 16);
+	for (i = 0; i < length; i ++) {
+		if (nextrandom(random_p, 100) < mix_p->escapes) {
+			if (nextrandom(random_p, 4)) {
+				mbprintf(output, "{%s}", pickescape(random_p));
+			}
+			else {
+				mbprintf(output, "{%s*%d}", pickescape(random_p),
+				         2 + nextrandom(random_p, 20));
+			}
+		}
+		else {
+			mbputc(output, text[nextrandom(random_p, sizeof(text) - 1)]);
+		}
+	}
+	mbputc(output, '"');
+}
+
+/* putoperand
+ * - writes a variable or a number
+ * in:	output - buffer to write to
+ *		random_p - generator state
+ * out:	none
+ */
+static void putoperand(membuf_t *output, random_t *random_p)
+{
+	static const char	*suffixes[] = { "", "", "%", "$" };
+
+	if (nextrandom(random_p, 2)) {
+		mbprintf(output, "%c%d%s", 'a' + nextrandom(random_p, 26),
+		         nextrandom(random_p, 10),
+		         suffixes[nextrandom(random_p, 4)]);
+	}
+	else {
+		mbprintf(output, "%d", nextrandom(random_p, 10000));
+	}
+}
+
+/* makelisting
+ * - generates the lines of a BASIC listing, in the text format read by
+ *   the output mode (without the start/stop headers)
+ * in:	output - buffer to append listing to
+ *		mode - BASIC dialect to use the keywords of
+ *		lines - number of lines
+ *		mix_p - make-up of listing
+ *		seed - random seed
+ * out:	none
+ */
+void makelisting(membuf_t *output, basic_t mode, int lines,
+                 const corpusmix_t *mix_p, unsigned long seed)
+{
+	random_t	random;
+	int			line, statements, i;
+	size_t		start;
+
+	random.state = seed;
+	for (line = 0; line < lines; line ++) {
+		start = output->length;
+		mbprintf(output, "%d ", 10 * (line + 1) % 64000);
+
+		statements = 1 + nextrandom(&random, mix_p->statements);
+		for (i = 0; i < statements; i ++) {
+			/* Keep lines well below the 511 characters read */
+			if (output->length - start > MAXLINE)	break;
+			if (i)	mbputc(output, ':');
+
+			mbputs(output, pickkeyword(&random, mode));
+			mbputc(output, ' ');
+			if (nextrandom(&random, 100) < mix_p->strings) {
+				putstring(output, &random, mix_p);
+				mbputc(output, ';');
+			}
+			putoperand(output, &random);
+			if (nextrandom(&random, 2)) {
+				mbputc(output, "+-*/,"[nextrandom(&random, 5)]);
+				putoperand(output, &random);
+			}
+		}
+		mbputc(output, '\n');
+	}
+}
@@ -0,0 +1,26 @@
+/* corpus.h
+ * $Id$
+ */
+
+#ifndef __CORPUS_H
+#define __CORPUS_H
+
+#include "tokenize.h"
+#include "membuf.h"
+
+/* Make-up of generated listings */
+typedef struct corpusmix_s {
+	int	statements;		/* most statements on a line */
+	int	strings;		/* percentage of statements with a quoted string */
+	int	escapes;		/* percentage of string characters written as
+						   {escapes}, some of them repeated {x*n} */
+} corpusmix_t;
+
+extern const corpusmix_t defaultmix;
+extern const char *dialectnames[];
+
+int corpusaddress(basic_t mode);
+void makelisting(membuf_t *output, basic_t mode, int lines,
+                 const corpusmix_t *mix_p, unsigned long seed);
+
+#endif
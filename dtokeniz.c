@@ -5,9 +5,22 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#ifndef __EMX__
+# include <pthread.h>
+#endif
+
+/* The vector code only pays off when the compiler keeps the vectors in
+ * registers, that is when optimizing
+ */
+#if defined(__SSE2__) && defined(__OPTIMIZE__)
+# define USESSE2
+# include <emmintrin.h>
+#endif
 
 #include "tokenize.h"
 #include "tokens.h"
+#include "context.h"
 
 #define FALSE 0
 #define TRUE 1
@@ -17,180 +30,416 @@
  * not included
  */
 
+/* Size of the text pool of a fragment table, the texts of one table
+ * use less than 12K
+ */
+#define POOLSIZE 16384
+
+/* Text fragment, stored in the pool of a fragment table */
+typedef struct fragment_s {
+	unsigned short	offset;			/* offset in pool */
+	unsigned char	length;			/* length of text */
+	unsigned char	extra;			/* quoted[]: shortest repetition written
+									   as {x*n}, 0 for never
+									   command[]: prefixed[] table + 1 for
+									   prefix bytes, 0 for other bytes
+									   prefixed[]: nonzero for valid tokens */
+} fragment_t;
+
+/* Fragment table
+ * - the texts to write for each byte, for one BASIC version and
+ *   strictness
+ */
+typedef struct fragtab_s {
+	fragment_t	command[256];		/* text in command mode */
+	fragment_t	quoted[256];		/* text in quote mode */
+	fragment_t	repeat[256];		/* start of repetition in quote mode,
+									   "{name*" */
+	fragment_t	prefixed[2][256];	/* text of bytes following CE/FE
+									   prefix in command mode */
+	signed char	tables[3][256];		/* token table each byte is counted
+									   in (--stats), unprefixed and
+									   following CE/FE, -1 for none */
+	unsigned	used;				/* amount of pool used */
+	char		pool[POOLSIZE];
+} fragtab_t;
+
+/* Fragment tables, built on first use */
+static fragtab_t *fragtabs[VicSuper + 1][2];
+#ifndef __EMX__
+static pthread_once_t fragonce = PTHREAD_ONCE_INIT;
+#endif
+
+/* addfragment
+ * - adds a text to the pool of a fragment table
+ * in:	tab_p - fragment table
+ *		text_p - text to add
+ *		extra - extra information for fragment
+ * out:	fragment for text
+ */
+static fragment_t addfragment(fragtab_t *tab_p, const char *text_p,
+                              int extra)
+{
+	fragment_t	fragment;
+	size_t		length = strlen(text_p);
+
+	fragment.offset = tab_p->used;
+	fragment.length = length;
+	fragment.extra = extra;
+	memcpy(&tab_p->pool[tab_p->used], text_p, length);
+	tab_p->used += length;
+
+	return fragment;
+}
+
+/* buildfragtab
+ * - builds the fragment table for a BASIC version and strictness
+ * in:	mode - BASIC version to detokenize
+ *		strict - flag for using strict tok64 compatibility
+ * out:	fragment table
+ */
+static fragtab_t *buildfragtab(basic_t mode, int strict)
+{
+	fragtab_t	*tab_p;
+	int			ch, i;
+	int			isspecial;			/* flag for special characters */
+	const char	*escape_p;			/* pointer to escape sequence */
+	char		numeric[4];			/* threedigit numeric escape for strict
+									   tok64 compatibility */
+	char		text[32];
+
+	tab_p = malloc(sizeof(fragtab_t));
+	if (!tab_p) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	tab_p->used = 0;
+
+	for (ch = 0; ch <= 255; ch ++) {
+		/* Point to PETSCII sequence */
+		escape_p = petscii[ch];
+		if (strict && nontok64compatible(ch)) {
+			/* Maintain tok64 compatibility */
+			sprintf(numeric, "%03d", ch);
+			escape_p = numeric;
+		}
+
+		/* Quote mode:
+		 * Convert from PETSCII to ASCII,
+		 * and write repetitions as a multiple of the character.
+		 * Repetitions of non-special characters is only written if
+		 * there are three or more repetitions.
+		 * Repetitions of * is not written ({**n} is not parsed correctly)
+		 * Repetitions of " is not written (quotemode on/off)
+		 */
+		isspecial = (0 != escape_p[1]);	/* escape is multibyte */
+		if (34 == ch) {			/* quote */
+			tab_p->quoted[ch] = addfragment(tab_p, "\"", 0);
+		}
+		else if (42 == ch) {	/* asterisk */
+			tab_p->quoted[ch] = addfragment(tab_p, "*", 0);
+		}
+		else {
+			/* Repetitions are written if:
+			 *  current and next character match
+			 *  AND (at least) one of the following:
+			 *    <this is a special character OR space>
+			 *    OR current and third character match
+			 *  AND (at least) one of the following:
+			 *    we are not in tok64 strict compatibility mode
+			 *    OR the character is space
+			 *    OR the escape code is not a single character
+			 */
+			if (isspecial) {
+				sprintf(text, "{%s}", escape_p);
+			}
+			else {	/* normal character */
+				sprintf(text, "%c", *escape_p);
+			}
+			tab_p->quoted[ch] =
+				addfragment(tab_p, text,
+				            (strict && 32 != ch && !isspecial) ? 0 :
+				            (isspecial || 32 == ch)            ? 2 : 3);
+
+			if (32 == ch) {		/* space */
+				strcpy(text, "{space*");
+			}
+			else {
+				sprintf(text, "{%s*", escape_p);
+			}
+			tab_p->repeat[ch] = addfragment(tab_p, text, 0);
+		}
+
+		/* Command mode */
+		if (ch >= 128 && ch <= 254) {	/* Probable BASIC command */
+			if (ch <= 203) {
+				/* C64 BASIC 2.0 */
+				escape_p = c64tokens[ch - 128];
+			}
+			else if (ch <= 253 && (Basic7 == mode || Basic71 == mode)) {
+				/* C128 BASIC 7.0 */
+				escape_p = c128tokens[ch - 204];
+			}
+			else if (ch <= 253 && Graphics52 == mode) {
+				/* C64 Graphics52 */
+				escape_p = graphics52tokens[ch - 204];
+			}
+			else if (ch <= 232 && TFC3 == mode) {
+				/* C64 TFC3 */
+				escape_p = tfc3tokens[ch - 204];
+			}
+			else {
+				/* Errorneous token */
+				sprintf(text, "{%d}", ch);
+				escape_p = text;
+			}
+
+			/* C128 BASIC 7.0/7.1 CE and FE prefixes, the texts above are
+			 * used if the following byte is not a valid token
+			 */
+			i = 0;
+			if (Basic7 == mode || Basic71 == mode) {
+				if (0xCE == ch)			i = 1;
+				else if (0xFE == ch)	i = 2;
+			}
+			tab_p->command[ch] = addfragment(tab_p, escape_p, i);
+		}
+		else {				/* text */
+			/* PETSCII text in BASIC:
+			 * The only possible case of text is unshifted. To increase
+			 * readability, this is written as lowercase ASCII, whereas
+			 * keywords are written as uppercase.
+			 * There can also be special characters (32-64), they are
+			 * printed as-is.
+			 */
+			if ((ch >= 32 && ch <= 64) ||	/* ' ' - '@', */
+			    91 == ch || 93 == ch) {		/* '[', ']' */
+				sprintf(text, "%c", ch);
+			}
+			else if (ch >= 65 && ch <= 90) {	/* 'A' - 'Z' */
+				sprintf(text, "%c", ch + 32);
+			}
+			else {	/* Possibly illegal character, write petscii escape */
+				sprintf(text, "{%s}", escape_p);
+			}
+			tab_p->command[ch] = addfragment(tab_p, text, 0);
+		}
+	}
+
+	/* Token tables to count tokens in, looked up once here instead of for
+	 * each token
+	 */
+	for (ch = 0; ch <= 255; ch ++) {
+		tab_p->tables[0][ch] = findtokentable(mode, 0, ch);
+		tab_p->tables[1][ch] = findtokentable(mode, 0xCE, ch);
+		tab_p->tables[2][ch] = findtokentable(mode, 0xFE, ch);
+	}
+
+	/* C128 BASIC 7.0 CE prefix and C128 BASIC 7.0/7.1 FE prefix */
+	memset(tab_p->prefixed, 0, sizeof(tab_p->prefixed));
+	if (Basic7 == mode || Basic71 == mode) {
+		for (ch = 2; ch <= 9; ch ++) {
+			tab_p->prefixed[0][ch] =
+				addfragment(tab_p, c128CEtokens[ch], 1);
+		}
+		for (ch = 2; ch <= ((Basic7 == mode) ? 0x26 : 0x37); ch ++) {
+			tab_p->prefixed[1][ch] =
+				addfragment(tab_p, c128FEtokens[ch], 1);
+		}
+	}
+
+	return tab_p;
+}
+
+/* putnumber
+ * - writes an unsigned number in decimal
+ * in:	output_p - pointer to string to put it in
+ *		value - number to write
+ * out:	pointer past the written number
+ */
+static char *putnumber(char *output_p, unsigned value)
+{
+	char	digits[12], *digit_p = &digits[sizeof(digits)];
+
+	do {
+		*(-- digit_p) = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	while (digit_p < &digits[sizeof(digits)]) {
+		*(output_p ++) = *(digit_p ++);
+	}
+
+	return output_p;
+}
+
+/* buildfragtabs
+ * - builds the fragment tables for all BASIC versions
+ * in:	none
+ * out:	none
+ */
+static void buildfragtabs(void)
+{
+	int mode, strict;
+
+	for (mode = Any; mode <= VicSuper; mode ++) {
+		for (strict = 0; strict <= 1; strict ++) {
+			fragtabs[mode][strict] = buildfragtab(mode, strict);
+		}
+	}
+}
+
+/* runlength
+ * - counts the bytes that repeat the byte at a position. With SSE2,
+ *   sixteen bytes are compared at a time
+ * in:	ch_p - pointer to first byte of run
+ *		end_p - end of line
+ * out:	number of bytes in run
+ */
+static unsigned runlength(const unsigned char *ch_p,
+                          const unsigned char *end_p)
+{
+	const unsigned char	*run_p = ch_p + 1;
+#ifdef USESSE2
+	__m128i				byte;
+	unsigned			mask;
+
+	byte = _mm_set1_epi8((char) *ch_p);
+	while (end_p - run_p >= 16) {
+		mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(
+		           _mm_loadu_si128((const __m128i *) run_p), byte)) & 0xFFFF;
+		if (mask) {
+			/* The run ends at the first byte that differs */
+			while (!(mask & 1)) {
+				mask >>= 1;
+				run_p ++;
+			}
+			return run_p - ch_p;
+		}
+		run_p += 16;
+	}
+#endif
+
+	while (run_p < end_p && *run_p == *ch_p) run_p ++;
+	return run_p - ch_p;
+}
+
+/* initdetokenize
+ * - builds the fragment tables once, so that detokenize only reads shared
+ *   data and can be called from several threads
+ * in:	none
+ * out:	none
+ */
+void initdetokenize(void)
+{
+#ifdef __EMX__
+	if (!fragtabs[Any][0])	buildfragtabs();
+#else
+	pthread_once(&fragonce, buildfragtabs);
+#endif
+}
+
 /* detokenize
  * - detokenize a C64/C128 BASIC (in binary) line
- * in:	input_p - pointer to a bytestream to detokenize
+ * in:	ctx_p - context to collect statistics in, may be NULL
+ *		input_p - pointer to a bytestream to detokenize
  *		output_p - pointer to a string to put results in, MUST BE ALLOCATED
  *      mode - BASIC version to detokenize
  *		strict - flag for using strict tok64 compatibility
  * out:	nonzero on error
  */
-int detokenize(const char *input_p, char *output_p, basic_t mode, int strict)
+int detokenize(context_t *ctx_p, const char *input_p, char *output_p,
+               basic_t mode, int strict)
 {
 	int	quotemode = FALSE;		/* flag for quote mode */
 	unsigned short i;			/* loop counter */
 	unsigned linenumber;		/* line number */
 	int rc = 0;					/* return code */
-	int isspecial;				/* flag for special characters */
 	const unsigned char *ch_p;	/* pointer moving over input */
-	const char *escape_p;		/* pointer to current escape sequence */
-	char numeric[4];			/* threedigit numeric escape for strict tok64
-								   compatibility */
+	const unsigned char *end_p;	/* end of input */
+	const fragtab_t *tab_p;		/* texts to write */
+	const fragment_t *frag_p;	/* text for current character */
+	const fragment_t *prefixed_p;	/* text for prefixed token */
+	int prefix;					/* 1/2 for CE/FE prefixed token, 0 for
+								   none */
+	int table;					/* token table to count token in */
+	stats_t *stats_p = ctx_p ? ctx_p->stats_p : NULL;	/* statistics */
+
+	/* Get the texts for this BASIC version */
+	initdetokenize();
+	tab_p = fragtabs[mode][strict ? 1 : 0];
 
-	ch_p = input_p;
+	ch_p = (const unsigned char *) input_p;
 
 	/* First two bytes is the line number as (low,high) */
 	linenumber = (*ch_p) | (*(ch_p + 1)) << 8;
 	ch_p += 2;
 	
 	/* print it to the output string, and move the character pointer beyond */
-	output_p += sprintf(output_p, "%u ", linenumber);
+	output_p = putnumber(output_p, linenumber);
+	*(output_p ++) = ' ';
 
 	/* Next comes a bytestream of line data, ending in a null character */
+	end_p = ch_p + strlen((const char *) ch_p);
 	while (*ch_p) {
-		/* Point to PETSCII sequence */
-		escape_p = petscii[*ch_p];
-		if (strict && nontok64compatible(*ch_p)) {
-			/* Maintain tok64 compatibility */
-			sprintf(numeric, "%03d", (int) *ch_p);
-			escape_p = numeric;
-		}
-
 		/* Process token */
 		if (quotemode) {		/* quoted string? */
-			/* Convert from PETSCII to ASCII,
-			 * and write repetitions as a multiple of the character.
-			 * Repetitions of non-special characters is only written if
-			 * there are three or more repetitions.
-			 * Repetitions of * is not written ({**n} is not parsed correctly)
-			 * Repetitions of " is not written (quotemode on/off)
-			 */
+			frag_p = &tab_p->quoted[*ch_p];
 			if (34 == *ch_p) {		/* quote */
-				*(output_p ++) = '\"';
 				quotemode = FALSE;	/* go out of quotemode */
 			} /* if */
-			else if (42 == *ch_p) {	/* asterisk */
-				*(output_p ++) = '*';
-			} /* else */
-			else {
-				/* Check for special token (escape is multibyte) */
-				if (escape_p[1] == 0) {
-					isspecial = FALSE;
-				} /* if */
-				else {
-					isspecial = TRUE;
-				} /* else */
-
-				/* Check repetition if:
-				 *  current and next character match
-				 *  AND (at least) one of the following:
-				 *    <this is a special character OR space>
-				 *    OR current and third character match
-				 *  AND (at least) one of the following:
-				 *    we are not in tok64 strict compatibility mode
-				 *    OR the character is space
-				 *    OR the escape code is not a single character
-				 */
-				if (*ch_p == ch_p[1] &&
-				    ((isspecial || 32 == *ch_p) ||
-				     *ch_p == ch_p[2]) &&
-				    (!strict || 32 == *ch_p || strlen(escape_p) > 1)) {
-					/* Count repetitions */
-					i = 2;
-					while (ch_p[i] == *ch_p) i ++;
-
-					/* We know the repetition number, now print it */
-					if (32 == *ch_p) {	/* space */
-						output_p += sprintf(output_p, "{space*%hd}", i);
-					} /* if */
-					else {
-						output_p += sprintf(output_p, "{%s*%hd}", escape_p, i);
-					} /* else */
-
-					ch_p += i - 1;	/* point to last repetition */
+			else if (frag_p->extra && *ch_p == ch_p[1]) {
+				/* Count repetitions */
+				i = runlength(ch_p, end_p);
+
+				/* Write it as repetition if there are enough */
+				if (i >= frag_p->extra) {
+					frag_p = &tab_p->repeat[*ch_p];
+					memcpy(output_p, &tab_p->pool[frag_p->offset],
+					       frag_p->length);
+					output_p = putnumber(output_p + frag_p->length, i);
+					*(output_p ++) = '}';
+					if (stats_p)	stats_p->escapes ++;
+
+					ch_p += i;	/* point past last repetition */
+					continue;
 				} /* if */
-				else {	/* not repetition */
-					if (isspecial) {
-						output_p += sprintf(output_p, "{%s}", escape_p);
-					} /* if */
-					else {	/* normal character */
-						*(output_p ++) = *escape_p;
-					} /* else */
-				} /* else */
 			} /* else */
 		} /* if */
 		else {					/* command mode */
-			if (*ch_p >= 128 && *ch_p <= 254) {	/* Probable BASIC command */
-				if ((unsigned char) *ch_p <= 203) {
-					/* C64 BASIC 2.0 */
-					output_p += sprintf(output_p, "%s",
-					                    c64tokens[*ch_p - 128]);
-				} /* if */
-				else if (*ch_p == 0xCE &&
-				         (*(ch_p + 1) >= 2 && *(ch_p + 1) <= 0xA) &&
-				         (Basic7 == mode || Basic71 == mode)) {
-					/* C128 BASIC 7.0 CE prefix */
-					ch_p ++;
-					output_p += sprintf(output_p, "%s",
-					                    c128CEtokens[*ch_p]);
-				} /* else */
-				else if (*ch_p == 0xFE && *(ch_p + 1) >= 2 &&
-				         ((*(ch_p + 1) <= 0x26 && Basic7 == mode) ||
-				          (*(ch_p + 1) <= 0x37 && Basic71 == mode))) {
-					/* C128 BASIC 7.0/7.1 FE prefix */
+			frag_p = &tab_p->command[*ch_p];
+			prefix = 0;
+			if (frag_p->extra) {
+				/* C128 BASIC 7.0/7.1 CE/FE prefix */
+				prefixed_p = &tab_p->prefixed[frag_p->extra - 1][ch_p[1]];
+				if (prefixed_p->extra) {
+					prefix = frag_p->extra;
+					frag_p = prefixed_p;
 					ch_p ++;
-					output_p += sprintf(output_p, "%s",
-					                    c128FEtokens[*ch_p]);
-				} /* else */
-				else if (Basic7 == mode || Basic71 == mode) {
-					/* C128 BASIC 7.0 */
-					output_p += sprintf(output_p, "%s",
-					                    c128tokens[*ch_p - 204]);
-				} /* else */
-				else if (Graphics52 == mode) {
-					/* C64 Graphics52 */
-					output_p += sprintf(output_p, "%s",
-					                    graphics52tokens[*ch_p - 204]);
-				} /* else */
-				else if (*ch_p <= 232 && TFC3 == mode) {
-					/* C64 TFC3 */
-					output_p += sprintf(output_p, "%s",
-					                    tfc3tokens[*ch_p - 204]);
-				} /* else */
-				else {
-					/* Errorneous token */
-					output_p += sprintf(output_p, "{%d}", *ch_p);
-				}
-				
-			} /* if */
-			else {				/* text */
-				/* PETSCII text in BASIC:
-				 * The only possible case of text is unshifted. To increase
-				 * readability, this is written as lowercase ASCII, whereas
-				 * keywords are written as uppercase.
-				 * There can also be special characters (32-64), they are
-				 * printed as-is.
-				 */
-				if ((*ch_p >= 32 && *ch_p <= 64) ||	/* ' ' - '@', */
-				    91 == *ch_p || 93 == *ch_p) {		/* '[', ']' */
-					*(output_p ++) = *ch_p;
-					if (34 == *ch_p) {
-						quotemode = TRUE;		/* go to quotemode */
-					} /* if */
 				} /* if */
-				else if (*ch_p >= 65 && *ch_p <= 90) {	/* 'A' - 'Z' */
-					*(output_p ++) = tolower(*ch_p);
-				} /* else */
-				else {	/* Possibly illegal character, write petscii escape */
-					output_p += sprintf(output_p, "{%s}", escape_p);
-				} /* else */
+			} /* if */
+			else if (34 == *ch_p) {
+				quotemode = TRUE;		/* go to quotemode */
 			} /* else */
+
+			if (stats_p && (prefix || *ch_p >= 0x80)) {
+				table = tab_p->tables[prefix][*ch_p];
+				if (table >= 0)	stats_p->tokens[table] ++;
+			} /* if */
 		} /* else */
 
+		if (stats_p && frag_p->length > 1 &&
+		    '{' == tab_p->pool[frag_p->offset]) {
+			stats_p->escapes ++;
+		} /* if */
+
+		memcpy(output_p, &tab_p->pool[frag_p->offset], frag_p->length);
+		output_p += frag_p->length;
+
 		ch_p ++;				/* next character */
 	} /* while */
 
 	*output_p = 0;
 
 	return rc;
-}
\ No newline at end of file
+}
@@ -0,0 +1,203 @@
+/* image.c
+ * - routines for reading whole files into memory, and replacing them
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef __EMX__
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+#endif
+
+#include "image.h"
+
+#define FALSE 0
+#define TRUE 1
+
+/* readimage
+ * - reads a whole file into allocated memory
+ * in:	input - open file, positioned at start
+ *		image_p - pointer to image to fill in
+ * out:	zero if ok, nonzero on error
+ */
+static int readimage(FILE *input, image_t *image_p)
+{
+	unsigned char	*data_p = NULL, *new_p;
+	size_t			size = 0, length = 0, got;
+
+	/* Read in large chunks, growing the buffer as needed */
+	do {
+		if (length == size) {
+			size = size ? size * 2 : 65536;
+			new_p = realloc(data_p, size);
+			if (!new_p) {
+				free(data_p);
+				return 1;
+			}
+			data_p = new_p;
+		}
+		got = fread(data_p + length, 1, size - length, input);
+		length += got;
+	} while (got);
+
+	if (ferror(input)) {
+		free(data_p);
+		return 1;
+	}
+
+	image_p->data_p = data_p;
+	image_p->length = length;
+	image_p->mapped = FALSE;
+	return 0;
+}
+
+/* loadimage
+ * - loads a whole file into memory, by mapping it if possible
+ * in:	filename - name of file to load
+ *		image_p - pointer to image to fill in
+ * out:	zero if ok, nonzero on error
+ */
+int loadimage(const char *filename, image_t *image_p)
+{
+	FILE	*input;
+	int		rc;
+
+#ifndef __EMX__
+	int			fd;
+	struct stat	st;
+	void		*data_p;
+
+	/* Map the file read-only, the kernel reads it ahead sequentially */
+	fd = open(filename, O_RDONLY);
+	if (-1 == fd) {
+		return 1;
+	}
+	if (0 == fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+		data_p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (MAP_FAILED != data_p) {
+# ifdef MADV_SEQUENTIAL
+			madvise(data_p, st.st_size, MADV_SEQUENTIAL);
+# endif
+			close(fd);
+			image_p->data_p = data_p;
+			image_p->length = st.st_size;
+			image_p->mapped = TRUE;
+			return 0;
+		}
+	}
+
+	/* Could not map it (empty file, pipe, ...), read it instead */
+	input = fdopen(fd, "rb");
+	if (!input) {
+		close(fd);
+		return 1;
+	}
+#else
+	input = fopen(filename, "rb");
+	if (!input) {
+		return 1;
+	}
+#endif
+
+	rc = readimage(input, image_p);
+	fclose(input);
+	return rc;
+}
+
+/* freeimage
+ * - releases the memory of a file image
+ * in:	image_p - pointer to image
+ * out:	none
+ */
+void freeimage(image_t *image_p)
+{
+#ifndef __EMX__
+	if (image_p->mapped) {
+		munmap((void *) image_p->data_p, image_p->length);
+	}
+	else
+#endif
+	{
+		free((void *) image_p->data_p);
+	}
+
+	image_p->data_p = NULL;
+	image_p->length = 0;
+}
+
+/* readfilemode
+ * - finds the mode fopen gives new files. The umask can only be read by
+ *   setting it, so this must be called before any threads are started
+ * in:	none
+ * out:	file mode for saveimage
+ */
+int readfilemode(void)
+{
+#ifdef __EMX__
+	return 0666;
+#else
+	mode_t	mask;
+
+	mask = umask(0);
+	umask(mask);
+	return 0666 & ~mask;
+#endif
+}
+
+/* saveimage
+ * - replaces a whole file, writing it under a temporary name and renaming
+ *   it when complete, so that it is never seen half written
+ * in:	filename - name of file to write
+ *		data_p - file contents
+ *		length - file length
+ *		mode - file mode, from readfilemode
+ * out:	zero if ok, nonzero on error
+ */
+int saveimage(const char *filename, const void *data_p, size_t length,
+              int mode)
+{
+	FILE	*output;
+	char	*tempname;
+	int		ok = FALSE;
+
+	tempname = malloc(strlen(filename) + 8);
+	if (!tempname)	return 1;
+
+#ifdef __EMX__
+	sprintf(tempname, "%s.tmp", filename);
+	output = fopen(tempname, "wb");
+#else
+	{
+		int	fd;
+
+		/* mkstemp creates the file for the owner only, it is given the
+		 * mode other output files get
+		 */
+		sprintf(tempname, "%s.XXXXXX", filename);
+		fd = mkstemp(tempname);
+		if (fd >= 0)	fchmod(fd, (mode_t) mode);
+		output = (fd < 0) ? NULL : fdopen(fd, "wb");
+		if (fd >= 0 && !output)	close(fd);
+	}
+#endif
+	if (output) {
+		ok = (0 == length || 1 == fwrite(data_p, length, 1, output));
+		ok = (0 == fclose(output)) && ok;
+#ifdef __EMX__
+		if (ok)	remove(filename);
+#endif
+		if (!ok || rename(tempname, filename)) {
+			remove(tempname);
+			ok = FALSE;
+		}
+	}
+
+	free(tempname);
+	return !ok;
+}
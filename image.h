@@ -0,0 +1,23 @@
+/* image.h
+ * $Id$
+ */
+
+#ifndef __IMAGE_H
+#define __IMAGE_H
+
+#include <stddef.h>
+
+/* File image, the contents of a whole file in memory */
+typedef struct image_s {
+	const unsigned char	*data_p;	/* file contents */
+	size_t				length;		/* file length */
+	int					mapped;		/* flag for memory mapped file */
+} image_t;
+
+int loadimage(const char *filename, image_t *image_p);
+void freeimage(image_t *image_p);
+int readfilemode(void);
+int saveimage(const char *filename, const void *data_p, size_t length,
+              int mode);
+
+#endif
@@ -4,6 +4,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "inmode.h"
@@ -11,31 +12,83 @@
 #include "version.h"
 #include "select.h"
 #include "t64.h"
+#include "image.h"
+#include "membuf.h"
+#include "context.h"
+#include "jobs.h"
+#include "cache.h"
 
 #define FALSE 0
 #define TRUE 1
 
-void inconvert(FILE *, FILE *, const char *, int, int, int);
+/* Largest possible BASIC program, following the start address */
+#define MAXPROGRAM 0x10000
+
+int inconvert(context_t *, const unsigned char *, size_t, const char *, int,
+              membuf_t *);
+
+/* getword
+ * - reads a (low,high) word from a memory image, giving the same result as
+ *   two fgetc calls would
+ * in:	data_p - pointer to image
+ *		length - length of image
+ *		pos - position to read from
+ * out:	word read
+ */
+static int getword(const unsigned char *data_p, size_t length, size_t pos)
+{
+	int	low, high;
+
+	low  = (pos < length)     ? data_p[pos]     : EOF;
+	high = (pos + 1 < length) ? data_p[pos + 1] : EOF;
+	return low | (high << 8);
+}
+
+/* prg2txt
+ * - converts a binary file image into text
+ * in:	ctx_p - conversion context
+ *		image_p - file image, starting with the start address
+ *		length - length of file image
+ *		title - program title to print in header
+ *		output - buffer to write the text to
+ * out:	zero if the file was converted
+ */
+int prg2txt(context_t *ctx_p, const unsigned char *image_p, size_t length,
+            const char *title, membuf_t *output)
+{
+	int	adr;
+
+	/* First read the start address */
+	adr = getword(image_p, length, 0);
+
+	/* Now convert the file to text */
+	if (length > 2) {
+		return inconvert(ctx_p, image_p + 2, length - 2, title, adr, output);
+	}
+	return inconvert(ctx_p, NULL, 0, title, adr, output);
+}
 
 /* bas2txt
  * - converts a binary file into a text file
- * in:	infile - file name of file to read
- *		allfiles - flag whether or not to convert "non-BASIC" files
- *		strict - flag for using strict tok64 compatibility
- * out:	none
+ * in:	ctx_p - conversion context
+ *		infile - file name of file to read
+ *		output - buffer to write the text to
+ * out:	zero if the file could be read
  */
-void bas2txt(const char *infile, FILE *output, int allfiles, int strict)
+int bas2txt(context_t *ctx_p, const char *infile, membuf_t *output)
 {
-	FILE		*input;
+	image_t		input;
 	const char	*title_p;
-	int			adr;
+	double		start;
 
-	/* First, open input file */
-	input = fopen(infile, "rb");
-	if (!input) {
-		fprintf(stderr, "Unable to open input file: %s\n", infile);
-		exit(1);
+	/* First, load the input file */
+	start = starttimer(ctx_p->stats_p);
+	if (loadimage(infile, &input)) {
+		reporterror(ctx_p, "Unable to open input file: %s\n", infile);
+		return 1;
 	}
+	stoptimer(ctx_p->stats_p, ReadPhase, start);
+	if (ctx_p->stats_p)	ctx_p->stats_p->bytesin += input.length;
 
 	/* Name to print in header is the last part of the file name */
 #ifdef __EMX__
@@ -50,120 +103,631 @@ void bas2txt(const char *infile, FILE *output, int allfiles, int strict)
 		title_p = infile;
 	}
 
-	/* First read the start address */
-	adr = fgetc(input);			/* low byte */
-	adr |= fgetc(input) << 8;	/* high byte */
+	/* Convert it */
+	prg2txt(ctx_p, input.data_p, input.length, title_p, output);
+
+	/* Release the file */
+	freeimage(&input);
+	return 0;
+}
+
+/* Program data of a T64 directory entry */
+typedef struct t64entry_s {
+	unsigned int		index;		/* directory index */
+	long				offset;		/* start of data in file */
+	long				end;		/* end of data to read */
+	const unsigned char	*data_p;	/* data read */
+} t64entry_t;
+
+/* compareoffset
+ * - qsort comparison function, orders T64 entries by file offset
+ */
+static int compareoffset(const void *a_p, const void *b_p)
+{
+	const t64entry_t	*a = a_p, *b = b_p;
+
+	if (a->offset != b->offset) {
+		return (a->offset < b->offset) ? -1 : 1;
+	}
+	return (a->index < b->index) ? -1 : (a->index > b->index);
+}
+
+/* Conversion of a T64 entry, may run on a worker thread */
+typedef struct entryjob_s {
+	context_t	ctx;			/* messages and statistics of the entry */
+	stats_t		stats;
+	membuf_t	text;			/* the listing */
+} entryjob_t;
+
+/* Conversion of the entries of a T64 archive, shared by the entries */
+typedef struct t64run_s {
+	context_t			*ctx_p;
+	const t64record_t	*records_p;		/* directory */
+	t64entry_t			**byindex_pp;	/* data of each directory entry */
+	const unsigned int	*indices_p;		/* directory index of each job */
+	entryjob_t			*jobs_p;
+	membuf_t			*output;
+} t64run_t;
+
+/* convertentry
+ * - converts a T64 entry into text, may run on a worker thread
+ * in:	job - index of entry to convert, among the program entries
+ *		run_p - T64 conversion
+ * out:	none
+ */
+static void convertentry(int job, void *run_p)
+{
+	t64run_t			*r = run_p;
+	entryjob_t			*job_p = &r->jobs_p[job];
+	const t64record_t	*record_p = &r->records_p[r->indices_p[job]];
+	const t64entry_t	*entry_p = r->byindex_pp[r->indices_p[job]];
+	char				title[21], *c_p;
+	int					adr;
+
+	/* This is an allocated entry, with a normal program file in it */
+
+	/* Get the file title */
+	strncpy(title, record_p->filename, 16);
+	title[16] = 0;		/* null terminate */
+
+	while ((char) 32 == title[strlen(title) - 1] ||
+	       (char) 160 == title[strlen(title) - 1]) {
+		/* Remove trailing spaces */
+		title[strlen(title) - 1] = 0;
+	}
+
+	/* Convert to uppercase ASCII, and change spaces to underscores */
+	c_p = title;
+	while (*c_p) {
+		*c_p &= 0x7F;			/* Strip highbit */
+		if (0x60 == (*c_p & 0x60)) {
+			*c_p &= ~0x20;		/* Lowercase => uppercase */
+		}
+		else if (' ' == *c_p) {
+			*c_p = '_';
+		}
+		c_p ++;
+	}
+
+	/* Add .prg suffix */
+	strcat(title, ".prg");
+
+	/* Retrieve the starting address */
+	adr = record_p->startaddress[0] | (record_p->startaddress[1] << 8);
 
 	/* Now convert the file to text */
-	inconvert(input, output, title_p, adr, allfiles, strict);
+	report(&job_p->ctx, "Converting: %s\n", title);
+	inconvert(&job_p->ctx, entry_p->data_p, entry_p->end - entry_p->offset,
+	          title, adr, &job_p->text);
+}
 
-	/* Close files */
-	fclose(input);
+/* commitentry
+ * - adds a converted T64 entry to the output, in directory order
+ * in:	job - index of converted entry
+ *		run_p - T64 conversion
+ * out:	none
+ */
+static void commitentry(int job, void *run_p)
+{
+	t64run_t	*r = run_p;
+	entryjob_t	*job_p = &r->jobs_p[job];
+
+	mbwrite(r->output, job_p->text.data_p, job_p->text.length);
+	mergecontext(r->ctx_p, &job_p->ctx);
+
+	mbfree(&job_p->text);
+	freecontext(&job_p->ctx);
 }
 
-void t642txt(const char *infile, FILE *output, int allfiles, int strict)
+/* convertentries
+ * - converts the program entries of a T64 archive into text, in
+ *   directory order
+ * in:	ctx_p - conversion context
+ *		records_p - directory
+ *		byindex_pp - data of each directory entry, NULL for entries that
+ *		             are not converted
+ *		usedentries - number of directory entries
+ *		output - buffer to write the text to
+ * out:	none
+ */
+static void convertentries(context_t *ctx_p, const t64record_t *records_p,
+                           t64entry_t **byindex_pp, unsigned int usedentries,
+                           membuf_t *output)
+{
+	unsigned int	*indices_p, numjobs, i;
+	t64run_t		run;
+
+	indices_p = malloc((usedentries ? usedentries : 1) *
+	                   sizeof(unsigned int));
+	if (!indices_p) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	numjobs = 0;
+	for (i = 0; i < usedentries; i ++) {
+		if (byindex_pp[i])	indices_p[numjobs ++] = i;
+	}
+	if (numjobs) {
+		run.ctx_p = ctx_p;
+		run.records_p = records_p;
+		run.byindex_pp = byindex_pp;
+		run.indices_p = indices_p;
+		run.output = output;
+		run.jobs_p = malloc(numjobs * sizeof(entryjob_t));
+		if (!run.jobs_p) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+
+		/* The threads go to the entries if there are several of them,
+		 * otherwise to the lines of the entry
+		 */
+		for (i = 0; i < numjobs; i ++) {
+			forkcontext(&run.jobs_p[i].ctx, ctx_p, &run.jobs_p[i].stats);
+			if (numjobs > 1)	run.jobs_p[i].ctx.threads = 1;
+			mbinit(&run.jobs_p[i].text);
+		}
+
+		runjobs(numjobs, (numjobs > 1) ? ctx_p->threads : 1, convertentry,
+		        commitentry, &run);
+
+		free(run.jobs_p);
+	}
+
+	free(indices_p);
+}
+
+/* t642txt
+ * - converts the programs in a T64 archive into text
+ * in:	ctx_p - conversion context
+ *		infile - file name of archive to read
+ *		output - buffer to write the text to
+ * out:	zero if the archive could be read
+ */
+int t642txt(context_t *ctx_p, const char *infile, membuf_t *output)
 {
 	FILE			*input;
-	char			title[21], *c_p;
 	t64header_t		header;
-	t64record_t		record;
-	unsigned int	totalentries, usedentries, i;
+	t64record_t		*records_p;
+	t64entry_t		*entries_p, **byindex_pp;
+	unsigned char	**extents_pp;
+	unsigned int	totalentries, usedentries, numentries, numextents;
+	unsigned int	i, j;
 	int				adr;
-	long			fptr;
+	long			filesize, start, end;
+	size_t			length;
+	int				rc = 0;
+	double			timer;
 
 	/* First, open input file */
+	timer = starttimer(ctx_p->stats_p);
 	input = fopen(infile, "rb");
 	if (!input) {
-		fprintf(stderr, "Unable to open input file: %s\n", infile);
-		exit(1);
+		reporterror(ctx_p, "Unable to open input file: %s\n", infile);
+		return 1;
 	}
 
 	/* Read the T64 header */
 	fread(&header, sizeof(header), 1, input);
 
 	/* Check that it is a T64 file */
-	if (checkvalidheader(&header, &totalentries, &usedentries, infile)) {
+	if (checkvalidheader(ctx_p, &header, &totalentries, &usedentries,
+	                     infile)) {
 		/* It wasn't -> panic */
-		exit(1);
+		fclose(input);
+		return 1;
 	}
 
-	/* Cycle through the entries */
+	/* Read the whole directory */
+	records_p = readdirectory(ctx_p, input, usedentries, infile);
+	fseek(input, 0, SEEK_END);
+	filesize = ftell(input);
+
+	entries_p = malloc((usedentries ? usedentries : 1) * sizeof(t64entry_t));
+	byindex_pp = calloc(usedentries ? usedentries : 1, sizeof(t64entry_t *));
+	extents_pp = malloc((usedentries ? usedentries : 1) *
+	                    sizeof(unsigned char *));
+	if (!records_p || !entries_p || !byindex_pp || !extents_pp) {
+		if (records_p)	reporterror(ctx_p, "Out of memory\n");
+		free(extents_pp);
+		free(byindex_pp);
+		free(entries_p);
+		free(records_p);
+		fclose(input);
+		return 1;
+	}
+
+	/* Collect the entries with normal program files in them, each needs
+	 * as much data as the program can use (up to the top of memory), or up
+	 * to end of file
+	 */
+	numentries = 0;
 	for (i = 0; i < usedentries; i ++) {
-		/* Seek to the directory entry and read it */
-		fseek(input, sizeof(t64header_t) + sizeof(t64record_t) * i, SEEK_SET);
-		fread(&record, sizeof(t64record_t), 1, input);
-
-		/* Check filetype */
-		if (ALLOC_NORM == record.allocflag) {
-			/* This is an allocated entry, with a normal program file in it */
-
-			/* Get the file title */
-			strncpy(title, record.filename, 16);
-			title[16] = 0;		/* null terminate */
-
-			while ((char) 32 == title[strlen(title) - 1] ||
-			       (char) 160 == title[strlen(title) - 1]) {
-				/* Remove trailing spaces */
-				title[strlen(title) - 1] = 0;
+		if (ALLOC_NORM == records_p[i].allocflag) {
+			adr = records_p[i].startaddress[0] |
+			      (records_p[i].startaddress[1] << 8);
+			entries_p[numentries].index = i;
+			entries_p[numentries].offset = recordoffset(&records_p[i]);
+			entries_p[numentries].end = entries_p[numentries].offset +
+			                            MAXPROGRAM - adr;
+			if (entries_p[numentries].end > filesize) {
+				entries_p[numentries].end = filesize;
 			}
+			numentries ++;
+		}
+	}
 
-			/* Convert to uppercase ASCII, and change spaces to underscores */
-			c_p = title;
-			while (*c_p) {
-				*c_p &= 0x7F;			/* Strip highbit */
-				if (0x60 == (*c_p & 0x60)) {
-					*c_p &= ~0x20;		/* Lowercase => uppercase */
-				}
-				else if (' ' == *c_p) {
-					*c_p = '_';
-				}
-				c_p ++;
-			}
+	/* Read the data in file order, in as few contiguous extents as
+	 * possible
+	 */
+	qsort(entries_p, numentries, sizeof(t64entry_t), compareoffset);
+	numextents = 0;
+	for (i = 0; i < numentries; i = j) {
+		/* Find the entries that overlap this extent */
+		start = entries_p[i].offset;
+		end = entries_p[i].end;
+		for (j = i + 1; j < numentries && entries_p[j].offset <= end; j ++) {
+			if (entries_p[j].end > end)	end = entries_p[j].end;
+		}
 
-			/* Add .prg suffix */
-			strcat(title, ".prg");
+		/* Read it */
+		extents_pp[numextents] = NULL;
+		if (start < end) {
+			extents_pp[numextents] = malloc(end - start);
+			if (!extents_pp[numextents]) {
+				reporterror(ctx_p, "Out of memory\n");
+				rc = 1;
+				break;
+			}
+			fseek(input, start, SEEK_SET);
+			length = fread(extents_pp[numextents], 1, end - start, input);
+			end = start + length;
+		}
 
-			/* Retrieve the starting address */
-			adr = record.startaddress[0] | (record.startaddress[1] << 8);
+		/* Point the entries to their data */
+		for (; i < j; i ++) {
+			entries_p[i].data_p = extents_pp[numextents] +
+			                      (entries_p[i].offset - start);
+			if (entries_p[i].end > end)		entries_p[i].end = end;
+			if (entries_p[i].end < entries_p[i].offset) {
+				entries_p[i].end = entries_p[i].offset;
+			}
+			byindex_pp[entries_p[i].index] = &entries_p[i];
+		}
+		numextents ++;
+	}
 
-			/* Position file pointer to the start of data */
-			fptr = (record.offset[0]      ) | (record.offset[1] << 8 ) |
-			       (record.offset[2] << 16) | (record.offset[3] << 24);
-			fseek(input, fptr, SEEK_SET);
+	stoptimer(ctx_p->stats_p, ReadPhase, timer);
+	if (ctx_p->stats_p)	ctx_p->stats_p->bytesin += filesize;
 
-			/* Now convert the file to text */
-			fprintf(stderr, "Converting: %s\n", title);
-			inconvert(input, output, title, adr, allfiles, strict);
-		}
+	/* Convert the entries, adding them to the output in directory order */
+	if (!rc) {
+		convertentries(ctx_p, records_p, byindex_pp, usedentries, output);
 	}
 
 	/* Close files */
+	for (i = 0; i < numextents; i ++) {
+		free(extents_pp[i]);
+	}
+	free(extents_pp);
+	free(byindex_pp);
+	free(entries_p);
+	free(records_p);
 	fclose(input);
+	return rc;
 }
 
-/* inconvert
+/* t64img2txt
+ * - converts the programs in a T64 archive image into text
+ * in:	ctx_p - conversion context
+ *		image_p - archive image
+ *		length - length of archive image
+ *		title - name of archive, for error messages
+ *		output - buffer to write the text to
+ * out:	zero if the image is a T64 archive
+ */
+int t64img2txt(context_t *ctx_p, const unsigned char *image_p, size_t length,
+               const char *title, membuf_t *output)
+{
+	t64header_t		header;
+	t64record_t		*records_p;
+	t64entry_t		*entries_p, **byindex_pp;
+	unsigned int	totalentries, usedentries, numentries, i;
+	size_t			available;
+	int				adr;
+
+	if (ctx_p->stats_p)	ctx_p->stats_p->bytesin += length;
+
+	/* Check the header, as much of it as there is */
+	memset(&header, 0, sizeof(header));
+	memcpy(&header, image_p, length < sizeof(header) ? length
+	                                                 : sizeof(header));
+	if (checkvalidheader(ctx_p, &header, &totalentries, &usedentries,
+	                     title)) {
+		return 1;
+	}
+
+	/* Copy the directory, records missing from a truncated image are
+	 * free
+	 */
+	records_p = calloc(usedentries ? usedentries : 1, sizeof(t64record_t));
+	entries_p = malloc((usedentries ? usedentries : 1) * sizeof(t64entry_t));
+	byindex_pp = calloc(usedentries ? usedentries : 1, sizeof(t64entry_t *));
+	if (!records_p || !entries_p || !byindex_pp) {
+		reporterror(ctx_p, "Out of memory\n");
+		free(byindex_pp);
+		free(entries_p);
+		free(records_p);
+		return 1;
+	}
+	available = (length > sizeof(header)) ? length - sizeof(header) : 0;
+	if (available > usedentries * sizeof(t64record_t)) {
+		available = usedentries * sizeof(t64record_t);
+	}
+	memcpy(records_p, image_p + sizeof(header), available);
+
+	/* Point the program entries into the image, each gets as much data as
+	 * the program can use (up to the top of memory), or up to the end of
+	 * the image
+	 */
+	numentries = 0;
+	for (i = 0; i < usedentries; i ++) {
+		if (ALLOC_NORM == records_p[i].allocflag) {
+			adr = records_p[i].startaddress[0] |
+			      (records_p[i].startaddress[1] << 8);
+			entries_p[numentries].index = i;
+			entries_p[numentries].offset = recordoffset(&records_p[i]);
+			if ((unsigned long) entries_p[numentries].offset > length) {
+				entries_p[numentries].offset = length;
+			}
+			entries_p[numentries].end = entries_p[numentries].offset +
+			                            MAXPROGRAM - adr;
+			if ((unsigned long) entries_p[numentries].end > length) {
+				entries_p[numentries].end = length;
+			}
+			entries_p[numentries].data_p = image_p +
+			                               entries_p[numentries].offset;
+			byindex_pp[i] = &entries_p[numentries];
+			numentries ++;
+		}
+	}
+
+	convertentries(ctx_p, records_p, byindex_pp, usedentries, output);
+
+	free(byindex_pp);
+	free(entries_p);
+	free(records_p);
+	return 0;
+}
+
+/* detokenizeline
+ * - detokenizes a program line onto the end of a listing
+ * in:	ctx_p - conversion context
+ *		prg_p - pointer to BASIC program, following the start address
+ *		length - length of BASIC program
+ *		pos - position of the line in the program
+ *		size - size of the line, from its next-line pointer
+ *		mode - BASIC version to detokenize
+ *		strict - flag for strict tok64 compatibility
+ *		output - buffer to write to
+ * out:	none
+ */
+static void detokenizeline(context_t *ctx_p, const unsigned char *prg_p,
+                           size_t length, size_t pos, int size,
+                           basic_t mode, int strict, membuf_t *output)
+{
+	char				buf[256], text[4096];
+	const unsigned char	*line_p;
+	int					linelength;
+	stats_t				*stats_p = ctx_p->stats_p;
+	double				start;
+
+	/* The line is detokenized where it is, unless it lacks the
+	 * terminating null or is cut short by the end of the file,
+	 * then a terminated copy of what there is is used
+	 */
+	line_p = prg_p + pos + 2;
+	linelength = size - 2;
+	if (pos + 2 + linelength > length) {
+		linelength = (pos + 2 < length) ? length - pos - 2 : 0;
+	}
+	if (linelength != size - 2 || linelength < 3 ||
+	    !memchr(line_p + 2, 0, linelength - 2)) {
+		memset(buf, 0, sizeof(buf));
+		if (linelength > 0) {
+			memcpy(buf, line_p, linelength);
+		}
+		line_p = (const unsigned char *) buf;
+	}
+
+	/* Convert to text */
+	start = starttimer(stats_p);
+	detokenize(ctx_p, (const char *) line_p, text, mode, strict);
+	stoptimer(stats_p, ConvertPhase, start);
+	if (stats_p)	stats_p->lines ++;
+
+	/* Write to output */
+	mbputs(output, text);
+	mbputc(output, '\n');
+}
+
+/* Line of a program, found by following the next-line pointers */
+typedef struct progline_s {
+	size_t	pos;				/* position in program */
+	int		size;				/* size, from its next-line pointer */
+} progline_t;
+
+/* Batch of lines, detokenized on a worker thread */
+typedef struct batch_s {
+	context_t	ctx;			/* messages and statistics of the batch */
+	stats_t		stats;
+	membuf_t	text;			/* the detokenized lines */
+} batch_t;
+
+/* Parallel detokenization of a program, shared by the batches */
+typedef struct detokenizerun_s {
+	context_t			*ctx_p;
+	const unsigned char	*prg_p;
+	size_t				length;
+	basic_t				mode;
+	int					strict;
+	const progline_t	*lines_p;
+	int					numlines;
+	batch_t				*batches_p;
+	membuf_t			*output;
+} detokenizerun_t;
+
+/* detokenizebatch
+ * - detokenizes a batch of lines, may run on a worker thread
+ * in:	job - index of batch
+ *		run_p - parallel detokenization
+ * out:	none
+ */
+static void detokenizebatch(int job, void *run_p)
+{
+	detokenizerun_t	*r = run_p;
+	batch_t			*batch_p = &r->batches_p[job];
+	int				i;
+
+	for (i = job * BATCHLINES;
+	     i < (job + 1) * BATCHLINES && i < r->numlines; i ++) {
+		detokenizeline(&batch_p->ctx, r->prg_p, r->length, r->lines_p[i].pos,
+		               r->lines_p[i].size, r->mode, r->strict,
+		               &batch_p->text);
+	}
+}
+
+/* commitbatch
+ * - adds a detokenized batch to the listing, in batch order
+ * in:	job - index of batch
+ *		run_p - parallel detokenization
+ * out:	none
+ */
+static void commitbatch(int job, void *run_p)
+{
+	detokenizerun_t	*r = run_p;
+	batch_t			*batch_p = &r->batches_p[job];
+
+	mbwrite(r->output, batch_p->text.data_p, batch_p->text.length);
+	mergecontext(r->ctx_p, &batch_p->ctx);
+
+	mbfree(&batch_p->text);
+	freecontext(&batch_p->ctx);
+}
+
+/* detokenizelines
+ * - detokenizes the lines of a program, in two passes: the first follows
+ *   the next-line pointers to find the lines, the second detokenizes them,
+ *   in batches on worker threads if there are many of them, and adds them
+ *   to the listing in order
+ * in:	ctx_p - conversion context
+ *		prg_p - pointer to BASIC program, following the start address
+ *		length - length of BASIC program
+ *		pos - position of first line
+ *		adr - address of first line
+ *		mode - BASIC version to detokenize
+ *		strict - flag for strict tok64 compatibility
+ *		output - buffer to write to
+ * out:	next-line pointer that ended the program
+ */
+static int detokenizelines(context_t *ctx_p, const unsigned char *prg_p,
+                           size_t length, size_t pos, int adr, basic_t mode,
+                           int strict, membuf_t *output)
+{
+	membuf_t		lines;
+	progline_t		line;
+	detokenizerun_t	run;
+	int				nextadr, i, numbatches;
+
+	/* Find the lines */
+	mbinit(&lines);
+	nextadr = getword(prg_p, length, pos);
+	while (nextadr && nextadr > adr && nextadr - adr < 256) {
+		line.pos = pos;
+		line.size = nextadr - adr;
+		mbwrite(&lines, &line, sizeof(line));
+		pos += nextadr - adr;
+		adr = nextadr;
+
+		/* Read address to next line */
+		nextadr = getword(prg_p, length, pos);
+	}
+
+	run.ctx_p = ctx_p;
+	run.prg_p = prg_p;
+	run.length = length;
+	run.mode = mode;
+	run.strict = strict;
+	run.lines_p = (const progline_t *) lines.data_p;
+	run.numlines = lines.length / sizeof(progline_t);
+	run.output = output;
+
+	if (run.numlines < PARALLELLINES) {
+		/* Too few to be worth it */
+		for (i = 0; i < run.numlines; i ++) {
+			detokenizeline(ctx_p, prg_p, length, run.lines_p[i].pos,
+			               run.lines_p[i].size, mode, strict, output);
+		}
+	}
+	else {
+		numbatches = (run.numlines + BATCHLINES - 1) / BATCHLINES;
+		run.batches_p = malloc(numbatches * sizeof(batch_t));
+		if (!run.batches_p) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		for (i = 0; i < numbatches; i ++) {
+			forkcontext(&run.batches_p[i].ctx, ctx_p,
+			            &run.batches_p[i].stats);
+			mbinit(&run.batches_p[i].text);
+		}
+
+		runjobs(numbatches, ctx_p->threads, detokenizebatch, commitbatch,
+		        &run);
+
+		free(run.batches_p);
+	}
+
+	mbfree(&lines);
+	return nextadr;
+}
+
+/* convertprogram
  * - performs the actual conversion
- * in:	input - open file, positioned at start of BASIC program
- * 		output - open file, to write to
+ * in:	ctx_p - conversion context
+ *		prg_p - pointer to BASIC program, following the start address
+ *		length - length of BASIC program
  *		title - program title to print in header
- *		allfiles - flag whether or not to convert "non-BASIC" files
- * out:	none
+ *		adr - address of BASIC start
+ *		output - buffer to write to
+ * out:	zero if the program was converted
  */
-void inconvert(FILE *input, FILE *output, const char *title, int adr,
-               int allfiles, int strict)
+static int convertprogram(context_t *ctx_p, const unsigned char *prg_p,
+                          size_t length, const char *title, int adr,
+                          membuf_t *output)
 {
-	int		ch, nextadr;
-	char	buf[256], text[512];
-	basic_t	mode;
+	int					nextadr;
+	int					strict = ctx_p->strict;
+	size_t				pos;
+	basic_t				mode;
+	stats_t				*stats_p = ctx_p->stats_p;
 
 	/* Check for valid BASIC file */
-	if (allfiles || 0x0401 == adr || 0x0801 == adr || 0x1c01 == adr ||
+	if (ctx_p->allfiles || 0x0401 == adr || 0x0801 == adr || 0x1c01 == adr ||
 	    0x4001 == adr || 0x132D == adr) {
-		mode = selectbasic(adr);
+		mode = selectbasic(ctx_p, adr);
+		if (ctx_p->detect) {
+			mode = detectbasic(ctx_p, prg_p, length, adr, mode, TRUE);
+		}
 
-		/* Print bastext header if start is != 0x0801 and != 0x1C01 */
-		if (0x0801 != adr && 0x1C01 != adr) {
-			fprintf(output, "\nstart bastext %d", adr);
+		/* Print bastext header if start is != 0x0801 and != 0x1C01, or if
+		 * a C128 program starts at 0x0801 (the tok128 header alone would
+		 * move it to 0x1C01)
+		 */
+		if ((0x0801 != adr && 0x1C01 != adr) ||
+		    (0x0801 == adr && (Basic7 == mode || Basic71 == mode))) {
+			mbprintf(output, "\nstart bastext %d", adr);
 		}
 
 		/* Print tok64 header */
@@ -171,24 +735,25 @@ void inconvert(FILE *input, FILE *output, const char *title, int adr,
 			if (strict) {
 				/* tok64 doesn't handle C128 programs, so skip strict mode */
 				strict = FALSE;
-				fprintf(stderr, "Strict mode ignored for C128 program: %s\n",
-				        title);
+				report(ctx_p, "Strict mode ignored for C128 program: %s\n",
+				       title);
 			}
-			fprintf(output, "\nstart tok128 %s\n", title);
+			mbprintf(output, "\nstart tok128 %s\n", title);
 		}
 		else {
-			fprintf(output, "\nstart tok64 %s\n", title);
+			mbprintf(output, "\nstart tok64 %s\n", title);
 		}
 
 		/* If this is a combined BASIC 7.1 extension + BASIC text,
 		 * skip over the header (0x132D - 0x1C00)
 		 */
+		pos = 0;
 		if (0x132D == adr) {
-			fseek(input, 0x1C01 - 0x132D, SEEK_CUR);
+			pos = 0x1C01 - 0x132D;
 			adr = 0x1C01;
 		}
 
-		/* We suppose this is a valid BASIC file, so start reading it
+		/* We suppose this is a valid BASIC file, so start walking it
 		 * line for line.
 		 * Line format is this:
 		 *  [0-1]- address to next line
@@ -197,45 +762,134 @@ void inconvert(FILE *input, FILE *output, const char *title, int adr,
 		 */
 
 		/* Read address to next line */
-		nextadr = fgetc(input);			/* low byte */
-		nextadr |= fgetc(input) << 8;	/* high byte */
+		nextadr = getword(prg_p, length, pos);
 
 		/* Address to next line is null when the program is ended.
 		 * Address to next line must be higher than the current address.
 		 * The line cannot be longer than 256 bytes
 		 */
-		while (nextadr && nextadr > adr && nextadr - adr < 256) {
-			/* Read the line into the buffer */
-			fread(buf, nextadr - adr - 2, 1, input);
-			adr = nextadr;
-
-			/* Convert to text */
-			detokenize(buf, text, mode, strict);
-
-			/* Write to output */
-			fputs(text, output);
-			fputc('\n', output);
-
-			/* Read address to next line */
-			nextadr = fgetc(input);			/* low byte */
-			nextadr |= fgetc(input) << 8;	/* high byte */
+		if (ctx_p->threads > 1) {
+			nextadr = detokenizelines(ctx_p, prg_p, length, pos, adr, mode,
+			                          strict, output);
+		}
+		else {
+			while (nextadr && nextadr > adr && nextadr - adr < 256) {
+				detokenizeline(ctx_p, prg_p, length, pos, nextadr - adr,
+				               mode, strict, output);
+				pos += nextadr - adr;
+				adr = nextadr;
+
+				/* Read address to next line */
+				nextadr = getword(prg_p, length, pos);
+			}
 		}
-		
+
 		/* If nextadr != null, then the program was invalid */
 		if (nextadr != 0) {
-			fprintf(stderr, "Invalid BASIC file: %s\n", title);
-			fprintf(output, "63999 REM \"Invalid BASIC input %s\n", title);
+			report(ctx_p, "Invalid BASIC file: %s\n", title);
+			mbprintf(output, "63999 REM \"Invalid BASIC input %s\n", title);
+			if (stats_p)	stats_p->errors ++;
 		}
 
 		/* Print tok64 footer */
 		if (Basic7 == mode || Basic71 == mode) {
-			fprintf(output, "stop tok128\n(" PROGNAME ")\n");
+			mbputs(output, "stop tok128\n(" PROGNAME ")\n");
 		}
 		else {
-			fprintf(output, "stop tok64\n(" PROGNAME ")\n");
+			mbputs(output, "stop tok64\n(" PROGNAME ")\n");
 		}
+
+		if (stats_p)	stats_p->programs ++;
 	}
 	else {
-		fprintf(stderr, "Invalid BASIC start address: %04x (%d)\n", adr, adr);
+		report(ctx_p, "Invalid BASIC start address: %04x (%d)\n", adr, adr);
+		return 1;
 	}
-}
\ No newline at end of file
+
+	return 0;
+}
+
+/* programlength
+ * - finds where a program ends, following the next-line pointers the way
+ *   convertprogram does. The conversion reads nothing behind the link that
+ *   ends the walk, so the data after it (the rest of a T64 archive, say)
+ *   need not be part of the program's cache entry
+ * in:	prg_p - pointer to BASIC program, following the start address
+ *		length - length of data following the start address
+ *		adr - address of BASIC start
+ * out:	length of the program, up to and including its end link
+ */
+static size_t programlength(const unsigned char *prg_p, size_t length,
+                            int adr)
+{
+	size_t	pos = 0;
+	int		nextadr;
+
+	/* A BASIC 7.1 extension bound to the program is part of it */
+	if (0x132D == adr) {
+		pos = 0x1C01 - 0x132D;
+		adr = 0x1C01;
+	}
+
+	nextadr = getword(prg_p, length, pos);
+	while (nextadr && nextadr > adr && nextadr - adr < 256) {
+		pos += nextadr - adr;
+		adr = nextadr;
+		nextadr = getword(prg_p, length, pos);
+	}
+
+	return (pos + 2 < length) ? pos + 2 : length;
+}
+
+/* inconvert
+ * - converts a program, or takes its listing from the cache if there is
+ *   one and the program has been converted before
+ * in:	ctx_p - conversion context
+ *		prg_p - pointer to BASIC program, following the start address
+ *		length - length of BASIC program
+ *		title - program title to print in header
+ *		adr - address of BASIC start
+ *		output - buffer to write to
+ * out:	zero if the program was converted
+ */
+int inconvert(context_t *ctx_p, const unsigned char *prg_p, size_t length,
+              const char *title, int adr, membuf_t *output)
+{
+	context_t	child;
+	stats_t		stats;
+	size_t		start = output->length;
+	int			rc;
+	double		timer;
+
+	if (!ctx_p->cachedir) {
+		return convertprogram(ctx_p, prg_p, length, title, adr, output);
+	}
+
+	/* Only the program itself is hashed and stored */
+	length = programlength(prg_p, length, adr);
+
+	/* The messages and statistics of the conversion are kept separately,
+	 * to be stored with the listing
+	 */
+	forkcontext(&child, ctx_p, &stats);
+	child.stats_p = &stats;
+
+	timer = starttimer(&stats);
+	if (0 == loadcached(&child, prg_p, length, title, adr, output, &rc)) {
+		stoptimer(&stats, ReadPhase, timer);
+		stats.cachehits ++;
+	}
+	else {
+		rc = convertprogram(&child, prg_p, length, title, adr, output);
+		timer = starttimer(&stats);
+		storecached(&child, prg_p, length, title, adr,
+		            output->data_p + start, output->length - start, rc);
+		stoptimer(&stats, WritePhase, timer);
+		stats.cachemisses ++;
+	}
+
+	if (!ctx_p->stats_p)	child.stats_p = NULL;
+	mergecontext(ctx_p, &child);
+	freecontext(&child);
+	return rc;
+}
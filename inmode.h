@@ -5,7 +5,14 @@
 #ifndef __INMODE_H
 #define __INMODE_H
 
-void bas2txt(const char *infile, FILE *output, int allfiles, int strict);
-void t642txt(const char *infile, FILE *output, int allfiles, int strict);
+#include "membuf.h"
+#include "context.h"
+
+int prg2txt(context_t *ctx_p, const unsigned char *image_p, size_t length,
+            const char *title, membuf_t *output);
+int bas2txt(context_t *ctx_p, const char *infile, membuf_t *output);
+int t642txt(context_t *ctx_p, const char *infile, membuf_t *output);
+int t64img2txt(context_t *ctx_p, const unsigned char *image_p, size_t length,
+               const char *title, membuf_t *output);
 
 #endif
@@ -0,0 +1,156 @@
+/* jobs.c
+ * - runs numbered jobs on a pool of worker threads, finishing them in order
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#ifndef __EMX__
+# include <pthread.h>
+#endif
+
+#include "jobs.h"
+
+#define FALSE 0
+#define TRUE 1
+
+/* Number of jobs that may be started ahead of the oldest unfinished job,
+ * per thread. Limits the amount of output waiting to be committed
+ */
+#define LOOKAHEAD 4
+
+#ifndef __EMX__
+/* State shared by the worker threads */
+typedef struct pool_s {
+	pthread_mutex_t	lock;
+	pthread_cond_t	changed;		/* signalled when a job is done or
+									   committed */
+	int				numjobs;
+	int				window;			/* number of jobs allowed in progress */
+	int				next;			/* next job to start */
+	int				committed;		/* number of jobs committed */
+	char			*done_p;		/* flag for each job that is done */
+	jobfunc_t		*work_p;
+	void			*arg_p;
+} pool_t;
+
+/* worker
+ * - thread routine, does jobs until there are none left
+ * in:	pool_p - job pool
+ * out:	NULL
+ */
+static void *worker(void *pool_p)
+{
+	pool_t	*p = pool_p;
+	int		job;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		/* Wait until there is a job to do within the window */
+		while (p->next < p->numjobs &&
+		       p->next >= p->committed + p->window) {
+			pthread_cond_wait(&p->changed, &p->lock);
+		}
+		if (p->next >= p->numjobs)	break;
+
+		/* Do it */
+		job = p->next ++;
+		pthread_mutex_unlock(&p->lock);
+		p->work_p(job, p->arg_p);
+		pthread_mutex_lock(&p->lock);
+
+		p->done_p[job] = TRUE;
+		pthread_cond_broadcast(&p->changed);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+#endif
+
+/* runjobs
+ * - runs jobs on worker threads, and commits their results in job order on
+ *   the calling thread
+ * in:	numjobs - number of jobs, numbered from 0
+ *		numthreads - number of worker threads, 1 or less runs the jobs
+ *		             one by one on the calling thread
+ *		work_p - routine that does a job
+ *		commit_p - routine that commits the result of a job
+ *		arg_p - argument for the job routines
+ * out:	none
+ */
+void runjobs(int numjobs, int numthreads, jobfunc_t *work_p,
+             jobfunc_t *commit_p, void *arg_p)
+{
+#ifndef __EMX__
+	pool_t		pool;
+	pthread_t	*threads_p;
+	int			started;
+#endif
+	int			i;
+
+#ifndef __EMX__
+	if (numthreads > numjobs)	numthreads = numjobs;
+	if (numthreads > 1) {
+		pool.numjobs = numjobs;
+		pool.window = numthreads * LOOKAHEAD;
+		pool.next = 0;
+		pool.committed = 0;
+		pool.work_p = work_p;
+		pool.arg_p = arg_p;
+		pool.done_p = calloc(numjobs, 1);
+		threads_p = malloc(numthreads * sizeof(pthread_t));
+		if (!pool.done_p || !threads_p) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		pthread_mutex_init(&pool.lock, NULL);
+		pthread_cond_init(&pool.changed, NULL);
+
+		/* Start the workers, if none could be started the jobs are run
+		 * below instead
+		 */
+		for (started = 0; started < numthreads; started ++) {
+			if (pthread_create(&threads_p[started], NULL, worker, &pool)) {
+				break;
+			}
+		}
+
+		if (started) {
+			/* Commit each job as soon as it, and all jobs before it, are
+			 * done
+			 */
+			pthread_mutex_lock(&pool.lock);
+			for (i = 0; i < numjobs; i ++) {
+				while (!pool.done_p[i]) {
+					pthread_cond_wait(&pool.changed, &pool.lock);
+				}
+				pthread_mutex_unlock(&pool.lock);
+				commit_p(i, arg_p);
+				pthread_mutex_lock(&pool.lock);
+
+				pool.committed ++;
+				pthread_cond_broadcast(&pool.changed);
+			}
+			pthread_mutex_unlock(&pool.lock);
+
+			for (i = 0; i < started; i ++) {
+				pthread_join(threads_p[i], NULL);
+			}
+		}
+
+		pthread_cond_destroy(&pool.changed);
+		pthread_mutex_destroy(&pool.lock);
+		free(threads_p);
+		free(pool.done_p);
+
+		if (started)	return;
+	}
+#endif
+
+	/* Run the jobs one at a time */
+	for (i = 0; i < numjobs; i ++) {
+		work_p(i, arg_p);
+		commit_p(i, arg_p);
+	}
+}
@@ -0,0 +1,22 @@
+/* jobs.h
+ * $Id$
+ */
+
+#ifndef __JOBS_H
+#define __JOBS_H
+
+/* Job routines, called with the job number and the argument given to
+ * runjobs
+ */
+typedef void jobfunc_t(int job, void *arg_p);
+
+/* Programs with at least this many lines are converted in batches of
+ * lines on worker threads, if the context allows more than one thread
+ */
+#define PARALLELLINES 2048
+#define BATCHLINES 512
+
+void runjobs(int numjobs, int numthreads, jobfunc_t *work_p,
+             jobfunc_t *commit_p, void *arg_p);
+
+#endif
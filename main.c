@@ -4,6 +4,10 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #ifdef __EMX__
 # include <getopt.h>
 #else
@@ -12,12 +16,44 @@
 
 #include "inmode.h"
 #include "outmode.h"
+#include "xlate.h"
 #include "tokenize.h"
+#include "membuf.h"
+#include "image.h"
+#include "jobs.h"
+#include "context.h"
+#include "stats.h"
+#include "sink.h"
+#include "serve.h"
 
 #define TRUE 1
 #define FALSE 0
 
-typedef enum runmode_e { None, In, Out } runmode_t;
+typedef enum runmode_e { None, In, Out, Cross } runmode_t;
+
+/* Conversion of one file */
+typedef struct job_s {
+	context_t	ctx;			/* options and messages */
+	membuf_t	text;			/* in mode text */
+	program_t	*programs_p;	/* out/cross mode programs */
+	int			failed;			/* flag for file that could not be read */
+	stats_t		stats;			/* statistics, if collected */
+} job_t;
+
+/* Conversion run, shared by the jobs */
+typedef struct run_s {
+	char		**files_pp;		/* files to convert, one per job */
+	int			numfiles;
+	runmode_t	mode;
+	int			t64mode;
+	context_t	options;		/* options for each job */
+	sink_t		output;			/* in mode output */
+	job_t		*jobs_p;
+	int			stats;			/* flag for collecting statistics */
+	const char	*statsfile;		/* file to write them to, NULL for stderr */
+	stats_t		total;			/* statistics of all files */
+	membuf_t	statstext;		/* statistics of each file committed */
+} run_t;
 
 #ifdef __EMX__
 # define SWITCH "/"
@@ -25,20 +61,209 @@ typedef enum runmode_e { None, In, Out } runmode_t;
 # define SWITCH "-"
 #endif
 
+/* convertjob
+ * - converts one file into memory, may run on a worker thread
+ * in:	job - index of file to convert
+ *		run_p - conversion run
+ * out:	none
+ */
+static void convertjob(int job, void *run_p)
+{
+	run_t		*r = run_p;
+	job_t		*job_p = &r->jobs_p[job];
+	const char	*infile = r->files_pp[job];
+	int			rc = 0;
+
+	/* Each job collects its own messages */
+	job_p->ctx = r->options;
+	mbinit(&job_p->ctx.messages);
+	initstats(&job_p->stats);
+	if (r->stats) {
+		job_p->stats.timing = TRUE;
+		job_p->ctx.stats_p = &job_p->stats;
+	}
+	report(&job_p->ctx, "Processing: %s\n", infile);
+
+	switch (r->mode) {
+		case In:
+			mbinit(&job_p->text);
+			if (r->t64mode) {
+				rc = t642txt(&job_p->ctx, infile, &job_p->text);
+			}
+			else {
+				rc = bas2txt(&job_p->ctx, infile, &job_p->text);
+			}
+			break;
+
+		case Out:
+			rc = readbundle(&job_p->ctx, infile, &job_p->programs_p);
+			break;
+
+		case Cross:
+			rc = bas2bas(&job_p->ctx, infile, &job_p->programs_p);
+			break;
+	}
+
+	job_p->failed = (0 != rc);
+}
+
+/* putmessages
+ * - writes the messages collected in a context to stderr
+ * in:	ctx_p - context
+ * out:	none
+ */
+static void putmessages(context_t *ctx_p)
+{
+	fwrite(ctx_p->messages.data_p, 1, ctx_p->messages.length, stderr);
+	ctx_p->messages.length = 0;
+}
+
+/* putstats
+ * - writes the statistics of the files committed so far, and their total
+ * in:	r - conversion run
+ * out:	none
+ */
+static void putstats(run_t *r)
+{
+	FILE		*output = stderr;
+	membuf_t	text;
+
+	mbinit(&text);
+	mbputs(&text, "{\"inputs\": [");
+	mbwrite(&text, r->statstext.data_p, r->statstext.length);
+	mbputs(&text, "],\n \"total\": ");
+	writestats(&text, NULL, &r->total);
+	mbputs(&text, "}\n");
+
+	if (r->statsfile) {
+		output = fopen(r->statsfile, "w");
+		if (NULL == output) {
+			fprintf(stderr, "Unable to create statistics file %s\n",
+			        r->statsfile);
+			mbfree(&text);
+			return;
+		}
+	}
+	fwrite(text.data_p, 1, text.length, output);
+	if (output != stderr)	fclose(output);
+	mbfree(&text);
+}
+
+/* commitjob
+ * - writes the result of a converted file, in argument order, and stops
+ *   if the file could not be converted
+ * in:	job - index of converted file
+ *		run_p - conversion run
+ * out:	none
+ */
+static void commitjob(int job, void *run_p)
+{
+	run_t	*r = run_p;
+	job_t	*job_p = &r->jobs_p[job];
+	double	start;
+
+	putmessages(&job_p->ctx);
+
+	switch (r->mode) {
+		case In:
+			/* The output is collected to be written in large writes, the
+			 * last file writes what is left
+			 */
+			start = starttimer(job_p->ctx.stats_p);
+			job_p->stats.bytesout += job_p->text.length;
+			if (sinkput(&r->output, &job_p->text) ||
+			    (job == r->numfiles - 1 && sinkflush(&r->output))) {
+				fprintf(stderr, "Unable to write output\n");
+				job_p->failed = TRUE;
+			}
+			stoptimer(job_p->ctx.stats_p, WritePhase, start);
+			break;
+
+		case Out:
+		case Cross:
+			if (writebundle(&job_p->ctx, job_p->programs_p)) {
+				job_p->failed = TRUE;
+			}
+			job_p->programs_p = NULL;
+			putmessages(&job_p->ctx);
+			break;
+	}
+
+	/* Add the statistics of the file */
+	if (r->stats) {
+		mbputs(&r->statstext, job ? ",\n  " : "\n  ");
+		writestats(&r->statstext, r->files_pp[job], &job_p->stats);
+	}
+	addstats(&r->total, &job_p->stats);
+
+	freecontext(&job_p->ctx);
+	if (job_p->failed) {
+		/* The output of the files before it is still written */
+		if (sinkclose(&r->output)) {
+			fprintf(stderr, "Unable to write output\n");
+		}
+		if (r->stats)	putstats(r);
+		exit(1);
+	}
+}
+
 /* main
  * - main routine
  * evaluates arguments and call the appropriate routines
  */
 int main(int argc, char *argv[])
 {
-	int			option, i;
-	int			allfiles = FALSE;
+	int			option, numfiles, i, j;
 	int			t64mode = FALSE;
-	int			strict = FALSE;
+	int			threads = 0;
 	runmode_t	mode = None;
-	basic_t		force = Any;
 	char		*outfile = "-";
-	FILE		*output;
+	const char	*socket_p = NULL;
+	run_t		run;
+
+	initcontext(&run.options);
+	run.options.filemode = readfilemode();
+	run.stats = FALSE;
+	run.statsfile = NULL;
+	initstats(&run.total);
+	mbinit(&run.statstext);
+
+	/* Long options, which getopt does not know, are taken out of the
+	 * arguments first:
+	 *  --stats     - write statistics of the conversion to stderr
+	 *  --stats=fn  - write statistics of the conversion to file fn
+	 *  --cache=dir - keep converted listings in directory dir
+	 *  --serve     - serve conversion requests on socket bastext.sock
+	 *  --serve=fn  - serve conversion requests on socket fn ('-' for
+	 *                stdin/stdout)
+	 */
+	for (i = j = 1; i < argc; i ++) {
+		if (0 == strcmp(argv[i], "--")) {
+			while (i < argc)	argv[j ++] = argv[i ++];
+			break;
+		}
+		else if (0 == strcmp(argv[i], "--stats")) {
+			run.stats = TRUE;
+		}
+		else if (0 == strncmp(argv[i], "--stats=", 8)) {
+			run.stats = TRUE;
+			run.statsfile = argv[i] + 8;
+		}
+		else if (0 == strncmp(argv[i], "--cache=", 8)) {
+			run.options.cachedir = argv[i] + 8;
+		}
+		else if (0 == strcmp(argv[i], "--serve")) {
+			socket_p = "bastext.sock";
+		}
+		else if (0 == strncmp(argv[i], "--serve=", 8)) {
+			socket_p = argv[i] + 8;
+		}
+		else {
+			argv[j ++] = argv[i];
+		}
+	}
+	argc = j;
+	argv[argc] = NULL;
 
 #ifdef __EMX__
 	/* OS/2 uses '/' as switch character */
@@ -48,20 +273,28 @@ int main(int argc, char *argv[])
 	/* Recognized options:
 	 *  i (in)   - convert from binary to text
 	 *  o (out)  - convert from text to binary
+	 *  x (cross)- convert from binary to binary in another BASIC version
 	 *  t (t64)  - T64 mode
 	 *  2 (2.0)  - force BASIC 2.0        -\
 	 *  3 (TFC3) - force TFC3 BASIC         \
-	 *  5 (G52)  - force Graphics52 BASIC    >- out mode only,
-	 *  7 (7.0)  - force BASIC 7.0          /   if not specified, looks at
-	 *  1 (7.1)  - force BASIC 7.1        -/    "start bastext" header
+	 *  5 (G52)  - force Graphics52 BASIC    >- out mode: if not specified,
+	 *  7 (7.0)  - force BASIC 7.0          /   looks at "start bastext"
+	 *  1 (7.1)  - force BASIC 7.1        -/    header; cross mode: target
+	 *  u (update)-tokenize changed lines only, keeping a sidecar (out mode)
+	 *  r (replace)-replace programs of the same name in the T64 archive
+	 *             (out/cross mode)
 	 *  a (all)  - convert all programs, not only those with recognized start
 	 *             address (0401/0801/1001/1201/132D/1C01/4001)
 	 *  s (strict)-strict tok64 encoding
-	 *  d (dest) - gives destination filename (followed by filename)
+	 *  g (guess)- detect BASIC version from the tokens used (in/cross mode)
+	 *  d (dest) - gives destination filename (followed by filename), or
+	 *             destination directory in cross mode
+	 *  j (jobs) - number of files to convert at the same time (followed
+	 *             by number)
 	 *  h (help) - print help page
 	 *  ? (help)
 	 */
-	while (-1 != (option = getopt(argc, argv, "iot23571asd:h?"))) {
+	while (-1 != (option = getopt(argc, argv, "ioxt23571urasgd:j:h?"))) {
 		switch (option) {
 			case 'i':
 				mode = In;
@@ -71,64 +304,101 @@ int main(int argc, char *argv[])
 				mode = Out;
 				break;
 
+			case 'x':
+				mode = Cross;
+				break;
+
 			case 't':
 				t64mode = TRUE;
 				break;
 
 			case '2':
-				force = Basic2;
+				run.options.force = Basic2;
 				break;
 
 			case '3':
-				force = TFC3;
+				run.options.force = TFC3;
 				break;
 
 			case '5':
-				force = Graphics52;
+				run.options.force = Graphics52;
 				break;
 
 			case '7':
-				force = Basic7;
+				run.options.force = Basic7;
 				break;
 
 			case '1':
-				force = Basic71;
+				run.options.force = Basic71;
+				break;
+
+			case 'u':
+				run.options.incremental = TRUE;
+				break;
+
+			case 'r':
+				run.options.replace = TRUE;
 				break;
 
 			case 'a':
-				allfiles = TRUE;
+				run.options.allfiles = TRUE;
 				break;
 
 			case 's':
-				strict = TRUE;
+				run.options.strict = TRUE;
+				break;
+
+			case 'g':
+				run.options.detect = TRUE;
 				break;
 
 			case 'd':
 				outfile = optarg;
 				break;
 
+			case 'j':
+				threads = atoi(optarg);
+				if (threads < 1) {
+					fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+					return 1;
+				}
+				break;
+
 			case 'h':
 			case '?':
 			case ':':
-				fprintf(stderr, "Usage: %s " SWITCH "i|" SWITCH "o|" SWITCH "h [modifiers] infile(s) outfile\n"
+				fprintf(stderr, "Usage: %s " SWITCH "i|" SWITCH "o|" SWITCH "x|" SWITCH "h [modifiers] infile(s) outfile\n"
 				                "\n Mode (one of these required):\n"
 				                "  " SWITCH "i\tInput mode (binary to text)\n"
 				                "  " SWITCH "o\tOutput mode (text to binary)\n"
+				                "  " SWITCH "x\tCross mode (binary to binary in another BASIC)\n"
 				                "  " SWITCH "h\tPrint help page\n"
 				                "\n General modfiers:\n"
 				                "  " SWITCH "t\tT64 mode (in: reads from specified T64 archive(s)\n"
-				                "    \t          out: creates/appends to bastext.t64)\n"
+				                "    \t          out/cross: creates/appends to bastext.t64)\n"
+				                "  " SWITCH "j n\tConvert n files at the same time\n"
+				                "  --stats[=fn]\tWrite statistics as JSON to stderr (or file fn)\n"
+				                "  --serve[=fn]\tServe conversions on socket fn (bastext.sock)\n"
 				                "\n Input mode modfiers:\n"
 				                "  " SWITCH "a\tConvert all, not just recognized start addresses\n"
 				                "    \t (0401/0801/1001/1201/132D/1C01/4001)\n"
 				                "  " SWITCH "s\tStrict tok64 compatibility\n"
+				                "  " SWITCH "g\tDetect BASIC version from the tokens used\n"
 				                "  " SWITCH "d fn\tSend output to file fn\n"
+				                "  --cache=dir\tKeep converted listings in directory dir\n"
 				                "\n Output mode modifiers:\n"
 				                "  " SWITCH "2\tForce C64 BASIC 2.0 interpretation\n"
 				                "  " SWITCH "3\tForce C64 TFC3 interpretation\n"
 				                "  " SWITCH "5\tForce C64 Graphics52 interpretation\n"
 				                "  " SWITCH "7\tForce C128 BASIC 7.0 interpretation\n"
-				                "  " SWITCH "1\tForce C128 BASIC 7.1 interpretation\n",
+				                "  " SWITCH "1\tForce C128 BASIC 7.1 interpretation\n"
+				                "  " SWITCH "u\tTokenize changed lines only, keeping infile.tok\n"
+				                "  " SWITCH "r\tReplace programs of the same name in bastext.t64\n"
+				                "\n Cross mode modifiers:\n"
+				                "  " SWITCH "2|" SWITCH "3|" SWITCH "5|" SWITCH "7|" SWITCH "1\tBASIC version to convert to (required)\n"
+				                "  " SWITCH "a, " SWITCH "g\tAs in input mode\n"
+				                "  " SWITCH "r\tAs in output mode\n"
+				                "  " SWITCH "d dir\tWrite programs to directory dir\n",
 				        argv[0]);
 				return 0;
 				break;
@@ -139,6 +409,17 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	/* The cache directory is created if it does not exist yet */
+	if (run.options.cachedir)	mkdir(run.options.cachedir, 0777);
+
+	/* In server mode, the options given are the defaults of each request,
+	 * and the number of jobs is the number of clients served at once
+	 */
+	if (socket_p) {
+		return serve(socket_p, &run.options, threads ? threads : SERVEWORKERS);
+	}
+	if (!threads)	threads = 1;
+
 	if (None == mode) {		/* missing mode option */
 		fprintf(stderr, "No operation mode specified\n"
 		                "-- use '%s " SWITCH "h' for help\n",
@@ -146,45 +427,66 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (Cross == mode && Any == run.options.force) {	/* missing target */
+		fprintf(stderr, "No BASIC version to convert to specified\n"
+		                "-- use '%s " SWITCH "h' for help\n",
+		        argv[0]);
+		return 1;
+	}
+
+	/* In cross mode, the destination is a directory to write to */
+	if (Cross == mode && 0 != strcmp(outfile, "-")) {
+		run.options.outdir = outfile;
+	}
+
 	if (argc - optind < 1) {	/* missing filenames */
 		fprintf(stderr, "Filename missing\n");
 		return 1;
 	}
 
 	/* If in input mode, and destination file is other than '-' (stdout),
-	 * open the output file, else set it to stdout
+	 * open the output file, else write to stdout
 	 */
-	if (In == mode && 0 != strcmp(outfile, "-")) {
-		output = fopen(outfile, "at");
-		if (NULL == output) {
-			output = fopen(outfile, "wt");
-			if (NULL == output) {
-				fprintf(stderr, "%s: Unable to open output file: %s\n",
-				        argv[0], outfile);
-				exit(1);
-			}
-		}
-	}
-	else {
-		output = stdout;
+	if (sinkopen(&run.output, In == mode ? outfile : "-")) {
+		fprintf(stderr, "%s: Unable to open output file: %s\n",
+		        argv[0], outfile);
+		exit(1);
 	}
 
-	/* Filename to read first is in argv[optind] */
-	for (i = optind; i < argc; i ++) {
-		fprintf(stderr, "Processing: %s\n", argv[i]);
-
-		switch (mode) {
-			case In:
-				if (t64mode)	t642txt(argv[i], output, allfiles, strict);
-				else			bas2txt(argv[i], output, allfiles, strict);
-				break;
+	/* Filename to read first is in argv[optind], the files are converted
+	 * as separate jobs whose results are written in argument order; threads
+	 * not needed for the files are shared out for converting large programs
+	 */
+	numfiles = argc - optind;
+	run.options.threads = (threads > numfiles) ? threads / numfiles : 1;
+	run.files_pp = &argv[optind];
+	run.numfiles = numfiles;
+	run.mode = mode;
+	run.t64mode = t64mode;
+	if (t64mode)	run.options.t64name = "bastext.t64";
+	run.jobs_p = calloc(numfiles, sizeof(job_t));
+	if (!run.jobs_p) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
 
-			case Out:
-				txt2bas(argv[i], force, t64mode);
-				break;
-		}
+	runjobs(numfiles, threads, convertjob, commitjob, &run);
+	if (run.stats) {
+		putstats(&run);
+	}
+	else if (In == mode && run.options.cachedir) {
+		fprintf(stderr, "Cache: %lu hits, %lu misses\n",
+		        run.total.cachehits, run.total.cachemisses);
 	}
 
+	free(run.jobs_p);
+	mbfree(&run.statstext);
+	freecontext(&run.options);
+
 	/* Close output file, if any */
-	if (output != stdout)	fclose(output);
+	if (sinkclose(&run.output)) {
+		fprintf(stderr, "Unable to write output\n");
+		return 1;
+	}
+	return 0;
 }
\ No newline at end of file
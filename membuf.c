@@ -0,0 +1,134 @@
+/* membuf.c
+ * - growable memory buffers, used to collect output before writing it
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "membuf.h"
+
+/* Smallest allocation */
+#define MINSIZE 4096
+
+/* mbinit
+ * - initializes an empty buffer
+ * in:	buf_p - buffer to initialize
+ * out:	none
+ */
+void mbinit(membuf_t *buf_p)
+{
+	buf_p->data_p = NULL;
+	buf_p->length = 0;
+	buf_p->size = 0;
+}
+
+/* mbfree
+ * - releases the memory of a buffer, leaving it empty
+ * in:	buf_p - buffer to release
+ * out:	none
+ */
+void mbfree(membuf_t *buf_p)
+{
+	free(buf_p->data_p);
+	mbinit(buf_p);
+}
+
+/* mbreserve
+ * - makes room for more data at the end of a buffer
+ * in:	buf_p - buffer
+ *		length - amount of room needed
+ * out:	pointer to the end of the data, where the room is
+ */
+char *mbreserve(membuf_t *buf_p, size_t length)
+{
+	size_t	size;
+	char	*data_p;
+
+	if (buf_p->size - buf_p->length < length) {
+		/* Grow geometrically, so that appending is amortized linear */
+		size = buf_p->size ? buf_p->size : MINSIZE;
+		while (size - buf_p->length < length) {
+			size *= 2;
+		}
+
+		data_p = realloc(buf_p->data_p, size);
+		if (!data_p) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		buf_p->data_p = data_p;
+		buf_p->size = size;
+	}
+
+	return buf_p->data_p + buf_p->length;
+}
+
+/* mbwrite
+ * - appends data to a buffer
+ * in:	buf_p - buffer
+ *		data_p - data to append
+ *		length - length of data
+ * out:	none
+ */
+void mbwrite(membuf_t *buf_p, const void *data_p, size_t length)
+{
+	memcpy(mbreserve(buf_p, length), data_p, length);
+	buf_p->length += length;
+}
+
+/* mbputc
+ * - appends a character to a buffer
+ * in:	buf_p - buffer
+ *		ch - character to append
+ * out:	none
+ */
+void mbputc(membuf_t *buf_p, int ch)
+{
+	*mbreserve(buf_p, 1) = ch;
+	buf_p->length ++;
+}
+
+/* mbputs
+ * - appends a string to a buffer
+ * in:	buf_p - buffer
+ *		text_p - string to append (without its null)
+ * out:	none
+ */
+void mbputs(membuf_t *buf_p, const char *text_p)
+{
+	mbwrite(buf_p, text_p, strlen(text_p));
+}
+
+/* mbprintf
+ * - appends formatted text to a buffer
+ * in:	buf_p - buffer
+ *		format_p - printf format
+ * out:	none
+ */
+void mbprintf(membuf_t *buf_p, const char *format_p, ...)
+{
+	va_list	args;
+	int		length;
+
+	/* Try with the room there is, and retry if it was not enough */
+	mbreserve(buf_p, 256);
+	va_start(args, format_p);
+	length = vsnprintf(buf_p->data_p + buf_p->length,
+	                   buf_p->size - buf_p->length, format_p, args);
+	va_end(args);
+
+	if (length >= 0 && (size_t) length >= buf_p->size - buf_p->length) {
+		mbreserve(buf_p, length + 1);
+		va_start(args, format_p);
+		vsnprintf(buf_p->data_p + buf_p->length,
+		          buf_p->size - buf_p->length, format_p, args);
+		va_end(args);
+	}
+
+	if (length > 0) {
+		buf_p->length += length;
+	}
+}
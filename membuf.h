@@ -0,0 +1,25 @@
+/* membuf.h
+ * $Id$
+ */
+
+#ifndef __MEMBUF_H
+#define __MEMBUF_H
+
+#include <stddef.h>
+
+/* Growable memory buffer */
+typedef struct membuf_s {
+	char	*data_p;		/* contents */
+	size_t	length;			/* amount used */
+	size_t	size;			/* amount allocated */
+} membuf_t;
+
+void mbinit(membuf_t *buf_p);
+void mbfree(membuf_t *buf_p);
+char *mbreserve(membuf_t *buf_p, size_t length);
+void mbwrite(membuf_t *buf_p, const void *data_p, size_t length);
+void mbputc(membuf_t *buf_p, int ch);
+void mbputs(membuf_t *buf_p, const char *text_p);
+void mbprintf(membuf_t *buf_p, const char *format_p, ...);
+
+#endif
@@ -0,0 +1,125 @@
+/* mkcorpus.c
+ * - writes generated BASIC listings, for benchmarking and testing
+ *   bastext on larger inputs
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __EMX__
+# include <getopt.h>
+#else
+# include <unistd.h>
+#endif
+
+#include "bastext.h"
+#include "corpus.h"
+
+#define FALSE 0
+#define TRUE 1
+
+/* main
+ * - writes a listing for each dialect (or the chosen one), as a text
+ *   bundle on standard output, or as program files
+ */
+int main(int argc, char *argv[])
+{
+	corpusmix_t		mix = defaultmix;
+	membuf_t		listing, image;
+	context_t		ctx;
+	int				option, mode, first = Basic2, last = VicSuper;
+	int				lines = 500, programs = 1, prgfiles = FALSE, i, c128;
+	unsigned long	seed = 1;
+	char			filename[32];
+	FILE			*output;
+
+	while (-1 != (option = getopt(argc, argv, "b:l:n:r:k:q:e:ph?"))) {
+		switch (option) {
+			case 'b':
+				for (mode = Basic2; mode <= VicSuper; mode ++) {
+					if (0 == strcmp(optarg, dialectnames[mode]))	break;
+				}
+				if (mode > VicSuper) {
+					fprintf(stderr, "Unknown dialect: %s\n", optarg);
+					return 1;
+				}
+				first = last = mode;
+				break;
+
+			case 'l':	lines = atoi(optarg);				break;
+			case 'n':	programs = atoi(optarg);			break;
+			case 'r':	seed = strtoul(optarg, NULL, 10);	break;
+			case 'k':	mix.statements = atoi(optarg);		break;
+			case 'q':	mix.strings = atoi(optarg);			break;
+			case 'e':	mix.escapes = atoi(optarg);			break;
+			case 'p':	prgfiles = TRUE;					break;
+
+			default:
+				fprintf(stderr, "Usage: %s [options]\n"
+				                "  -b name\tOnly this dialect (basic2, "
+				                "graphics52, tfc3, basic7,\n"
+				                "         \t basic71, basic35, basic4, "
+				                "vicsuper)\n"
+				                "  -l n\tLines per listing (500)\n"
+				                "  -n n\tListings per dialect (1)\n"
+				                "  -r n\tRandom seed (1)\n"
+				                "  -k n\tMost statements per line (4)\n"
+				                "  -q n\tPercentage of statements with "
+				                "strings (30)\n"
+				                "  -e n\tPercentage of string characters "
+				                "that are escapes (10)\n"
+				                "  -p\tWrite program files instead of "
+				                "text\n",
+				        argv[0]);
+				return 1;
+		}
+	}
+	if (lines < 1 || lines > 6399 || mix.statements < 1) {
+		fprintf(stderr, "Invalid corpus parameters\n");
+		return 1;
+	}
+
+	initcontext(&ctx);
+	for (mode = first; mode <= last; mode ++) {
+		for (i = 0; i < programs; i ++) {
+			mbinit(&listing);
+			makelisting(&listing, mode, lines, &mix, seed + i);
+			sprintf(filename, "%s%d.prg", dialectnames[mode], i);
+
+			if (prgfiles) {
+				/* Tokenized program file */
+				mbinit(&image);
+				tokenizeprg(&ctx, listing.data_p, listing.length,
+				            corpusaddress(mode), mode, &image);
+				output = fopen(filename, "wb");
+				if (!output) {
+					fprintf(stderr, "Unable to create output file %s\n",
+					        filename);
+					return 1;
+				}
+				fwrite(image.data_p, image.length, 1, output);
+				fclose(output);
+				mbfree(&image);
+			}
+			else {
+				/* Text bundle entry, bastext picks the dialect from the
+				 * start address where it can (else use a force option)
+				 */
+				c128 = (Basic7 == mode || Basic71 == mode);
+				printf("\nstart bastext %d\nstart %s %s\n",
+				       corpusaddress(mode), c128 ? "tok128" : "tok64",
+				       filename);
+				fwrite(listing.data_p, listing.length, 1, stdout);
+				printf("stop %s\n", c128 ? "tok128" : "tok64");
+			}
+
+			mbfree(&listing);
+		}
+	}
+
+	/* Problems found when tokenizing are generator bugs */
+	fwrite(ctx.messages.data_p, ctx.messages.length, 1, stderr);
+	freecontext(&ctx);
+	return 0;
+}
@@ -0,0 +1,500 @@
+/* mktables.c
+ * - generates the lookup tables in tables.c from the tables in tokens.c
+ *   (run at build time, writes the C source on standard output)
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __EMX__
+#define strcasecmp stricmp
+#endif
+
+#include "tokenize.h"
+#include "tokens.h"
+#include "tables.h"
+
+/* Number of basic_t values */
+#define NUMDIALECTS (VicSuper + 1)
+
+/* Trie size limits */
+#define MAXNODES 2048
+#define MAXTERMS 512
+
+/* Number of PETSCII escape names, including the "space" alias */
+#define NUMNAMES 256
+
+/* Size of the PETSCII text pool */
+#define POOLSIZE 8192
+
+/* Trie being built */
+static int				numnodes;
+static unsigned short	child[MAXNODES][256];	/* node for each character */
+static unsigned short	term[MAXNODES];			/* keyword ending here */
+static unsigned short	below[MAXNODES];		/* lowest keyword below */
+static int				numterms;
+static kwterm_t			terms[MAXTERMS];
+
+/* PETSCII text pool being built */
+static char				pool[POOLSIZE];
+static unsigned			poolused;
+
+/* upcase
+ * - converts a character to uppercase the way the tokenizer does
+ * in:	ch - character
+ * out:	uppercase character
+ */
+static int upcase(int ch)
+{
+	return (ch >= 'a' && ch <= 'z') ? ch - 32 : ch;
+}
+
+/* addkeyword
+ * - adds a keyword to the trie being built
+ * in:	text_p - keyword text
+ *		prefix - prefix byte, 0 for none
+ *		token - token byte
+ *		table - token table it is counted in
+ * out:	none
+ */
+static void addkeyword(const char *text_p, int prefix, int token, int table)
+{
+	kwterm_t		*term_p;
+	const char		*c_p;
+	int				node = 0;
+
+	if (numterms >= MAXTERMS) {
+		fprintf(stderr, "mktables: Too many keywords\n");
+		exit(1);
+	}
+
+	/* Walk down the trie, creating nodes as needed */
+	for (c_p = text_p; *c_p; c_p ++) {
+		int ch = upcase((unsigned char) *c_p);
+
+		if (!child[node][ch]) {
+			if (numnodes >= MAXNODES) {
+				fprintf(stderr, "mktables: Too many trie nodes\n");
+				exit(1);
+			}
+			child[node][ch] = numnodes ++;
+		}
+		node = child[node][ch];
+	}
+
+	/* Only the first keyword with this text can ever be matched */
+	if (KW_NONE == term[node]) {
+		term[node] = numterms;
+	}
+
+	/* Record the keyword */
+	term_p = &terms[numterms ++];
+	term_p->length = strlen(text_p);
+	term_p->flags = 0;
+	term_p->table = table;
+	if (prefix) {
+		term_p->bytes = 2;
+		term_p->token[0] = prefix;
+		term_p->token[1] = token;
+	}
+	else {
+		term_p->bytes = 1;
+		term_p->token[0] = token;
+		term_p->token[1] = 0;
+		if (0x83 == token || 0x8F == token) {	/* DATA & REM */
+			term_p->flags |= KW_NOTOKENIZE;
+		}
+	}
+}
+
+/* findbelow
+ * - fills in the lowest keyword number found below each node
+ * in:	node - node to start at
+ * out:	lowest keyword number at or below the node
+ */
+static unsigned findbelow(int node)
+{
+	unsigned	lowest = KW_NONE, sub;
+	int			ch;
+
+	for (ch = 0; ch < 256; ch ++) {
+		if (child[node][ch]) {
+			sub = findbelow(child[node][ch]);
+			if (sub < lowest)	lowest = sub;
+		}
+	}
+
+	below[node] = lowest;
+	return term[node] < lowest ? term[node] : lowest;
+}
+
+/* buildtrie
+ * - builds the keyword trie for a BASIC dialect
+ * in:	mode - the dialect
+ * out:	none
+ */
+static void buildtrie(basic_t mode)
+{
+	const tokenseg_t	*segs_p = dialects[mode];
+	int					i;
+
+	memset(child, 0, sizeof(child));
+	for (i = 0; i < MAXNODES; i ++) {
+		term[i] = KW_NONE;
+	}
+	numnodes = 1;				/* node 0 is the root */
+	numterms = 0;
+
+	for (; segs_p->table_p; segs_p ++) {
+		for (i = segs_p->first; i <= segs_p->last; i ++) {
+			/* Empty entries are unused token values */
+			if (*segs_p->table_p[i]) {
+				addkeyword(segs_p->table_p[i], segs_p->prefix,
+				           i + segs_p->offset,
+				           findtokentable(mode, segs_p->prefix,
+				                          i + segs_p->offset));
+			}
+		}
+	}
+
+	findbelow(0);
+}
+
+/* writetrie
+ * - writes the keyword trie for a BASIC dialect as C source
+ * in:	n - dialect number, used for naming the tables
+ * out:	none
+ */
+static void writetrie(int n)
+{
+	int i, ch, edge, count;
+
+	/* First character lookup, in both cases */
+	printf("static const unsigned short trie%droot[256] = {", n);
+	for (ch = 0; ch < 256; ch ++) {
+		printf("%s%u,", ch % 16 ? " " : "\n\t", child[0][upcase(ch)]);
+	}
+	printf("\n};\n\n");
+
+	/* Nodes, with their edges numbered consecutively */
+	printf("static const kwnode_t trie%dnodes[] = {\n", n);
+	edge = 0;
+	for (i = 0; i < numnodes; i ++) {
+		count = 0;
+		for (ch = 0; ch < 256; ch ++) {
+			if (child[i][ch])	count ++;
+		}
+		printf("\t{ %4d, %2d, %5u, %5u },\n",
+		       edge, count, term[i], below[i]);
+		edge += count;
+	}
+	printf("};\n\n");
+
+	printf("static const kwedge_t trie%dedges[] = {", n);
+	edge = 0;
+	for (i = 0; i < numnodes; i ++) {
+		for (ch = 0; ch < 256; ch ++) {
+			if (child[i][ch]) {
+				printf("%s{ %3d, %4u },", edge % 6 ? " " : "\n\t",
+				       ch, child[i][ch]);
+				edge ++;
+			}
+		}
+	}
+	printf("\n\t{ 0, 0 }\n};\n\n");
+
+	printf("static const kwterm_t trie%dterms[] = {\n", n);
+	for (i = 0; i < numterms; i ++) {
+		printf("\t{ %2u, %u, { 0x%02X, 0x%02X }, %u, %u },\n",
+		       terms[i].length, terms[i].bytes,
+		       terms[i].token[0], terms[i].token[1], terms[i].flags,
+		       terms[i].table);
+	}
+	printf("};\n\n");
+}
+
+/* lowercase
+ * - converts a character to lowercase the way strcasecmp does
+ * in:	ch - character
+ * out:	lowercase character
+ */
+static int lowercase(int ch)
+{
+	return (ch >= 'A' && ch <= 'Z') ? ch + 32 : ch;
+}
+
+/* writestring
+ * - writes a string as a C string literal
+ * in:	text_p - string to write
+ *		fold - flag for writing it in lowercase
+ * out:	none
+ */
+static void writestring(const char *text_p, int fold)
+{
+	putchar('"');
+	for (; *text_p; text_p ++) {
+		int ch = fold ? lowercase((unsigned char) *text_p)
+		              : (unsigned char) *text_p;
+
+		if ('"' == ch || '\\' == ch)	putchar('\\');
+		putchar(ch);
+	}
+	putchar('"');
+}
+
+/* addpool
+ * - adds a text to the PETSCII text pool
+ * in:	text_p - text to add
+ *		fold - flag for adding it in lowercase
+ * out:	offset of text in pool
+ */
+static unsigned addpool(const char *text_p, int fold)
+{
+	unsigned	offset = poolused;
+
+	if (poolused + strlen(text_p) > POOLSIZE) {
+		fprintf(stderr, "mktables: PETSCII text pool full\n");
+		exit(1);
+	}
+	for (; *text_p; text_p ++) {
+		pool[poolused ++] = fold ? lowercase((unsigned char) *text_p)
+		                         : *text_p;
+	}
+	return offset;
+}
+
+/* writepool
+ * - writes the PETSCII text pool as C source
+ * in:	none
+ * out:	none
+ */
+static void writepool(void)
+{
+	unsigned	i;
+
+	printf("const char petpool[] =");
+	for (i = 0; i < poolused; i ++) {
+		if (0 == i % 48)	printf("%s\n\t\"", i ? "\"" : "");
+		if ('"' == pool[i] || '\\' == pool[i])	putchar('\\');
+		putchar(pool[i]);
+	}
+	printf("\";\n\n");
+}
+
+/* writepetscii
+ * - writes the PETSCII escape name hash, and the text pool of the names
+ * in:	none
+ * out:	none
+ */
+static void writepetscii(void)
+{
+	const char		*name[NUMNAMES];	/* escape names, in lookup order */
+	int				ch[NUMNAMES];		/* character for each name */
+	int				key[NUMNAMES];		/* first name with same lowercase */
+	unsigned short	hash[PET_HASHSIZE];
+	unsigned		offset[256];		/* pool offset of each character */
+	unsigned		h, text;
+	int				i, j, n, first, count, folded;
+	const char		*c_p;
+
+	/* The name of each character as written, in character order */
+	poolused = 0;
+	for (i = 0; i <= 255; i ++) {
+		offset[i] = addpool(petscii[i], 0);
+	}
+
+	/* The table order, followed by "space" that is only used if nothing
+	 * else matched
+	 */
+	for (i = 1; i <= 255; i ++) {
+		name[i - 1] = petscii[i];
+		ch[i - 1] = i;
+	}
+	name[255] = "space";
+	ch[255] = ' ';
+
+	/* Group the names that are the same in lowercase */
+	for (i = 0; i < NUMNAMES; i ++) {
+		key[i] = i;
+		for (j = 0; j < i; j ++) {
+			if (0 == strcasecmp(name[i], name[j])) {
+				key[i] = j;
+				break;
+			}
+		}
+	}
+
+	/* Characters for each name, and the names in the order they get
+	 * hashed
+	 */
+	printf("const petchar_t petchars[] = {");
+	n = 0;
+	for (i = 0; i < NUMNAMES; i ++) {
+		if (key[i] != i)	continue;
+		for (j = i; j < NUMNAMES; j ++) {
+			if (key[j] == i) {
+				/* Upper-/lowercase PETSCII must be matched with case */
+				printf("%s{ %3d, %d },", n % 6 ? " " : "\n\t", ch[j],
+				       (ch[j] & 0x7F) >= 0x41 && (ch[j] & 0x7F) <= 0x5A);
+				n ++;
+			}
+		}
+	}
+	printf("\n};\n\n");
+
+	memset(hash, 0, sizeof(hash));
+	printf("const petname_t petnames[] = {\n");
+	first = 0;
+	n = 0;
+	for (i = 0; i < NUMNAMES; i ++) {
+		if (key[i] != i)	continue;
+
+		count = 0;
+		for (j = i; j < NUMNAMES; j ++) {
+			if (key[j] == i)	count ++;
+		}
+
+		/* The lowercase name is only added to the pool if it is not the
+		 * same as the name of the character
+		 */
+		folded = (i < 255);
+		for (c_p = name[i]; folded && *c_p; c_p ++) {
+			folded = (lowercase((unsigned char) *c_p) == *c_p);
+		}
+		text = folded ? offset[ch[i]] : addpool(name[i], 1);
+
+		printf("\t{ %4u, %2u, %3d, %d },\t/* ", text,
+		       (unsigned) strlen(name[i]), first, count);
+		writestring(name[i], 1);
+		printf(" */\n");
+		first += count;
+
+		/* Enter it in the first free slot */
+		h = 0;
+		for (c_p = name[i]; *c_p; c_p ++) {
+			h = PET_HASHSTEP(h, lowercase((unsigned char) *c_p));
+		}
+		h &= PET_HASHSIZE - 1;
+		while (hash[h]) {
+			h = (h + 1) & (PET_HASHSIZE - 1);
+		}
+		hash[h] = ++ n;
+	}
+	printf("};\n\n");
+
+	printf("const unsigned short pethash[PET_HASHSIZE] = {");
+	for (i = 0; i < PET_HASHSIZE; i ++) {
+		printf("%s%3u,", i % 12 ? " " : "\n\t", hash[i]);
+	}
+	printf("\n};\n\n");
+
+	printf("const unsigned short petoffsets[256] = {");
+	for (i = 0; i <= 255; i ++) {
+		printf("%s%4u,", i % 12 ? " " : "\n\t", offset[i]);
+	}
+	printf("\n};\n\n");
+
+	printf("const unsigned char petlengths[256] = {");
+	for (i = 0; i <= 255; i ++) {
+		printf("%s%2u,", i % 16 ? " " : "\n\t",
+		       (unsigned) strlen(petscii[i]));
+	}
+	printf("\n};\n\n");
+
+	writepool();
+}
+
+/* writetextmaps
+ * - writes the plain text maps, with the same mapping as tokenize()
+ *   uses for single characters
+ * in:	none
+ * out:	none
+ */
+static void writetextmaps(void)
+{
+	int	ch, map;
+
+	/* Inside quotes: specials (32-64, 91, 93, 94) as-is, uppercase ASCII
+	 * to uppercase PETSCII, lowercase ASCII to lowercase PETSCII
+	 */
+	printf("const unsigned char quotedmap[256] = {");
+	for (ch = 0; ch <= 255; ch ++) {
+		map = 0;
+		if ((ch >= 32 && ch <= 64) || 91 == ch || 93 == ch || 94 == ch) {
+			map = ch;
+		}
+		else if (ch >= 65 && ch <= 90) {
+			map = ch | 128;
+		}
+		else if (ch >= 97 && ch <= 122) {
+			map = ch & ~32;
+		}
+		if ('"' == ch)	map = 0;
+		printf("%s%3d,", ch % 12 ? " " : "\n\t", map);
+	}
+	printf("\n};\n\n");
+
+	/* After REM and DATA: 32-91 and 93 as-is, 96-122 to lowercase
+	 * PETSCII
+	 */
+	printf("const unsigned char plainmap[256] = {");
+	for (ch = 0; ch <= 255; ch ++) {
+		map = 0;
+		if ((ch >= 32 && ch <= 91) || 93 == ch) {
+			map = ch;
+		}
+		else if (ch >= 96 && ch <= 122) {
+			map = ch - 32;
+		}
+		if ('"' == ch)	map = 0;
+		printf("%s%3d,", ch % 12 ? " " : "\n\t", map);
+	}
+	printf("\n};\n\n");
+}
+
+/* main
+ * - writes tables.c to standard output
+ */
+int main(void)
+{
+	int	i, j, same[NUMDIALECTS];
+
+	printf("/* tables.c\n"
+	       " * - generated by mktables from the tables in tokens.c,"
+	       " do not edit\n"
+	       " */\n\n"
+	       "#include \"tables.h\"\n\n");
+
+	/* Keyword tries, dialects sharing keyword segments share tries */
+	for (i = 0; i < NUMDIALECTS; i ++) {
+		same[i] = i;
+		for (j = 0; j < i; j ++) {
+			if (dialects[j] == dialects[i]) {
+				same[i] = same[j];
+				break;
+			}
+		}
+
+		if (same[i] == i) {
+			buildtrie((basic_t) i);
+			writetrie(i);
+		}
+	}
+
+	printf("const kwtrie_t kwtries[] = {\n");
+	for (i = 0; i < NUMDIALECTS; i ++) {
+		printf("\t{ trie%droot, trie%dnodes, trie%dedges, trie%dterms },\n",
+		       same[i], same[i], same[i], same[i]);
+	}
+	printf("};\n\n");
+
+	/* PETSCII escape names */
+	writepetscii();
+
+	/* Plain text */
+	writetextmaps();
+
+	return 0;
+}
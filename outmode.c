@@ -4,12 +4,20 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include "outmode.h"
 #include "tokenize.h"
 #include "version.h"
+#include "select.h"
 #include "t64.h"
+#include "membuf.h"
+#include "context.h"
+#include "image.h"
+#include "jobs.h"
+#include "sidecar.h"
 
 #define FALSE 0
 #define TRUE 1
@@ -18,99 +26,183 @@
 #define strncasecmp strnicmp
 #endif
 
-int outconvert(FILE *, FILE *, int, basic_t);
+/* Text being read, from memory */
+typedef struct textsrc_s {
+	const char	*data_p;		/* text */
+	size_t		length;			/* length of text */
+	size_t		pos;			/* position of next line */
+} textsrc_t;
+
+int outconvert(context_t *, textsrc_t *, int, basic_t, membuf_t *,
+               sidecar_t *);
+static int tokenizebundle(context_t *, const char *, size_t, program_t **,
+                          sidecar_t *);
+
+/* readline
+ * - reads a line of text onto the end of a buffer, without its newline
+ *   (and the CR of DOS text files), keeping the buffer null terminated.
+ *   Lines may be of any length
+ * in:	src_p - text to read from
+ *		line - buffer to add the line to
+ * out:	FALSE at end of text
+ */
+static int readline(textsrc_t *src_p, membuf_t *line)
+{
+	const char	*line_p, *newline_p;
+	size_t		length;
+
+	if (src_p->pos >= src_p->length)	return FALSE;
+
+	/* Up to the newline, or the end of the text */
+	line_p = src_p->data_p + src_p->pos;
+	length = src_p->length - src_p->pos;
+	newline_p = memchr(line_p, '\n', length);
+	if (newline_p) {
+		length = newline_p - line_p;
+		src_p->pos ++;
+	}
+	src_p->pos += length;
+
+	/* Check for trailing CR (when reading DOS text files under Unix) */
+	if (length && '\r' == line_p[length - 1])	length --;
+
+	mbwrite(line, line_p, length);
+	mbputc(line, 0);
+	line->length --;			/* the null is not part of the text */
+
+	return TRUE;
+}
 
 /* txt2bas
- * - converts a text file into a binary file
- * in:	infile - file name of file to read
- *		force - flag for forcing a BASIC mode (Any for autodetect)
- *		t64mode - flag for putting the files in a T64 archive
- * out:	none
+ * - converts a text file into binary files
+ * in:	ctx_p - conversion context
+ *		infile - file name of file to read
+ * out:	zero if all files were written
  */
-void txt2bas(const char *infile, basic_t force, int t64mode)
+int txt2bas(context_t *ctx_p, const char *infile)
 {
-	FILE			*input, *output;
-	int				adr;
-	basic_t			mode;
-	char			text[256], filename[256], *c_p;
-	int				morefiles = TRUE;
-	int				foundheader, foundextraheader;
-	t64header_t		header;
-	t64record_t		record;
-	unsigned int	totalentries, usedentries, i;
-	long			fptr;
-
-	/* First, open input file */
-	input = fopen(infile, "rt");
-	if (!input) {
-		fprintf(stderr, "Unable to open input file: %s\n", infile);
-		exit(1);
-	}
-
-	/* Secondly, if in T64 mode, open the T64 archive */
-	if (t64mode) {
-		/* If the T64 file exists, we want to continue adding to it */
-		output = fopen("bastext.t64", "r+b");
-		if (NULL == output) {
-			/* Otherwise, create a new file */
-			output = fopen("bastext.t64", "w+b");
-			if (NULL == output) {
-				fprintf(stderr, "Unable to create output file bastext.t64\n");
-			}
+	program_t	*programs_p;
 
-			/* Create standard header */
-			memset(&header, 0, sizeof(header));
-			strcpy(header.description, "C64 tape archive " PROGNAME "\x1a");
-			strncpy(header.title, "CREATED BY BASTEXT      ", 24);
-			header.version[0]  = 0x00;					/* low */
-			header.version[1]  = 0x01;					/* high */
-			header.maxfiles[0] = STD_DIRSIZE & 0xFF;	/* low */
-			header.maxfiles[1] = STD_DIRSIZE >> 8;		/* high */
-
-			totalentries = STD_DIRSIZE;
-			usedentries = 0;
-			fwrite(&header, sizeof(header), 1, output);
-
-			/* Fill entries */
-			memset(&record, 0, sizeof(record));
-			for (i = 0; i < STD_DIRSIZE; i ++) {
-				fwrite(&record, sizeof(record), 1, output);
-			}
-		}
-		else {
-			/* We opened an old file, now check that it is valid */
+	if (readbundle(ctx_p, infile, &programs_p)) {
+		return 1;
+	}
+	return writebundle(ctx_p, programs_p);
+}
 
-			/* Read the T64 header */
-			fread(&header, sizeof(header), 1, output);
+/* readbundle
+ * - tokenizes the programs in a text file into memory
+ * in:	ctx_p - conversion context
+ *		infile - file name of file to read
+ *		programs_pp - pointer to where to put the list of programs, in
+ *		              file order
+ * out:	zero if the file could be read
+ */
+int readbundle(context_t *ctx_p, const char *infile, program_t **programs_pp)
+{
+	image_t		input;
+	sidecar_t	sidecar;
+	membuf_t	sidename;
+	double		start;
 
-			/* Check that it is a T64 file */
-			if (checkvalidheader(&header, &totalentries, &usedentries,
-			    "bastext.t64")) {
-				/* It wasn't -> panic */
-				exit(1);
-			}
+	/* First, load the input file */
+	*programs_pp = NULL;
+	start = starttimer(ctx_p->stats_p);
+	if (loadimage(infile, &input)) {
+		reporterror(ctx_p, "Unable to open input file: %s\n", infile);
+		return 1;
+	}
+	stoptimer(ctx_p->stats_p, ReadPhase, start);
+	if (ctx_p->stats_p)	ctx_p->stats_p->bytesin += input.length;
+
+	/* Tokenize it, reusing the lines that did not change since the last
+	 * run if asked to
+	 */
+	if (ctx_p->incremental) {
+		mbinit(&sidename);
+		mbprintf(&sidename, "%s%s", infile, SIDEEXT);
+		loadsidecar(&sidecar, sidename.data_p);
+		tokenizebundle(ctx_p, (const char *) input.data_p, input.length,
+		               programs_pp, &sidecar);
+		if (savesidecar(&sidecar, sidename.data_p, ctx_p->filemode)) {
+			reporterror(ctx_p, "Unable to write sidecar file %s\n",
+			            sidename.data_p);
 		}
+		freesidecar(&sidecar);
+		mbfree(&sidename);
+	}
+	else {
+		txt2prg(ctx_p, (const char *) input.data_p, input.length,
+		        programs_pp);
 	}
 
+	/* Release the file */
+	freeimage(&input);
+	return 0;
+}
+
+/* txt2prg
+ * - tokenizes the programs in a text into memory
+ * in:	ctx_p - conversion context
+ *		text_p - text to tokenize
+ *		length - length of text
+ *		programs_pp - pointer to where to put the list of programs, in
+ *		              text order
+ * out:	number of programs found
+ */
+int txt2prg(context_t *ctx_p, const char *text_p, size_t length,
+            program_t **programs_pp)
+{
+	return tokenizebundle(ctx_p, text_p, length, programs_pp, NULL);
+}
+
+/* tokenizebundle
+ * - tokenizes the programs in a text into memory
+ * in:	ctx_p - conversion context
+ *		text_p - text to tokenize
+ *		length - length of text
+ *		programs_pp - pointer to where to put the list of programs, in
+ *		              text order
+ *		sidecar_p - sidecar of the text (-u), or NULL
+ * out:	number of programs found
+ */
+static int tokenizebundle(context_t *ctx_p, const char *text_p,
+                          size_t length, program_t **programs_pp,
+                          sidecar_t *sidecar_p)
+{
+	textsrc_t		input;
+	int				adr;
+	basic_t			mode;
+	char			filename[256];
+	membuf_t		line;
+	const char		*text;
+	int				morefiles = TRUE;
+	int				foundheader, foundextraheader;
+	int				count = 0;
+	program_t		**last_pp = programs_pp, *program_p;
+	stats_t			*stats_p = ctx_p->stats_p;
+	double			start;
+
+	input.data_p = text_p;
+	input.length = length;
+	input.pos = 0;
+	*programs_pp = NULL;
+	mbinit(&line);
+
 	/* Read each available file */
 	while (morefiles) {
 		/* Set default values */
 		adr = 0x0801;						/* default start address */
-		mode = (Any == force) ? Basic7
-		                      : force;		/* default BASIC mode */
+		mode = (Any == ctx_p->force) ? Basic7
+		                             : ctx_p->force;	/* default BASIC mode */
 
 		/* Locate the bastext/tok64 headers */
 		foundextraheader = FALSE;
 		foundheader = FALSE;
-		while (!foundheader && NULL != fgets(text, sizeof(text), input)) {
-			/* Remove the trailing newline marker that fgets stuck there */
-			text[sizeof(text) - 1] = 0;		/* if buffer was full */
-			text[strlen(text) - 1] = 0;		/* overwrite newline */
-
-			/* Check for trailing CR (when reading DOS text files under Unix) */
-			if ('\r' == text[strlen(text) - 1]) {
-				text[strlen(text) - 1] = 0;
-			}
+		start = starttimer(stats_p);
+		line.length = 0;
+		while (!foundheader && readline(&input, &line)) {
+			text = line.data_p;
+			line.length = 0;
 
 			/* Got a text line, check for tok64 / bastext header */
 			if (strncasecmp(text, "start bastext ", 14) == 0) {
@@ -120,7 +212,7 @@ void txt2bas(const char *infile, basic_t force, int t64mode)
 				/* If not in force mode, select BASIC dialect from start
 				 * address.
 				 */
-				if (Any == force)	mode = selectbasic(adr);
+				if (Any == ctx_p->force)	mode = selectbasic(ctx_p, adr);
 
 				/* If the start address was 0x132D, the original file was
 				 * a C128 BASIC 7.1 file with the BASIC extension bound to
@@ -136,14 +228,16 @@ void txt2bas(const char *infile, basic_t force, int t64mode)
 				foundheader = TRUE;
 
 				/* Retrieve the file name */
-				strcpy(filename, &text[12]);
+				strncpy(filename, &text[12], sizeof(filename) - 1);
+				filename[sizeof(filename) - 1] = 0;
 			}
 			else if (strncasecmp(text, "start tok128 ", 13) == 0) {
 				/* This is the header that starts the actual BASIC text */
 				foundheader = TRUE;
 
 				/* Retrieve the file name */
-				strcpy(filename, &text[13]);
+				strncpy(filename, &text[13], sizeof(filename) - 1);
+				filename[sizeof(filename) - 1] = 0;
 
 				/* If we didn't find a 'start bastext' header, this was a
 				 * standard 0x1C01 C128 BASIC file. Since program starting
@@ -152,98 +246,40 @@ void txt2bas(const char *infile, basic_t force, int t64mode)
 				 */
 				if (!foundextraheader) {
 					adr = 0x1C01;
-					if (Any == force)	mode = Basic71;
+					if (Any == ctx_p->force)	mode = Basic71;
 				}
 			}
 		}
-		
-		if (foundheader) {
-			/* A header was found, write a message and open a file
-			 * (in T64 mode: create dir entry)
-			 */
-			fprintf(stderr, "Tokenizing: %s\n", filename);
-
-			if (t64mode) {
-				/* Check if the T64 is full */
-				if (usedentries >= totalentries) {
-					fprintf(stderr, "T64 archive full: bastext.t64\n");
-					fclose(input);
-					fclose(output);
-					exit(1);
-				}
-
-				/* Create a T64 file record */
-				memset(&record, 0, sizeof(record));
-				record.allocflag = ALLOC_NORM;
-				record.filetype = 1; /* 0x82? */		/* PRG */
-				record.startaddress[0] = adr & 0xFF;	/* low */
-				record.startaddress[1] = adr >> 8;		/* high */
+		stoptimer(stats_p, ScanPhase, start);
 
-				/* Remove .prg from filename, copy it to the T64 record,
-				 * and make uppercase
-				 */
-				strcpy(text, filename);
-				if (NULL != (c_p = strstr(text, ".prg"))) {
-					*c_p = 0;
-				}
-				strncpy(record.filename, text, sizeof(record.filename));
-				/* Make uppercase, convert _ to spaces, and fill with spaces.
-				 * (strncpy pads with nulls if src is less than 'n')
-				 */
-				for (i = 0; i < sizeof(filename); i ++) {
-					if (0 == record.filename[i] || '_' == record.filename[i]) {
-						record.filename[i] = ' ';
-					}
-					else if (0x60 == (0x60 & record.filename[i])) {
-						record.filename[i] &= ~0x20;
-					}
-				}
+		if (foundheader) {
+			/* A header was found, write a message and add a program */
+			report(ctx_p, "Tokenizing: %s\n", filename);
 
-				/* Seek to end of file, and enter start offset into the
-				 * file record
-				 */
-				fseek(output, 0, SEEK_END);
-				fptr = ftell(output);
-				record.offset[0] = fptr & 0xFF;		/* low */
-				record.offset[1] = (fptr >> 8) & 0xFF;
-				record.offset[2] = (fptr >> 16) & 0xFF;
-				record.offset[3] = fptr >> 24;		/* high */
+			program_p = malloc(sizeof(program_t));
+			if (!program_p) {
+				reporterror(ctx_p, "Out of memory\n");
+				break;
 			}
-			else {
-				output = fopen(filename, "wb");
+			program_p->next_p = NULL;
+			strcpy(program_p->filename, filename);
+			program_p->adr = adr;
+			program_p->unchanged = FALSE;
+			mbinit(&program_p->data);
 
-				/* Write the start address */
-				fputc(adr & 0xFF, output);		/* low */
-				fputc(adr >> 8, output);		/* high */
+			/* Now convert the file to binary */
+			if (sidecar_p)	startsideprog(sidecar_p, filename, mode);
+			program_p->endadr = outconvert(ctx_p, &input, adr, mode,
+			                               &program_p->data, sidecar_p);
+			if (sidecar_p) {
+				program_p->unchanged = endsideprog(sidecar_p,
+				                                   &program_p->data);
 			}
 
-			/* Now convert the file to text */
-			adr = outconvert(input, output, adr, mode);
-
-			if (t64mode) {
-				/* Finish the T64 record (we now know the ending address)
-				 * and write it to the first unused position.
-				 */
-				record.endaddress[0] = adr & 0xFF;	/* low */
-				record.endaddress[1] = adr >> 8;		/* high */
-
-				fseek(output, sizeof(t64header_t) +
-				              sizeof(t64record_t) * usedentries, SEEK_SET);
-				fwrite(&record, sizeof(t64record_t), 1, output);
-
-				/* Update the T64 header */
-				usedentries ++;
-				header.numfiles[0] = usedentries & 0xFF;	/* low */
-				header.numfiles[1] = usedentries >> 8;		/* high */
-				fseek(output, (long) ((t64header_t *) NULL)->numfiles,
-				      SEEK_SET);
-				fwrite(&header.numfiles, sizeof(header.numfiles),
-				       1, output);
-			}
-			else {
-				/* Close output */
-				fclose(output);
-			}
+			*last_pp = program_p;
+			last_pp = &program_p->next_p;
+			count ++;
+			if (stats_p)	stats_p->programs ++;
 		}
 		else {
 			/* If we get here, we have reached EOF */
@@ -251,113 +287,802 @@ void txt2bas(const char *infile, basic_t force, int t64mode)
 		}
 	}
 
-	/* Close input */
-	fclose(input);
+	mbfree(&line);
+	return count;
+}
 
-	if (t64mode) {
-		/* Close T64 */
-		fclose(output);
+/* freeprograms
+ * - releases a list of tokenized programs
+ * in:	programs_p - list of programs
+ * out:	none
+ */
+void freeprograms(program_t *programs_p)
+{
+	program_t	*program_p;
+
+	while (programs_p) {
+		program_p = programs_p;
+		programs_p = program_p->next_p;
+		mbfree(&program_p->data);
+		free(program_p);
 	}
 }
 
-/* outconvert
- * - performs the actual conversion
- * in:	input - open file, positioned at start of BASIC text
- * 		output - open file, to write to
- *		adr - address to BASIC start
- *		mode - BASIC version to tokenize
- * out:	last address of file
+/* makerecord
+ * - fills in the T64 directory record of a program
+ * in:	record_p - record to fill in
+ *		program_p - program
+ *		offset - file offset of the program data
+ * out:	none
  */
-int outconvert(FILE *input, FILE *output, int adr, basic_t mode)
+static void makerecord(t64record_t *record_p, const program_t *program_p,
+                       long offset)
 {
-	char		text[512], buf[256];
-	int			goon = TRUE;
-	int			linelength;
-	unsigned	errors = 0;
+	char			text[256], *c_p;
+	unsigned int	i;
 
-	/* Read the file until we either find a "stop tok64/tok128" footer,
-	 * or get to the end-of-file marker
+	memset(record_p, 0, sizeof(t64record_t));
+	record_p->allocflag = ALLOC_NORM;
+	record_p->filetype = 1; /* 0x82? */		/* PRG */
+	record_p->startaddress[0] = program_p->adr & 0xFF;	/* low */
+	record_p->startaddress[1] = program_p->adr >> 8;	/* high */
+	record_p->endaddress[0] = program_p->endadr & 0xFF;	/* low */
+	record_p->endaddress[1] = program_p->endadr >> 8;	/* high */
+	makeoffset(record_p, offset);
+
+	/* Remove .prg from filename, copy it to the T64 record,
+	 * and make uppercase
+	 */
+	strcpy(text, program_p->filename);
+	if (NULL != (c_p = strstr(text, ".prg"))) {
+		*c_p = 0;
+	}
+	strncpy(record_p->filename, text, sizeof(record_p->filename));
+	/* Make uppercase, convert _ to spaces, and fill with spaces.
+	 * (strncpy pads with nulls if src is less than 'n')
+	 */
+	for (i = 0; i < sizeof(record_p->filename); i ++) {
+		if (0 == record_p->filename[i] || '_' == record_p->filename[i]) {
+			record_p->filename[i] = ' ';
+		}
+		else if (0x60 == (0x60 & record_p->filename[i])) {
+			record_p->filename[i] &= ~0x20;
+		}
+	}
+}
+
+/* ispadding
+ * - checks if a character pads a T64 file name
+ * in:	ch - character
+ * out:	TRUE for padding
+ */
+static int ispadding(unsigned char ch)
+{
+	return 0 == ch || ' ' == ch || 0xA0 == ch;
+}
+
+/* findrecord
+ * - finds the directory record of a program file of the same name, any
+ *   of the padding characters matching each other
+ * in:	records_p - directory
+ *		usedentries - number of records used
+ *		record_p - record with the file name to look for
+ * out:	index of the record, -1 if not found
+ */
+static int findrecord(const t64record_t *records_p, unsigned int usedentries,
+                      const t64record_t *record_p)
+{
+	unsigned int	i, j;
+	unsigned char	ch1, ch2;
+
+	for (i = 0; i < usedentries; i ++) {
+		if (ALLOC_NORM != records_p[i].allocflag)	continue;
+		for (j = 0; j < sizeof(record_p->filename); j ++) {
+			ch1 = records_p[i].filename[j];
+			ch2 = record_p->filename[j];
+			if (ch1 != ch2 && !(ispadding(ch1) && ispadding(ch2)))	break;
+		}
+		if (sizeof(record_p->filename) == j)	return (int) i;
+	}
+	return -1;
+}
+
+/* recordroom
+ * - finds the room there is for the data of a directory record, up to the
+ *   data of the next record or the end of the data; data shared with
+ *   another record, or not behind the directory, gives no room
+ * in:	records_p - directory
+ *		usedentries - number of records used
+ *		index - index of record
+ *		datastart - end of the directory in the archive
+ *		dataend - end of the data in the archive
+ * out:	number of bytes that can be written at the offset of the record
+ */
+static long recordroom(const t64record_t *records_p, unsigned int usedentries,
+                       unsigned int index, long datastart, long dataend)
+{
+	long			offset = recordoffset(&records_p[index]), end = dataend;
+	long			other;
+	unsigned int	i;
+
+	if (offset < datastart)	return 0;
+
+	for (i = 0; i < usedentries; i ++) {
+		if (i == index || ALLOC_FREE == records_p[i].allocflag)	continue;
+		other = recordoffset(&records_p[i]);
+		if (other >= offset && other < end)	end = other;
+	}
+	return (end > offset) ? end - offset : 0;
+}
+
+/* writet64
+ * - adds tokenized programs to the T64 archive named in the context.
+ *   The program data and the directory records are collected in memory
+ *   and written with a few large writes. A new archive gets room for all
+ *   programs in its directory; when the directory of an old archive is
+ *   too small, it is grown to at least twice its size and the program data
+ *   already in the archive is moved up behind it. With the replace option
+ *   (-r), a program with the same name as one already in the archive
+ *   replaces it: it is written over the old data if it fits there, or
+ *   else added behind the data, leaving the old data unused
+ * in:	ctx_p - conversion context
+ *		programs_p - list of programs, in archive order
+ * out:	zero if all programs were written
+ */
+static int writet64(context_t *ctx_p, const program_t *programs_p)
+{
+	FILE				*output;
+	const program_t		*program_p;
+	const char			*t64name = ctx_p->t64name;
+	stats_t				*stats_p = ctx_p->stats_p;
+	t64header_t			header;
+	t64record_t			*records_p, *grown_p;
+	membuf_t			data;
+	unsigned long		count, numrecords;
+	unsigned int		totalentries, usedentries, i;
+	long				dataend, dirend, filesize, moved;
+	size_t				length;
+	unsigned char		*old_p = NULL;
+	int					*replaces_p, rc = 0;
+	long				*places_p;
+	t64record_t			record;
+	unsigned long		k;
+
+	/* Number of programs, the directory size is a 16-bit word */
+	count = 0;
+	for (program_p = programs_p; program_p; program_p = program_p->next_p) {
+		count ++;
+	}
+
+	/* The record each program replaces, and where it is written over the
+	 * old data
 	 */
-	while (goon && NULL != fgets(text, sizeof(text), input)) {
-		/* Remove the trailing newline marker that fgets stuck there */
-		text[sizeof(text) - 1] = 0;		/* if buffer was full */
-		text[strlen(text) - 1] = 0;		/* overwrite newline */
-
-		/* Check for trailing CR (when reading DOS text files under Unix) */
-		if ('\r' == text[strlen(text) - 1]) {
-			text[strlen(text) - 1] = 0;
+	replaces_p = malloc((count ? count : 1) * sizeof(int));
+	places_p = malloc((count ? count : 1) * sizeof(long));
+	if (!replaces_p || !places_p) {
+		reporterror(ctx_p, "Out of memory\n");
+		free(replaces_p);
+		free(places_p);
+		return 1;
+	}
+	for (k = 0; k < count; k ++) {
+		replaces_p[k] = -1;
+		places_p[k] = -1;
+	}
+
+	/* If the T64 file exists, we want to continue adding to it */
+	output = fopen(t64name, "r+b");
+	if (NULL == output) {
+		/* Otherwise, create a new file */
+		output = fopen(t64name, "w+b");
+		if (NULL == output) {
+			reporterror(ctx_p, "Unable to create output file %s\n",
+			            t64name);
+			free(replaces_p);
+			free(places_p);
+			return 1;
 		}
 
-		/* Check for trailing backslash (line continuation) */
-		while ('\\' == text[strlen(text) - 1]) {
-			char	*c_p;
+		/* Create standard header, with a directory large enough for all
+		 * the programs
+		 */
+		numrecords = (count > STD_DIRSIZE) ? count : STD_DIRSIZE;
+		if (numrecords > MAX_DIRSIZE)	numrecords = MAX_DIRSIZE;
+		memset(&header, 0, sizeof(header));
+		strcpy(header.description, "C64 tape archive " PROGNAME "\x1a");
+		strncpy(header.title, "CREATED BY BASTEXT      ", 24);
+		header.version[0]  = 0x00;					/* low */
+		header.version[1]  = 0x01;					/* high */
 
-			/* Remove the backslash */
-			text[strlen(text) - 1] = 0;
+		totalentries = 0;
+		usedentries = 0;
+		records_p = NULL;
+		filesize = sizeof(header);
+	}
+	else {
+		/* We opened an old file, now check that it is valid */
+
+		/* Read the T64 header */
+		memset(&header, 0, sizeof(header));
+		fread(&header, sizeof(header), 1, output);
 
-			/* Get next line */
-			fgets(buf, sizeof(buf), input);
+		/* Check that it is a T64 file */
+		if (checkvalidheader(ctx_p, &header, &totalentries,
+		                     &usedentries, t64name)) {
+			/* It wasn't -> panic */
+			fclose(output);
+			free(replaces_p);
+			free(places_p);
+			return 1;
+		}
 
-			/* Remove the trailing newline marker that fgets stuck there */
-			buf[sizeof(buf) - 1] = 0;		/* if buffer was full */
-			buf[strlen(buf) - 1] = 0;		/* overwrite newline */
+		/* Read the whole directory */
+		records_p = readdirectory(ctx_p, output, totalentries, t64name);
+		if (!records_p) {
+			fclose(output);
+			free(replaces_p);
+			free(places_p);
+			return 1;
+		}
+		fseek(output, 0, SEEK_END);
+		filesize = ftell(output);
 
-			/* Check for trailing CR (when reading DOS text files under Unix) */
-			if ('\r' == buf[strlen(buf) - 1]) {
-				buf[strlen(buf) - 1] = 0;
+		/* Find the programs to replace, they need no new records */
+		if (ctx_p->replace) {
+			for (program_p = programs_p, k = 0; program_p;
+			     program_p = program_p->next_p, k ++) {
+				makerecord(&record, program_p, 0);
+				replaces_p[k] = findrecord(records_p, usedentries, &record);
+				if (-1 != replaces_p[k])	count --;
 			}
+		}
 
-			/* Make c_p point to first non-space character */
-			c_p = buf;
-			while (' ' == *c_p)	c_p ++;
+		/* Grow the directory if the programs do not fit */
+		numrecords = totalentries;
+		if (usedentries + count > totalentries) {
+			numrecords = 2 * (unsigned long) totalentries;
+			if (numrecords < usedentries + count) {
+				numrecords = usedentries + count;
+			}
+			if (numrecords > MAX_DIRSIZE)	numrecords = MAX_DIRSIZE;
+		}
+	}
+
+	/* Make room for the new directory */
+	if (numrecords > totalentries) {
+		grown_p = realloc(records_p, numrecords * sizeof(t64record_t));
+		if (!grown_p) {
+			reporterror(ctx_p, "Out of memory\n");
+			free(records_p);
+			free(replaces_p);
+			free(places_p);
+			fclose(output);
+			return 1;
+		}
+		records_p = grown_p;
+		memset(&records_p[totalentries], 0,
+		       (numrecords - totalentries) * sizeof(t64record_t));
+	}
 
-			/* If the combined line isn't too long, combine it */
-			if (strlen(text) + strlen(c_p) >= sizeof(text)) {
-				fprintf(stderr, "Line too long");
+	/* Data already in the archive, behind the old directory, is moved up
+	 * behind the new one
+	 */
+	dirend = sizeof(header) + totalentries * sizeof(t64record_t);
+	moved = (numrecords - totalentries) * sizeof(t64record_t);
+	if (filesize < dirend)	filesize = dirend;
+	if (moved && filesize > dirend) {
+		old_p = malloc(filesize - dirend);
+		if (!old_p) {
+			reporterror(ctx_p, "Out of memory\n");
+			free(records_p);
+			free(replaces_p);
+			free(places_p);
+			fclose(output);
+			return 1;
+		}
+		fseek(output, dirend, SEEK_SET);
+		length = fread(old_p, 1, filesize - dirend, output);
+		filesize = dirend + length;
+
+		for (i = 0; i < usedentries; i ++) {
+			if (ALLOC_FREE != records_p[i].allocflag &&
+			    recordoffset(&records_p[i]) >= dirend) {
+				makeoffset(&records_p[i], recordoffset(&records_p[i]) +
+				                          moved);
+			}
+		}
+	}
+	dataend = filesize + moved;
+
+	/* Collect the programs, without their start addresses, and fill in
+	 * their records
+	 */
+	mbinit(&data);
+	for (program_p = programs_p, k = 0; program_p;
+	     program_p = program_p->next_p, k ++) {
+		/* A replaced program is written over its old data if it fits */
+		if (-1 != replaces_p[k]) {
+			i = replaces_p[k];
+			length = program_p->data.length - 2;
+			if ((long) length <= recordroom(records_p, usedentries, i,
+			                                dirend + moved, dataend)) {
+				places_p[k] = recordoffset(&records_p[i]);
+				makerecord(&records_p[i], program_p, places_p[k]);
 			}
 			else {
-				strcat(text, buf);
+				makerecord(&records_p[i], program_p,
+				           dataend + data.length);
+				mbwrite(&data, program_p->data.data_p + 2, length);
 			}
+			continue;
+		}
+
+		/* Check if the T64 is full */
+		if (usedentries >= numrecords) {
+			reporterror(ctx_p, "T64 archive full: %s\n", t64name);
+			rc = 1;
+			break;
+		}
+
+		makerecord(&records_p[usedentries ++], program_p,
+		           dataend + data.length);
+		mbwrite(&data, program_p->data.data_p + 2,
+		        program_p->data.length - 2);
+	}
+
+	/* Update the T64 header */
+	header.maxfiles[0] = numrecords & 0xFF;		/* low */
+	header.maxfiles[1] = numrecords >> 8;		/* high */
+	header.numfiles[0] = usedentries & 0xFF;	/* low */
+	header.numfiles[1] = usedentries >> 8;		/* high */
+
+	/* Write the header and the directory, then the moved and new data */
+	fseek(output, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, output);
+	fwrite(records_p, sizeof(t64record_t), numrecords, output);
+	if (old_p) {
+		fwrite(old_p, 1, filesize - dirend, output);
+	}
+	else {
+		fseek(output, dataend, SEEK_SET);
+	}
+	fwrite(data.data_p, 1, data.length, output);
+
+	if (stats_p) {
+		stats_p->bytesout += sizeof(header) +
+		                     numrecords * sizeof(t64record_t) +
+		                     (old_p ? filesize - dirend : 0) + data.length;
+	}
+
+	/* Write the replaced programs that fit over their old data */
+	for (program_p = programs_p, k = 0; program_p;
+	     program_p = program_p->next_p, k ++) {
+		if (-1 != places_p[k]) {
+			fseek(output, places_p[k], SEEK_SET);
+			fwrite(program_p->data.data_p + 2, 1,
+			       program_p->data.length - 2, output);
+			if (stats_p)	stats_p->bytesout += program_p->data.length - 2;
 		}
+	}
+
+	/* Close T64 */
+	if (fclose(output)) {
+		reporterror(ctx_p, "Unable to write output file %s\n", t64name);
+		rc = 1;
+	}
+	mbfree(&data);
+	free(old_p);
+	free(records_p);
+	free(replaces_p);
+	free(places_p);
+	return rc;
+}
+
+/* writebundle
+ * - writes tokenized programs to binary files, or to the T64 archive
+ *   named in the context, and releases them
+ * in:	ctx_p - conversion context
+ *		programs_p - list of programs, from readbundle
+ * out:	zero if all programs were written
+ */
+int writebundle(context_t *ctx_p, program_t *programs_p)
+{
+	FILE			*output;
+	program_t		*program_p;
+	struct stat		info;
+	int				rc = 0;
+	stats_t			*stats_p = ctx_p->stats_p;
+	double			start;
+
+	start = starttimer(stats_p);
+
+	/* In T64 mode, all programs go to the T64 archive */
+	if (ctx_p->t64name) {
+		rc = writet64(ctx_p, programs_p);
+		freeprograms(programs_p);
+		stoptimer(stats_p, WritePhase, start);
+		return rc;
+	}
 
-		/* Check if "stop tok64/tok128" marker */
-		if (strncasecmp(text, "stop tok", 8) == 0) {
-			goon = FALSE;
+	/* Write each program */
+	while (programs_p) {
+		program_p = programs_p;
+
+		/* A program that did not change need not be written again, if
+		 * the file is still there
+		 */
+		if (program_p->unchanged &&
+		    0 == stat(program_p->filename, &info) &&
+		    (unsigned long) info.st_size == program_p->data.length) {
+			report(ctx_p, "Unchanged: %s\n", program_p->filename);
+		}
+		else if (NULL == (output = fopen(program_p->filename, "wb"))) {
+			reporterror(ctx_p, "Unable to create output file %s\n",
+			            program_p->filename);
+			rc = 1;
 		}
 		else {
-			/* Tokenize */
-			if (tokenize(text, buf, &linelength, mode)) {
-				errors ++;		/* error if nonzero */
-			}
+			/* Write the program file in one go */
+			fwrite(program_p->data.data_p, program_p->data.length, 1,
+			       output);
+			if (stats_p)	stats_p->bytesout += program_p->data.length;
+
+			/* Close output */
+			fclose(output);
+		}
+
+		/* Release it */
+		programs_p = program_p->next_p;
+		mbfree(&program_p->data);
+		free(program_p);
+	}
+	stoptimer(stats_p, WritePhase, start);
+
+	return rc;
+}
+
+/* tokenizeprg
+ * - tokenizes a BASIC listing into a program file image
+ * in:	ctx_p - conversion context
+ *		text_p - listing, up to a "stop tok64/tok128" footer or the end
+ *		length - length of listing
+ *		adr - address of BASIC start
+ *		mode - BASIC version to tokenize
+ *		output - buffer to append the program file image to
+ * out:	last address of program
+ */
+int tokenizeprg(context_t *ctx_p, const char *text_p, size_t length,
+                int adr, basic_t mode, membuf_t *output)
+{
+	textsrc_t	input;
+
+	input.data_p = text_p;
+	input.length = length;
+	input.pos = 0;
+	return outconvert(ctx_p, &input, adr, mode, output, NULL);
+}
+
+/* getbasicline
+ * - reads the next line of BASIC text, joining continued lines
+ * in:	input_p - text to read from
+ *		line - buffer to read into, null terminated on return
+ * out:	TRUE if a line was read, FALSE at the "stop tok64/tok128" footer or
+ *		the end of the text
+ */
+static int getbasicline(textsrc_t *input_p, membuf_t *line)
+{
+	line->length = 0;
+	if (!readline(input_p, line)) {
+		return FALSE;
+	}
+
+	/* Check for trailing backslash (line continuation) */
+	while (line->length && '\\' == line->data_p[line->length - 1]) {
+		/* Remove the backslash, and add the next line in its place */
+		line->data_p[-- line->length] = 0;
+		if (!readline(input_p, line))	break;
+	}
+
+	/* Check if "stop tok64/tok128" marker */
+	return strncasecmp(line->data_p, "stop tok", 8) != 0;
+}
+
+/* tokenizeline
+ * - tokenizes a line of BASIC text onto the end of a program file image
+ * in:	ctx_p - conversion context
+ *		text_p - line to tokenize, null terminated
+ *		length - length of line
+ *		adr - address of the line
+ *		mode - BASIC version to tokenize
+ *		output - buffer to write to
+ *		errors_p - pointer to the count of lines with errors
+ *		sidecar_p - sidecar to reuse unchanged lines from (-u), or NULL
+ * out:	address of the next line
+ */
+static int tokenizeline(context_t *ctx_p, const char *text_p, size_t length,
+                        int adr, basic_t mode, membuf_t *output,
+                        unsigned *errors_p, sidecar_t *sidecar_p)
+{
+	stats_t				*stats_p = ctx_p->stats_p;
+	char				*line_p;
+	int					linelength;
+	double				start;
+	const sideline_t	*old_p = NULL;
+	unsigned long		hash1, hash2;
+	int					failed = FALSE;
+
+	/* Tokenize straight into the image, after the next-line pointer */
+	line_p = mbreserve(output, 2 + TOKENIZEDSIZE(length));
+	start = starttimer(stats_p);
+	if (sidecar_p) {
+		old_p = findsideline(sidecar_p, text_p, length, &hash1, &hash2);
+	}
+	if (old_p && old_p->bytes <= TOKENIZEDSIZE(length)) {
+		/* Unchanged since the last run */
+		memcpy(line_p + 2, old_p->bytes_p, old_p->bytes);
+		linelength = old_p->bytes;
+	}
+	else if (tokenize(ctx_p, text_p, line_p + 2, &linelength, mode)) {
+		failed = TRUE;		/* error if nonzero */
+	}
+	if (linelength + 2 >= 256) {
+		/* The next-line pointer could not be followed to the next line */
+		report(ctx_p, "* Tokenized line too long: %d bytes at line %u\n",
+		       linelength + 2, (unsigned char) line_p[2] |
+		       ((unsigned char) line_p[3] << 8));
+		failed = TRUE;
+	}
+	if (failed) {
+		(*errors_p) ++;
+
+		/* Lines with errors are left out of the sidecar, to be reported
+		 * again the next time
+		 */
+		sidecar_p = NULL;
+	}
+	if (sidecar_p) {
+		addsideline(sidecar_p, hash1, hash2, text_p, length, line_p + 2,
+		            linelength);
+	}
+	stoptimer(stats_p, ConvertPhase, start);
+	if (stats_p)	stats_p->lines ++;
+
+	/* Fill in next-line pointer */
+	adr += linelength + 2;
+	line_p[0] = adr & 0xFF;		/* low */
+	line_p[1] = adr >> 8;		/* high */
+	output->length += linelength + 2;
+
+	return adr;
+}
+
+/* Lines of a listing, read ahead to be tokenized in parallel */
+typedef struct linelist_s {
+	membuf_t	text;			/* the lines, each null terminated */
+	membuf_t	starts;			/* offset of each line and of the end of
+								   the last, size_t */
+	int			count;			/* number of lines */
+} linelist_t;
+
+/* Batch of lines, tokenized on a worker thread */
+typedef struct batch_s {
+	context_t	ctx;			/* messages and statistics of the batch */
+	stats_t		stats;
+	membuf_t	image;			/* the tokenized lines, with next-line
+								   pointers relative to the batch */
+	int			ends[BATCHLINES];	/* end of each line in image */
+	unsigned	errors;			/* number of lines with errors */
+} batch_t;
+
+/* Parallel tokenization of a listing, shared by the batches */
+typedef struct tokenizerun_s {
+	context_t	*ctx_p;
+	basic_t		mode;
+	linelist_t	*lines_p;
+	batch_t		*batches_p;
+	int			adr;			/* address of the next line to commit */
+	unsigned	errors;			/* number of lines with errors */
+	membuf_t	*output;
+} tokenizerun_t;
+
+/* tokenizebatch
+ * - tokenizes a batch of lines, may run on a worker thread
+ * in:	job - index of batch
+ *		run_p - parallel tokenization
+ * out:	none
+ */
+static void tokenizebatch(int job, void *run_p)
+{
+	tokenizerun_t	*r = run_p;
+	batch_t			*batch_p = &r->batches_p[job];
+	const size_t	*starts_p = (const size_t *) r->lines_p->starts.data_p;
+	int				first = job * BATCHLINES, i, adr = 0;
+
+	/* Tokenize as if the batch started at address zero */
+	for (i = 0; i < BATCHLINES && first + i < r->lines_p->count; i ++) {
+		adr = tokenizeline(&batch_p->ctx,
+		                   r->lines_p->text.data_p + starts_p[first + i],
+		                   starts_p[first + i + 1] - starts_p[first + i] - 1,
+		                   adr, r->mode, &batch_p->image, &batch_p->errors,
+		                   NULL);
+		batch_p->ends[i] = adr;
+	}
+}
+
+/* commitbatch
+ * - fills in the next-line pointers of a tokenized batch and adds it to
+ *   the program file image, in batch order
+ * in:	job - index of batch
+ *		run_p - parallel tokenization
+ * out:	none
+ */
+static void commitbatch(int job, void *run_p)
+{
+	tokenizerun_t	*r = run_p;
+	batch_t			*batch_p = &r->batches_p[job];
+	unsigned char	*line_p = (unsigned char *) batch_p->image.data_p;
+	int				first = job * BATCHLINES, i, next;
+
+	/* The pointers are the running address plus the end of each line */
+	for (i = 0; i < BATCHLINES && first + i < r->lines_p->count; i ++) {
+		next = r->adr + batch_p->ends[i];
+		line_p[0] = next & 0xFF;		/* low */
+		line_p[1] = (next >> 8) & 0xFF;	/* high */
+		line_p = (unsigned char *) batch_p->image.data_p + batch_p->ends[i];
+	}
+	r->adr += batch_p->image.length;
+	r->errors += batch_p->errors;
+	mbwrite(r->output, batch_p->image.data_p, batch_p->image.length);
+
+	/* Pass on the messages and statistics, in line order */
+	mergecontext(r->ctx_p, &batch_p->ctx);
+
+	mbfree(&batch_p->image);
+	freecontext(&batch_p->ctx);
+}
+
+/* tokenizelines
+ * - reads the lines of a listing, and tokenizes them in batches on
+ *   worker threads if there are many of them; the next-line pointers,
+ *   which depend on the length of all lines before, are filled in as the
+ *   batches are added to the image in order
+ * in:	ctx_p - conversion context
+ *		input_p - text, positioned at start of BASIC text
+ *		adr - address to BASIC start
+ *		mode - BASIC version to tokenize
+ *		output - buffer to write to
+ *		errors_p - pointer to the count of lines with errors
+ * out:	address following the last line
+ */
+static int tokenizelines(context_t *ctx_p, textsrc_t *input_p, int adr,
+                         basic_t mode, membuf_t *output, unsigned *errors_p)
+{
+	linelist_t		lines;
+	tokenizerun_t	run;
+	membuf_t		line;
+	size_t			start;
+	const size_t	*starts_p;
+	int				i, numbatches;
+
+	/* Read ahead all the lines */
+	mbinit(&lines.text);
+	mbinit(&lines.starts);
+	lines.count = 0;
+	mbinit(&line);
+	while (getbasicline(input_p, &line)) {
+		start = lines.text.length;
+		mbwrite(&lines.starts, &start, sizeof(start));
+		mbwrite(&lines.text, line.data_p, line.length + 1);
+		lines.count ++;
+	}
+	mbfree(&line);
+	start = lines.text.length;
+	mbwrite(&lines.starts, &start, sizeof(start));
+	starts_p = (const size_t *) lines.starts.data_p;
+
+	if (lines.count < PARALLELLINES) {
+		/* Too few to be worth it */
+		for (i = 0; i < lines.count; i ++) {
+			adr = tokenizeline(ctx_p, lines.text.data_p + starts_p[i],
+			                   starts_p[i + 1] - starts_p[i] - 1,
+			                   adr, mode, output, errors_p, NULL);
+		}
+	}
+	else {
+		numbatches = (lines.count + BATCHLINES - 1) / BATCHLINES;
+		run.ctx_p = ctx_p;
+		run.mode = mode;
+		run.lines_p = &lines;
+		run.adr = adr;
+		run.errors = 0;
+		run.output = output;
+		run.batches_p = malloc(numbatches * sizeof(batch_t));
+		if (!run.batches_p) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+
+		/* Each batch collects its own messages and statistics, the
+		 * context's own are added to as the batches are committed
+		 */
+		for (i = 0; i < numbatches; i ++) {
+			forkcontext(&run.batches_p[i].ctx, ctx_p,
+			            &run.batches_p[i].stats);
+			mbinit(&run.batches_p[i].image);
+			run.batches_p[i].errors = 0;
+		}
+
+		runjobs(numbatches, ctx_p->threads, tokenizebatch, commitbatch, &run);
+
+		free(run.batches_p);
+		adr = run.adr;
+		*errors_p += run.errors;
+	}
+
+	mbfree(&lines.starts);
+	mbfree(&lines.text);
+	return adr;
+}
 
-			/* Write next-line pointer */
-			adr += linelength + 2;
-			fputc(adr & 0xFF, output);	/* low */
-			fputc(adr >> 8, output);	/* high */
+/* outconvert
+ * - performs the actual conversion, building the program file image in
+ *   memory so that it can be written at once
+ * in:	ctx_p - conversion context
+ *		input_p - text, positioned at start of BASIC text
+ *		adr - address to BASIC start
+ *		mode - BASIC version to tokenize
+ *		output - buffer to write to
+ *		sidecar_p - sidecar to reuse unchanged lines from (-u), or NULL
+ * out:	last address of file
+ */
+int outconvert(context_t *ctx_p, textsrc_t *input_p, int adr, basic_t mode,
+               membuf_t *output, sidecar_t *sidecar_p)
+{
+	char		text[64], buf[256];
+	membuf_t	line;
+	int			linelength;
+	unsigned	errors = 0;
+	stats_t		*stats_p = ctx_p->stats_p;
 
-			/* Write line */
-			fwrite(&buf, linelength, 1, output);
+	/* Start address */
+	mbputc(output, adr & 0xFF);		/* low */
+	mbputc(output, adr >> 8);		/* high */
+
+	/* Read the file until we either find a "stop tok64/tok128" footer,
+	 * or get to the end-of-file marker
+	 */
+	if (ctx_p->threads > 1 && !sidecar_p) {
+		adr = tokenizelines(ctx_p, input_p, adr, mode, output, &errors);
+	}
+	else {
+		mbinit(&line);
+		while (getbasicline(input_p, &line)) {
+			adr = tokenizeline(ctx_p, line.data_p, line.length, adr, mode,
+			                   output, &errors, sidecar_p);
 		}
+		mbfree(&line);
 	}
 
+	if (stats_p)	stats_p->errors += errors;
+
 	/* If we had errors while interpreting the source, say so */
 	if (errors) {
 		sprintf(text, "63999 REM\"%u errors in tokenization", errors);
-		tokenize(text, buf, &linelength, mode);
+		tokenize(ctx_p, text, buf, &linelength, mode);
 
 		/* Write tokenized line to program */
 		adr += linelength + 2;
-		fputc(adr & 0x7F, output);
-		fputc(adr >> 8, output);
-		fwrite(&buf, linelength, 1, output);
+		mbputc(output, adr & 0xFF);
+		mbputc(output, adr >> 8);
+		mbwrite(output, buf, linelength);
 	}
 
 	/* The program is ended by having a null nextline pointer */
-	fputc(0, output);
-	fputc(0, output);
+	mbputc(output, 0);
+	mbputc(output, 0);
 
 	/* adr points to last line pointer, which contains two nulls, so the
 	 * last used address is adr+1
 	 */
 	return adr + 1;
-}
\ No newline at end of file
+}
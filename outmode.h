@@ -6,7 +6,28 @@
 #define __OUTMODE_H
 
 #include "tokenize.h"
+#include "membuf.h"
+#include "context.h"
 
-void txt2bas(const char *infile, basic_t force, int t64mode);
+/* Tokenized program, read from a text file */
+typedef struct program_s {
+	struct program_s	*next_p;		/* next program in file */
+	char				filename[256];	/* file name from header */
+	int					adr;			/* start address */
+	int					endadr;			/* last address used */
+	membuf_t			data;			/* program file image, starting with
+										   the start address */
+	int					unchanged;		/* same as the last time it was
+										   tokenized (-u) */
+} program_t;
 
-#endif
\ No newline at end of file
+int tokenizeprg(context_t *ctx_p, const char *text_p, size_t length,
+                int adr, basic_t mode, membuf_t *output);
+int txt2prg(context_t *ctx_p, const char *text_p, size_t length,
+            program_t **programs_pp);
+void freeprograms(program_t *programs_p);
+int txt2bas(context_t *ctx_p, const char *infile);
+int readbundle(context_t *ctx_p, const char *infile, program_t **programs_pp);
+int writebundle(context_t *ctx_p, program_t *programs_p);
+
+#endif
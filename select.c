@@ -3,16 +3,41 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "select.h"
 #include "tokenize.h"
+#include "tokens.h"
+#include "context.h"
+
+#define FALSE 0
+#define TRUE 1
+
+/* Names of the BASIC dialects, for messages */
+static const char *basicnames[] = {
+	"BASIC 2.0", "BASIC 2.0", "Graphics52", "TFC3", "BASIC 7.0",
+	"BASIC 7.1", "BASIC 3.5", "BASIC 4.0", "VIC Super Extender"
+};
+
+/* Dialects that detectbasic chooses between, in order of preference,
+ * the first NUMPRINTABLE of them can be detokenized into text
+ */
+static const basic_t candidates[] = {
+	Basic2, TFC3, Graphics52, Basic7, Basic71, Basic35, Basic4, VicSuper
+};
+#define NUMCANDIDATES (sizeof(candidates) / sizeof(candidates[0]))
+#define NUMPRINTABLE 5
+
+/* First token byte that differs between the dialects */
+#define FIRSTEXTENSION 0xCC
 
 /* selectbasic
  * - Selects a BASIC dialect with regard to the starting address
- * in:	adr - starting address
+ * in:	ctx_p - context to report unrecognized addresses to
+ *		adr - starting address
  * out:	BASIC dialect
  */
-basic_t selectbasic(int adr)
+basic_t selectbasic(context_t *ctx_p, int adr)
 {
 	/* With regard to the starting address, select a probable
 	 * BASIC version
@@ -52,9 +77,224 @@ basic_t selectbasic(int adr)
 			break;
 
 		default:
-			fprintf(stderr, "* Unrecognized start address of BASIC: %04x\n",
-			        adr);
+			report(ctx_p, "* Unrecognized start address of BASIC: %04x\n",
+			       adr);
 			return Basic71;
 			break;
 	}
-}
\ No newline at end of file
+}
+/* hasprefixes
+ * - checks whether a BASIC dialect has 0xCE/0xFE prefixed tokens
+ * in:	mode - BASIC dialect
+ * out:	TRUE / FALSE
+ */
+static int hasprefixes(basic_t mode)
+{
+	const tokenseg_t	*seg_p;
+
+	for (seg_p = dialects[mode]; seg_p->table_p; seg_p ++) {
+		if (seg_p->prefix)	return TRUE;
+	}
+	return FALSE;
+}
+
+/* extensionsize
+ * - counts the token values a BASIC dialect adds to BASIC 2.0
+ * in:	mode - BASIC dialect
+ * out:	number of token values
+ */
+static int extensionsize(basic_t mode)
+{
+	const tokenseg_t	*seg_p;
+	int					size = 0;
+
+	for (seg_p = dialects[mode]; seg_p->table_p; seg_p ++) {
+		if (seg_p->prefix || seg_p->offset >= FIRSTEXTENSION) {
+			size += seg_p->last - seg_p->first + 1;
+		}
+	}
+	return size;
+}
+
+/* samekeywords
+ * - checks whether two BASIC dialects read the tokens a program uses as
+ *   the same keywords
+ * in:	count - counts of the tokens used, unprefixed/0xCE/0xFE
+ *		mode1, mode2 - BASIC dialects
+ * out:	TRUE / FALSE
+ */
+static int samekeywords(unsigned long count[3][256], basic_t mode1,
+                        basic_t mode2)
+{
+	const char	*keyword1_p, *keyword2_p;
+	int			prefixed1, prefixed2, token, next;
+
+	for (token = FIRSTEXTENSION; token < 0xFF; token ++) {
+		if (!count[0][token])	continue;
+
+		prefixed1 = (0xCE == token || 0xFE == token) && hasprefixes(mode1);
+		prefixed2 = (0xCE == token || 0xFE == token) && hasprefixes(mode2);
+		if (prefixed1 != prefixed2)	return FALSE;
+
+		if (!prefixed1) {
+			keyword1_p = findkeyword(mode1, 0, token);
+			keyword2_p = findkeyword(mode2, 0, token);
+			if (keyword1_p != keyword2_p &&
+			    (!keyword1_p || !keyword2_p ||
+			     strcmp(keyword1_p, keyword2_p))) {
+				return FALSE;
+			}
+			continue;
+		}
+
+		/* The keywords follow the prefix byte */
+		for (next = 0; next < 256; next ++) {
+			if (!count[0xCE == token ? 1 : 2][next])	continue;
+			keyword1_p = findkeyword(mode1, token, next);
+			keyword2_p = findkeyword(mode2, token, next);
+			if (keyword1_p != keyword2_p &&
+			    (!keyword1_p || !keyword2_p ||
+			     strcmp(keyword1_p, keyword2_p))) {
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
+
+/* detectbasic
+ * - Selects a BASIC dialect with regard to the tokens a program uses.
+ *   The extension tokens (0xCC-0xFE) and 0xCE/0xFE prefixed tokens used
+ *   outside strings, REM and DATA are counted in one pass over the
+ *   program, and the dialect that has the fewest of them undefined is
+ *   chosen. Ties go to the dialect selected from the starting address, so
+ *   programs that only use tokens common to the candidates keep it, and
+ *   otherwise to the dialect with the fewest tokens of its own. Dialects
+ *   that use the same token values can only be told apart this way, so if
+ *   the best of them read the tokens as different keywords, the guess is
+ *   kept and the ambiguity reported.
+ * in:	ctx_p - context to report a changed dialect to
+ *		prg_p - BASIC program, following the start address
+ *		length - length of BASIC program
+ *		adr - starting address
+ *		guess - BASIC dialect selected from the starting address
+ *		printable - TRUE to only choose dialects that can be detokenized
+ * out:	BASIC dialect
+ */
+basic_t detectbasic(context_t *ctx_p, const unsigned char *prg_p,
+                    size_t length, int adr, basic_t guess, int printable)
+{
+	unsigned long	count[3][256];	/* tokens, unprefixed/0xCE/0xFE */
+	unsigned long	undefined[NUMCANDIDATES], fewest = 0, used = 0;
+	size_t			pos = 0, end;
+	int				nextadr, quotemode, datamode, prefixed, token;
+	int				bestsize = 0;
+	unsigned		i, numcandidates;
+	basic_t			mode, best = guess;
+
+	memset(count, 0, sizeof(count));
+
+	/* A BASIC 7.1 extension bound to the program is skipped, as in
+	 * inconvert
+	 */
+	if (0x132D == adr) {
+		pos = 0x1C01 - 0x132D;
+		adr = 0x1C01;
+	}
+
+	/* Walk the lines the way inconvert does, counting the tokens */
+	while (pos + 4 < length) {
+		nextadr = prg_p[pos] | (prg_p[pos + 1] << 8);
+		if (!nextadr || nextadr <= adr || nextadr - adr >= 256)	break;
+
+		end = pos + (nextadr - adr);
+		if (end > length)	end = length;
+		quotemode = datamode = FALSE;
+		for (pos += 4; pos < end && prg_p[pos]; pos ++) {
+			token = prg_p[pos];
+			if (34 == token) {
+				quotemode = !quotemode;
+			}
+			else if (quotemode) {
+				continue;
+			}
+			else if (datamode) {
+				if (':' == token)	datamode = FALSE;
+			}
+			else if (0x8F == token) {		/* REM */
+				break;
+			}
+			else if (0x83 == token) {		/* DATA */
+				datamode = TRUE;
+			}
+			else if (token >= FIRSTEXTENSION && token < 0xFF) {
+				count[0][token] ++;
+				if ((0xCE == token || 0xFE == token) && pos + 1 < end) {
+					count[0xCE == token ? 1 : 2][prg_p[pos + 1]] ++;
+				}
+			}
+		}
+
+		pos = end;
+		adr = nextadr;
+	}
+
+	/* Score the candidates, the prefix bytes are tokens of their own in
+	 * the dialects without prefixed tokens
+	 */
+	/* All candidates are scored, to find out whether another dialect reads
+	 * the tokens as well as the one chosen
+	 */
+	numcandidates = printable ? NUMPRINTABLE : NUMCANDIDATES;
+	for (i = 0; i < NUMCANDIDATES; i ++) {
+		mode = candidates[i];
+		prefixed = hasprefixes(mode);
+		undefined[i] = 0;
+		for (token = FIRSTEXTENSION; token < 0xFF; token ++) {
+			if (count[0][token] &&
+			    !(prefixed && (0xCE == token || 0xFE == token)) &&
+			    findtokentable(mode, 0, token) < 0) {
+				undefined[i] += count[0][token];
+			}
+		}
+		for (token = 0; prefixed && token < 256; token ++) {
+			if (count[1][token] && findtokentable(mode, 0xCE, token) < 0) {
+				undefined[i] += count[1][token];
+			}
+			if (count[2][token] && findtokentable(mode, 0xFE, token) < 0) {
+				undefined[i] += count[2][token];
+			}
+		}
+
+		if (guess == mode)	used = undefined[i];
+		if (i >= numcandidates)	continue;
+		if (0 == i || undefined[i] < fewest ||
+		    (undefined[i] == fewest && extensionsize(mode) < bestsize)) {
+			fewest = undefined[i];
+			best = mode;
+			bestsize = extensionsize(mode);
+		}
+	}
+
+	/* Keep the guess if it does as well as the best candidate */
+	if (used == fewest) {
+		return guess;
+	}
+
+	/* or if the tokens could be the keywords of another candidate that
+	 * does as well
+	 */
+	for (i = 0; i < NUMCANDIDATES; i ++) {
+		if (undefined[i] <= fewest && !samekeywords(count, best,
+		                                            candidates[i])) {
+			report(ctx_p, "* BASIC dialect ambiguous from tokens: %s or %s, "
+			       "kept %s\n", basicnames[best],
+			       basicnames[candidates[i]], basicnames[guess]);
+			return guess;
+		}
+	}
+
+	report(ctx_p, "* BASIC dialect detected from tokens: %s\n",
+	       basicnames[best]);
+	return best;
+}
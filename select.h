@@ -5,8 +5,13 @@
 #ifndef __SELECT_H
 #define __SELECT_H
 
+#include <stddef.h>
+
 #include "tokenize.h"
+#include "context.h"
 
-basic_t selectbasic(int adr);
+basic_t selectbasic(context_t *ctx_p, int adr);
+basic_t detectbasic(context_t *ctx_p, const unsigned char *prg_p,
+                    size_t length, int adr, basic_t guess, int printable);
 
 #endif
\ No newline at end of file
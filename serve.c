@@ -0,0 +1,466 @@
+/* serve.c
+ * - conversion server (--serve), converting files sent by clients over a
+ *   Unix domain socket, or over standard input and output
+ * $Id$
+ */
+
+/* Protocol
+ * A client sends any number of requests on its connection, each a line
+ *   command flags length [title]
+ * followed by length bytes of data, where command is one of
+ *   prg - program file to convert to text
+ *   t64 - T64 archive to convert to text
+ *   txt - text to convert to program files
+ * flags are the modifier options to use (a, s, g, 2, 3, 5, 7, 1), or "-"
+ * for none, and title is the name to give the program in the text header.
+ * Each request is answered by a line
+ *   status length msglength
+ * where status is "ok" or "error", followed by length bytes of converted
+ * data and msglength bytes of messages. The data for txt requests is each
+ * program file, as a line "length filename" followed by the file image.
+ * An invalid request is answered with "error" and the connection closed,
+ * as is a socket connection idle for SERVETIMEOUT seconds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef __EMX__
+# include <errno.h>
+# include <signal.h>
+# include <unistd.h>
+# include <pthread.h>
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/time.h>
+# include <sys/socket.h>
+# include <sys/uio.h>
+# include <sys/un.h>
+#endif
+
+#include "serve.h"
+#include "inmode.h"
+#include "outmode.h"
+#include "membuf.h"
+#include "context.h"
+#include "sink.h"
+
+#define FALSE 0
+#define TRUE 1
+
+#ifndef __EMX__
+
+/* Largest request accepted */
+#define MAXREQUEST (64 * 1024 * 1024)
+
+/* Buffers grown larger than this by a request are released after it */
+#define KEEPSIZE (1024 * 1024)
+
+/* Size of the read-ahead buffer of a connection, also the longest
+ * request line
+ */
+#define CONNBUFSIZE 4096
+
+/* Connection to a client */
+typedef struct conn_s {
+	int		infd, outfd;
+	char	buf[CONNBUFSIZE];		/* data read ahead */
+	size_t	pos, end;				/* part of buf not used yet */
+} conn_t;
+
+/* Buffers of a worker, kept between requests */
+typedef struct worker_s {
+	context_t	ctx;
+	membuf_t	request;		/* data of request */
+	membuf_t	output;			/* converted data */
+} worker_t;
+
+/* Server, shared by the workers */
+typedef struct server_s {
+	int				listenfd;
+	const context_t	*options_p;		/* options given on the command line */
+} server_t;
+
+/* readrequestline
+ * - reads the line starting a request
+ * in:	conn_p - connection
+ *		line - buffer to read into, CONNBUFSIZE bytes
+ * out:	TRUE if a line was read, FALSE at end of input, -1 on error or
+ *		for too long line
+ */
+static int readrequestline(conn_t *conn_p, char *line)
+{
+	char	*newline_p;
+	ssize_t	got;
+
+	for (;;) {
+		newline_p = memchr(conn_p->buf + conn_p->pos, '\n',
+		                   conn_p->end - conn_p->pos);
+		if (newline_p) {
+			*newline_p = 0;
+			strcpy(line, conn_p->buf + conn_p->pos);
+			conn_p->pos = newline_p + 1 - conn_p->buf;
+			return TRUE;
+		}
+
+		/* Move what there is to the start, and read more */
+		memmove(conn_p->buf, conn_p->buf + conn_p->pos,
+		        conn_p->end - conn_p->pos);
+		conn_p->end -= conn_p->pos;
+		conn_p->pos = 0;
+		if (CONNBUFSIZE == conn_p->end)	return -1;
+
+		got = read(conn_p->infd, conn_p->buf + conn_p->end,
+		           CONNBUFSIZE - conn_p->end);
+		if (got < 0 && EINTR == errno)	continue;
+		if (got < 0)	return -1;
+		if (0 == got)	return conn_p->end ? -1 : FALSE;
+		conn_p->end += got;
+	}
+}
+
+/* readdata
+ * - reads the data of a request
+ * in:	conn_p - connection
+ *		data_p - buffer to read into
+ *		length - amount to read
+ * out:	zero if ok, nonzero on error or end of input
+ */
+static int readdata(conn_t *conn_p, char *data_p, size_t length)
+{
+	size_t	have = conn_p->end - conn_p->pos;
+	ssize_t	got;
+
+	/* First what was read ahead, then straight into the buffer */
+	if (have > length)	have = length;
+	memcpy(data_p, conn_p->buf + conn_p->pos, have);
+	conn_p->pos += have;
+	data_p += have;
+	length -= have;
+
+	while (length) {
+		got = read(conn_p->infd, data_p, length);
+		if (got < 0 && EINTR == errno)	continue;
+		if (got <= 0)	return -1;
+		data_p += got;
+		length -= got;
+	}
+	return 0;
+}
+
+/* setflags
+ * - sets the options of a request
+ * in:	ctx_p - context of request
+ *		flags - modifier options, "-" for none
+ * out:	zero if ok, nonzero for unknown options
+ */
+static int setflags(context_t *ctx_p, const char *flags)
+{
+	if (0 == strcmp(flags, "-"))	return 0;
+
+	for (; *flags; flags ++) {
+		switch (*flags) {
+			case 'a':	ctx_p->allfiles = TRUE;		break;
+			case 's':	ctx_p->strict = TRUE;		break;
+			case 'g':	ctx_p->detect = TRUE;		break;
+			case '2':	ctx_p->force = Basic2;		break;
+			case '3':	ctx_p->force = TFC3;		break;
+			case '5':	ctx_p->force = Graphics52;	break;
+			case '7':	ctx_p->force = Basic7;		break;
+			case '1':	ctx_p->force = Basic71;		break;
+			default:	return 1;
+		}
+	}
+	return 0;
+}
+
+/* convertrequest
+ * - converts the data of a request
+ * in:	worker_p - worker, with the request data and context set up
+ *		command - command of request
+ *		title - title of request
+ * out:	zero if ok, nonzero if the data could not be converted
+ */
+static int convertrequest(worker_t *worker_p, const char *command,
+                          const char *title)
+{
+	context_t		*ctx_p = &worker_p->ctx;
+	membuf_t		*request = &worker_p->request;
+	program_t		*programs_p, *program_p;
+
+	if (0 == strcmp(command, "prg")) {
+		return prg2txt(ctx_p, (const unsigned char *) request->data_p,
+		               request->length, title, &worker_p->output);
+	}
+	else if (0 == strcmp(command, "t64")) {
+		return t64img2txt(ctx_p, (const unsigned char *) request->data_p,
+		                  request->length, title, &worker_p->output);
+	}
+
+	/* txt, each program file goes out after a line giving its name */
+	txt2prg(ctx_p, request->data_p, request->length, &programs_p);
+	for (program_p = programs_p; program_p; program_p = program_p->next_p) {
+		mbprintf(&worker_p->output, "%lu %s\n",
+		         (unsigned long) program_p->data.length, program_p->filename);
+		mbwrite(&worker_p->output, program_p->data.data_p,
+		        program_p->data.length);
+	}
+	freeprograms(programs_p);
+	return 0;
+}
+
+/* answer
+ * - sends the answer to a request
+ * in:	conn_p - connection
+ *		ok - flag for successful conversion
+ *		output - converted data
+ *		messages - messages of conversion
+ * out:	zero if ok, nonzero if the answer could not be sent
+ */
+static int answer(conn_t *conn_p, int ok, const membuf_t *output,
+                  const membuf_t *messages)
+{
+	char			status[64];
+	struct iovec	iov[3];
+
+	sprintf(status, "%s %lu %lu\n", ok ? "ok" : "error",
+	        (unsigned long) output->length, (unsigned long) messages->length);
+	iov[0].iov_base = status;
+	iov[0].iov_len = strlen(status);
+	iov[1].iov_base = output->data_p;
+	iov[1].iov_len = output->length;
+	iov[2].iov_base = messages->data_p;
+	iov[2].iov_len = messages->length;
+	return sinkwritev(conn_p->outfd, iov, 3);
+}
+
+/* serveconnection
+ * - serves the requests of a client until it closes the connection
+ * in:	server_p - server
+ *		worker_p - worker serving the client
+ *		infd - file to read requests from
+ *		outfd - file to write answers to
+ * out:	none
+ */
+static void serveconnection(const server_t *server_p, worker_t *worker_p,
+                            int infd, int outfd)
+{
+	conn_t			*conn_p;
+	char			line[CONNBUFSIZE], command[4], flags[16];
+	unsigned long	length;
+	const char		*title_p;
+	membuf_t		messages;
+	int				rc, n;
+
+	conn_p = malloc(sizeof(conn_t));
+	if (!conn_p) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	conn_p->infd = infd;
+	conn_p->outfd = outfd;
+	conn_p->pos = conn_p->end = 0;
+
+	while (TRUE == (rc = readrequestline(conn_p, line))) {
+		/* Each request starts from the command line options, keeping the
+		 * buffers of the worker
+		 */
+		messages = worker_p->ctx.messages;
+		worker_p->ctx = *server_p->options_p;
+		worker_p->ctx.messages = messages;
+		worker_p->ctx.messages.length = 0;
+		worker_p->ctx.errors = 0;
+		worker_p->ctx.threads = 1;
+		worker_p->ctx.t64name = NULL;
+		worker_p->ctx.stats_p = NULL;
+		worker_p->request.length = 0;
+		worker_p->output.length = 0;
+
+		/* Parse the request line */
+		n = 0;
+		if (sscanf(line, "%3s %15s %lu%n", command, flags, &length, &n) < 3 ||
+		    (strcmp(command, "prg") && strcmp(command, "t64") &&
+		     strcmp(command, "txt")) ||
+		    setflags(&worker_p->ctx, flags) || length > MAXREQUEST) {
+			report(&worker_p->ctx, "Invalid request: %s\n", line);
+			answer(conn_p, FALSE, &worker_p->output, &worker_p->ctx.messages);
+			break;
+		}
+		title_p = line + n;
+		while (' ' == *title_p)	title_p ++;
+		if (!*title_p)	title_p = "-";
+
+		/* Read the data */
+		if (readdata(conn_p, mbreserve(&worker_p->request, length),
+		             length)) {
+			break;
+		}
+		worker_p->request.length = length;
+
+		/* Convert it and answer */
+		rc = convertrequest(worker_p, command, title_p);
+		if (answer(conn_p, 0 == rc && 0 == worker_p->ctx.errors,
+		           &worker_p->output, &worker_p->ctx.messages)) {
+			break;
+		}
+
+		/* Don't hold on to memory for one large request */
+		if (worker_p->request.size > KEEPSIZE)	mbfree(&worker_p->request);
+		if (worker_p->output.size > KEEPSIZE)	mbfree(&worker_p->output);
+	}
+
+	free(conn_p);
+}
+
+/* initworker
+ * - sets up the buffers of a worker
+ * in:	worker_p - worker
+ * out:	none
+ */
+static void initworker(worker_t *worker_p)
+{
+	initcontext(&worker_p->ctx);
+	mbinit(&worker_p->request);
+	mbinit(&worker_p->output);
+}
+
+/* freeworker
+ * - releases the buffers of a worker
+ * in:	worker_p - worker
+ * out:	none
+ */
+static void freeworker(worker_t *worker_p)
+{
+	freecontext(&worker_p->ctx);
+	mbfree(&worker_p->request);
+	mbfree(&worker_p->output);
+}
+
+/* worker
+ * - thread routine, serves one client after another
+ * in:	server_p - server
+ * out:	NULL
+ */
+static void *worker(void *server_p)
+{
+	const server_t	*s = server_p;
+	worker_t		state;
+	struct timeval	timeout;
+	int				fd;
+
+	initworker(&state);
+	for (;;) {
+		fd = accept(s->listenfd, NULL, NULL);
+		if (fd < 0) {
+			if (EINTR == errno || ECONNABORTED == errno)	continue;
+			perror("accept");
+			break;
+		}
+
+		/* A client that stops sending or reading must not hold the worker
+		 * for good, reads and writes timing out end the connection
+		 */
+		timeout.tv_sec = SERVETIMEOUT;
+		timeout.tv_usec = 0;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		serveconnection(s, &state, fd, fd);
+		close(fd);
+	}
+	freeworker(&state);
+	return NULL;
+}
+
+#endif
+
+/* serve
+ * - serves conversion requests until killed, or until the end of input
+ *   when serving standard input
+ * in:	path - Unix domain socket to listen on, "-" for standard input and
+ *		       output
+ *		options_p - options to start each request with
+ *		workers - number of clients served at the same time
+ * out:	exit code
+ */
+int serve(const char *path, const context_t *options_p, int workers)
+{
+#ifdef __EMX__
+	fprintf(stderr, "--serve is not supported on this platform\n");
+	return 1;
+#else
+	server_t			server;
+	worker_t			state;
+	struct sockaddr_un	address;
+	struct stat			info;
+	pthread_t			*threads_p;
+	int					i, fd, refused;
+
+	/* Clients going away must not kill the server */
+	signal(SIGPIPE, SIG_IGN);
+	server.options_p = options_p;
+
+	if (0 == strcmp(path, "-")) {
+		initworker(&state);
+		serveconnection(&server, &state, STDIN_FILENO, STDOUT_FILENO);
+		freeworker(&state);
+		return 0;
+	}
+
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Socket name too long: %s\n", path);
+		return 1;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	/* A socket left behind by an earlier server is replaced, but not one
+	 * that a running server still answers on
+	 */
+	if (0 == stat(path, &info) && S_ISSOCK(info.st_mode)) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		refused = fd >= 0 &&
+		          connect(fd, (struct sockaddr *) &address, sizeof(address)) &&
+		          ECONNREFUSED == errno;
+		if (fd >= 0)	close(fd);
+		if (!refused) {
+			fprintf(stderr, "Already serving on socket %s\n", path);
+			return 1;
+		}
+		unlink(path);
+	}
+
+	server.listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server.listenfd < 0 ||
+	    bind(server.listenfd, (struct sockaddr *) &address,
+	         sizeof(address)) ||
+	    listen(server.listenfd, SOMAXCONN)) {
+		fprintf(stderr, "Unable to listen on socket %s\n", path);
+		return 1;
+	}
+
+	/* Each worker takes the next client waiting, others wait to be
+	 * accepted
+	 */
+	threads_p = malloc(workers * sizeof(pthread_t));
+	if (!threads_p) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < workers; i ++) {
+		if (pthread_create(&threads_p[i], NULL, worker, &server)) {
+			fprintf(stderr, "Unable to start worker threads\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < workers; i ++) {
+		pthread_join(threads_p[i], NULL);
+	}
+
+	free(threads_p);
+	close(server.listenfd);
+	unlink(path);
+	return 1;
+#endif
+}
@@ -0,0 +1,20 @@
+/* serve.h
+ * $Id$
+ */
+
+#ifndef __SERVE_H
+#define __SERVE_H
+
+#include "context.h"
+
+/* Number of clients served at the same time, unless given with -j */
+#define SERVEWORKERS 4
+
+/* Seconds a client may leave its connection idle, or take to accept an
+ * answer, before it is closed
+ */
+#define SERVETIMEOUT 30
+
+int serve(const char *path, const context_t *options_p, int workers);
+
+#endif
@@ -0,0 +1,342 @@
+/* sidecar.c
+ * - sidecar files of text files (-u), keeping the tokenized lines of the
+ *   last run so that only changed lines are tokenized again
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sidecar.h"
+#include "cache.h"
+#include "image.h"
+#include "membuf.h"
+#include "version.h"
+
+#define FALSE 0
+#define TRUE 1
+
+/* First line of a sidecar, sidecars of other versions or layouts are not
+ * used
+ */
+#define SIDEMAGIC PROGNAME " sidecar 2"
+
+/* Longest line in the header of a program or a line */
+#define SIDELINESIZE 512
+
+/* Shortest header of a line, "0 0 0 0\n" */
+#define SIDEMINLINE 8
+
+/* Sidecar layout:
+ *  SIDEMAGIC
+ * and for each program
+ *  program mode hash1 hash2 length numlines filename
+ * followed by a line
+ *  hash1 hash2 length bytes
+ * the text and the tokenized bytes for each of its lines.
+ */
+
+/* readsideline
+ * - reads a line of a sidecar header
+ * in:	sidecar_p - sidecar being read
+ *		pos_p - pointer to the position to read from, moved past the line
+ *		line - buffer to read into, SIDELINESIZE bytes
+ * out:	zero if ok, nonzero at the end or for too long line
+ */
+static int readsideline(const sidecar_t *sidecar_p, size_t *pos_p,
+                        char *line)
+{
+	const char	*data_p = (const char *) sidecar_p->image.data_p + *pos_p;
+	const char	*newline_p;
+	size_t		length = sidecar_p->image.length - *pos_p;
+
+	if (length > SIDELINESIZE - 1)	length = SIDELINESIZE - 1;
+	newline_p = memchr(data_p, '\n', length);
+	if (!newline_p)	return 1;
+
+	memcpy(line, data_p, newline_p - data_p);
+	line[newline_p - data_p] = 0;
+	*pos_p += newline_p + 1 - data_p;
+	return 0;
+}
+
+/* parsesidecar
+ * - parses the programs of a loaded sidecar
+ * in:	sidecar_p - sidecar, with its file loaded
+ * out:	zero if ok, nonzero if it was not a valid sidecar
+ */
+static int parsesidecar(sidecar_t *sidecar_p)
+{
+	char			line[SIDELINESIZE];
+	size_t			pos = 0;
+	sideprog_t		*prog_p, *new_p;
+	sideline_t		*line_p;
+	unsigned int	i, size = 0;
+	size_t			slot;
+	int				mode, n;
+
+	if (readsideline(sidecar_p, &pos, line) || strcmp(line, SIDEMAGIC)) {
+		return 1;
+	}
+
+	while (pos < sidecar_p->image.length) {
+		/* Add a program */
+		if (sidecar_p->numprograms == size) {
+			size = size ? size * 2 : 16;
+			new_p = realloc(sidecar_p->programs_p, size * sizeof(sideprog_t));
+			if (!new_p)	return 1;
+			sidecar_p->programs_p = new_p;
+		}
+		prog_p = &sidecar_p->programs_p[sidecar_p->numprograms];
+		prog_p->lines_p = NULL;
+		prog_p->table_p = NULL;
+		sidecar_p->numprograms ++;
+
+		n = 0;
+		if (readsideline(sidecar_p, &pos, line) ||
+		    5 != sscanf(line, "program %d %lx %lx %lu %u %n", &mode,
+		                &prog_p->hash1, &prog_p->hash2, &prog_p->length,
+		                &prog_p->numlines, &n)) {
+			return 1;
+		}
+		prog_p->mode = (basic_t) mode;
+		prog_p->namelength = strlen(line + n);
+		prog_p->filename_p = (const char *) sidecar_p->image.data_p + pos -
+		                     1 - prog_p->namelength;
+
+		/* Each line takes at least its header, more lines than the rest of
+		 * the file can hold means it is corrupt
+		 */
+		if (prog_p->numlines > (sidecar_p->image.length - pos) / SIDEMINLINE ||
+		    prog_p->numlines > (size_t) -1 / sizeof(sideline_t)) {
+			return 1;
+		}
+
+		/* Its lines, and a hash table to find them by their text */
+		for (prog_p->tablesize = 16;
+		     prog_p->tablesize / 2 < prog_p->numlines;
+		     prog_p->tablesize *= 2) {
+			if (prog_p->tablesize > (size_t) -1 / 2 / sizeof(unsigned int)) {
+				return 1;
+			}
+		}
+		prog_p->lines_p = malloc((prog_p->numlines ? prog_p->numlines : 1) *
+		                         sizeof(sideline_t));
+		prog_p->table_p = calloc(prog_p->tablesize, sizeof(unsigned int));
+		if (!prog_p->lines_p || !prog_p->table_p)	return 1;
+
+		for (i = 0; i < prog_p->numlines; i ++) {
+			line_p = &prog_p->lines_p[i];
+			if (readsideline(sidecar_p, &pos, line) ||
+			    4 != sscanf(line, "%lx %lx %lu %u", &line_p->hash1,
+			                &line_p->hash2, &line_p->length,
+			                &line_p->bytes) ||
+			    line_p->length > sidecar_p->image.length - pos ||
+			    line_p->bytes > sidecar_p->image.length - pos -
+			                    line_p->length) {
+				return 1;
+			}
+			line_p->text_p = (const char *) sidecar_p->image.data_p + pos;
+			pos += line_p->length;
+			line_p->bytes_p = sidecar_p->image.data_p + pos;
+			pos += line_p->bytes;
+
+			slot = line_p->hash1 & (prog_p->tablesize - 1);
+			while (prog_p->table_p[slot]) {
+				slot = (slot + 1) & (prog_p->tablesize - 1);
+			}
+			prog_p->table_p[slot] = i + 1;
+		}
+	}
+
+	return 0;
+}
+
+/* freeprogs
+ * - releases the programs parsed from a sidecar
+ * in:	sidecar_p - sidecar
+ * out:	none
+ */
+static void freeprogs(sidecar_t *sidecar_p)
+{
+	unsigned int	i;
+
+	for (i = 0; i < sidecar_p->numprograms; i ++) {
+		free(sidecar_p->programs_p[i].lines_p);
+		free(sidecar_p->programs_p[i].table_p);
+	}
+	free(sidecar_p->programs_p);
+	sidecar_p->programs_p = NULL;
+	sidecar_p->numprograms = 0;
+}
+
+/* loadsidecar
+ * - loads the sidecar of the last run, a missing or invalid sidecar is
+ *   taken as empty
+ * in:	sidecar_p - sidecar to set up, released with freesidecar
+ *		filename - name of sidecar file
+ * out:	none
+ */
+void loadsidecar(sidecar_t *sidecar_p, const char *filename)
+{
+	sidecar_p->programs_p = NULL;
+	sidecar_p->numprograms = 0;
+	sidecar_p->current_p = NULL;
+	sidecar_p->numlines = 0;
+	mbinit(&sidecar_p->next);
+	mbinit(&sidecar_p->lines);
+	mbputs(&sidecar_p->next, SIDEMAGIC "\n");
+
+	if (loadimage(filename, &sidecar_p->image)) {
+		sidecar_p->image.data_p = NULL;
+		sidecar_p->image.length = 0;
+		return;
+	}
+
+	if (parsesidecar(sidecar_p))	freeprogs(sidecar_p);
+}
+
+/* savesidecar
+ * - writes the sidecar of this run, unless it is the same as before
+ * in:	sidecar_p - sidecar
+ *		filename - name of sidecar file
+ *		mode - file mode, from readfilemode
+ * out:	zero if ok, nonzero on error
+ */
+int savesidecar(sidecar_t *sidecar_p, const char *filename, int mode)
+{
+	if (sidecar_p->image.data_p &&
+	    sidecar_p->next.length == sidecar_p->image.length &&
+	    0 == memcmp(sidecar_p->next.data_p, sidecar_p->image.data_p,
+	                sidecar_p->next.length)) {
+		return 0;
+	}
+	return saveimage(filename, sidecar_p->next.data_p,
+	                 sidecar_p->next.length, mode);
+}
+
+/* freesidecar
+ * - releases a sidecar
+ * in:	sidecar_p - sidecar
+ * out:	none
+ */
+void freesidecar(sidecar_t *sidecar_p)
+{
+	freeprogs(sidecar_p);
+	if (sidecar_p->image.data_p)	freeimage(&sidecar_p->image);
+	mbfree(&sidecar_p->next);
+	mbfree(&sidecar_p->lines);
+}
+
+/* startsideprog
+ * - starts tokenizing a program, finding its earlier version
+ * in:	sidecar_p - sidecar
+ *		filename - file name from header
+ *		mode - BASIC version to tokenize
+ * out:	none
+ */
+void startsideprog(sidecar_t *sidecar_p, const char *filename, basic_t mode)
+{
+	const sideprog_t	*prog_p;
+	size_t				length = strlen(filename);
+	unsigned int		i;
+
+	strcpy(sidecar_p->filename, filename);
+	sidecar_p->mode = mode;
+	sidecar_p->current_p = NULL;
+	sidecar_p->lines.length = 0;
+	sidecar_p->numlines = 0;
+
+	/* The lines of a program tokenized for another BASIC version are of no
+	 * use
+	 */
+	for (i = 0; i < sidecar_p->numprograms; i ++) {
+		prog_p = &sidecar_p->programs_p[i];
+		if (prog_p->mode == mode && prog_p->namelength == length &&
+		    0 == memcmp(prog_p->filename_p, filename, length)) {
+			sidecar_p->current_p = prog_p;
+			break;
+		}
+	}
+}
+
+/* findsideline
+ * - finds a line of text in the earlier version of the program
+ * in:	sidecar_p - sidecar
+ *		text_p - line of text
+ *		length - length of line
+ *		hash1_p, hash2_p - pointers to where to put the hash of the line
+ * out:	tokenized line, NULL if it was not found
+ */
+const sideline_t *findsideline(const sidecar_t *sidecar_p,
+                               const char *text_p, size_t length,
+                               unsigned long *hash1_p,
+                               unsigned long *hash2_p)
+{
+	const sideprog_t	*prog_p = sidecar_p->current_p;
+	const sideline_t	*line_p;
+	size_t				slot;
+
+	*hash1_p = hashbytes(HASHSEED1, text_p, length);
+	*hash2_p = hashbytes(HASHSEED2, text_p, length);
+	if (!prog_p)	return NULL;
+
+	slot = *hash1_p & (prog_p->tablesize - 1);
+	while (prog_p->table_p[slot]) {
+		line_p = &prog_p->lines_p[prog_p->table_p[slot] - 1];
+		if (line_p->hash1 == *hash1_p && line_p->hash2 == *hash2_p &&
+		    line_p->length == length &&
+		    0 == memcmp(line_p->text_p, text_p, length)) {
+			return line_p;
+		}
+		slot = (slot + 1) & (prog_p->tablesize - 1);
+	}
+	return NULL;
+}
+
+/* addsideline
+ * - adds a tokenized line to the next sidecar
+ * in:	sidecar_p - sidecar
+ *		hash1, hash2 - hash of the text, from findsideline
+ *		text_p - line of text
+ *		length - length of the text
+ *		bytes_p - tokenized line
+ *		bytes - length of tokenized line
+ * out:	none
+ */
+void addsideline(sidecar_t *sidecar_p, unsigned long hash1,
+                 unsigned long hash2, const char *text_p, size_t length,
+                 const char *bytes_p, int bytes)
+{
+	mbprintf(&sidecar_p->lines, "%08lx %08lx %lu %d\n", hash1, hash2,
+	         (unsigned long) length, bytes);
+	mbwrite(&sidecar_p->lines, text_p, length);
+	mbwrite(&sidecar_p->lines, bytes_p, bytes);
+	sidecar_p->numlines ++;
+}
+
+/* endsideprog
+ * - ends tokenizing a program, adding it to the next sidecar
+ * in:	sidecar_p - sidecar
+ *		image - program file image
+ * out:	TRUE if the image is the same as the earlier version
+ */
+int endsideprog(sidecar_t *sidecar_p, const membuf_t *image)
+{
+	const sideprog_t	*prog_p = sidecar_p->current_p;
+	unsigned long		hash1, hash2;
+
+	hash1 = hashbytes(HASHSEED1, image->data_p, image->length);
+	hash2 = hashbytes(HASHSEED2, image->data_p, image->length);
+
+	mbprintf(&sidecar_p->next, "program %d %08lx %08lx %lu %u %s\n",
+	         (int) sidecar_p->mode, hash1, hash2,
+	         (unsigned long) image->length, sidecar_p->numlines,
+	         sidecar_p->filename);
+	mbwrite(&sidecar_p->next, sidecar_p->lines.data_p,
+	        sidecar_p->lines.length);
+
+	return prog_p && prog_p->hash1 == hash1 && prog_p->hash2 == hash2 &&
+	       prog_p->length == image->length;
+}
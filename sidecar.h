@@ -0,0 +1,70 @@
+/* sidecar.h
+ * $Id$
+ */
+
+#ifndef __SIDECAR_H
+#define __SIDECAR_H
+
+#include "tokenize.h"
+#include "membuf.h"
+#include "image.h"
+
+/* Added to the name of a text file to get the name of its sidecar */
+#define SIDEEXT ".tok"
+
+/* Tokenized line of an earlier run */
+typedef struct sideline_s {
+	unsigned long		hash1, hash2;	/* hash of the text */
+	unsigned long		length;			/* length of the text */
+	const char			*text_p;		/* the text, to tell apart lines of
+										   the same hash */
+	const unsigned char	*bytes_p;		/* tokenized line, from line number
+										   to the ending null */
+	unsigned int		bytes;			/* length of tokenized line */
+} sideline_t;
+
+/* Program of an earlier run */
+typedef struct sideprog_s {
+	const char		*filename_p;	/* file name from header */
+	size_t			namelength;
+	basic_t			mode;			/* BASIC version tokenized */
+	unsigned long	hash1, hash2;	/* hash of the program file image */
+	unsigned long	length;			/* length of the program file image */
+	sideline_t		*lines_p;
+	unsigned int	numlines;
+	unsigned int	*table_p;		/* line index + 1 for each hash slot */
+	size_t			tablesize;		/* power of two */
+} sideprog_t;
+
+/* Sidecar of a text file (-u)
+ * - the tokenized lines of each program tokenized from the text the last
+ *   time, so that only changed lines need to be tokenized again
+ */
+typedef struct sidecar_s {
+	image_t			image;			/* sidecar file of the earlier run */
+	sideprog_t		*programs_p;	/* its programs */
+	unsigned int	numprograms;
+	membuf_t		next;			/* sidecar of this run */
+
+	/* Program being tokenized */
+	char			filename[256];
+	basic_t			mode;
+	const sideprog_t *current_p;	/* its earlier version, NULL for none */
+	membuf_t		lines;			/* its lines, for the next sidecar */
+	unsigned int	numlines;
+} sidecar_t;
+
+void loadsidecar(sidecar_t *sidecar_p, const char *filename);
+int savesidecar(sidecar_t *sidecar_p, const char *filename, int mode);
+void freesidecar(sidecar_t *sidecar_p);
+void startsideprog(sidecar_t *sidecar_p, const char *filename, basic_t mode);
+const sideline_t *findsideline(const sidecar_t *sidecar_p,
+                               const char *text_p, size_t length,
+                               unsigned long *hash1_p,
+                               unsigned long *hash2_p);
+void addsideline(sidecar_t *sidecar_p, unsigned long hash1,
+                 unsigned long hash2, const char *text_p, size_t length,
+                 const char *bytes_p, int bytes);
+int endsideprog(sidecar_t *sidecar_p, const membuf_t *image);
+
+#endif
@@ -0,0 +1,230 @@
+/* sink.c
+ * - output sink, collecting text output to write it in large writes
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef __EMX__
+# include <errno.h>
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/types.h>
+# include <sys/uio.h>
+#endif
+
+#include "sink.h"
+
+#ifndef __EMX__
+/* sinkwritev
+ * - writes buffers to a file with vectored writes, going on after partial
+ *   writes
+ * in:	fd - file to write to
+ *		iov_p - buffers to write, changed on return
+ *		count - number of buffers
+ * out:	zero if ok, nonzero if output could not be written
+ */
+int sinkwritev(int fd, struct iovec *iov_p, int count)
+{
+	ssize_t	written;
+	int		first = 0;
+
+	while (first < count) {
+		written = writev(fd, &iov_p[first], count - first);
+		if (written < 0) {
+			if (EINTR == errno)	continue;
+			return -1;
+		}
+
+		/* Skip what was written */
+		while (first < count && (size_t) written >= iov_p[first].iov_len) {
+			written -= iov_p[first].iov_len;
+			first ++;
+		}
+		if (first < count) {
+			iov_p[first].iov_base = (char *) iov_p[first].iov_base + written;
+			iov_p[first].iov_len -= written;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+/* sinkinit
+ * - initializes the buffers of a sink
+ * in:	sink_p - sink
+ * out:	none
+ */
+static void sinkinit(sink_t *sink_p)
+{
+	int	i;
+
+	sink_p->memory_p = NULL;
+	for (i = 0; i < SINKBUFFERS; i ++) {
+		mbinit(&sink_p->buffers[i]);
+	}
+	sink_p->count = 0;
+	sink_p->length = 0;
+}
+
+/* sinkopen
+ * - opens a sink writing to a file, appending to it if it exists
+ * in:	sink_p - sink to open
+ *		filename - name of file, "-" for standard output
+ * out:	zero if ok, nonzero if the file could not be opened
+ */
+int sinkopen(sink_t *sink_p, const char *filename)
+{
+	sinkinit(sink_p);
+
+#ifdef __EMX__
+	if (0 == strcmp(filename, "-")) {
+		sink_p->file_p = stdout;
+	}
+	else {
+		sink_p->file_p = fopen(filename, "at");
+		if (NULL == sink_p->file_p) {
+			sink_p->file_p = fopen(filename, "wt");
+		}
+	}
+	return NULL == sink_p->file_p;
+#else
+	if (0 == strcmp(filename, "-")) {
+		sink_p->fd = STDOUT_FILENO;
+	}
+	else {
+		sink_p->fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0666);
+	}
+	return sink_p->fd < 0;
+#endif
+}
+
+/* sinkmemory
+ * - opens a sink writing to a memory buffer
+ * in:	sink_p - sink to open
+ *		memory_p - buffer to add the output to
+ * out:	none
+ */
+void sinkmemory(sink_t *sink_p, membuf_t *memory_p)
+{
+	sinkinit(sink_p);
+#ifdef __EMX__
+	sink_p->file_p = NULL;
+#else
+	sink_p->fd = -1;
+#endif
+	sink_p->memory_p = memory_p;
+}
+
+/* sinkput
+ * - adds text to the output, taking over the memory of the buffer
+ * in:	sink_p - sink
+ *		text_p - text to add, left empty
+ * out:	zero if ok, nonzero if output could not be written
+ */
+int sinkput(sink_t *sink_p, membuf_t *text_p)
+{
+	membuf_t	*last_p;
+
+	if (0 == text_p->length) {
+		mbfree(text_p);
+		return 0;
+	}
+
+	/* Memory buffers get the text at once */
+	if (sink_p->memory_p) {
+		mbwrite(sink_p->memory_p, text_p->data_p, text_p->length);
+		mbfree(text_p);
+		return 0;
+	}
+
+	sink_p->length += text_p->length;
+	last_p = sink_p->count ? &sink_p->buffers[sink_p->count - 1] : NULL;
+	if (last_p && text_p->length < SINKSMALL) {
+		/* Not worth a buffer of its own */
+		mbwrite(last_p, text_p->data_p, text_p->length);
+		mbfree(text_p);
+	}
+	else {
+		if (SINKBUFFERS == sink_p->count && sinkflush(sink_p)) {
+			mbfree(text_p);
+			return -1;
+		}
+		sink_p->buffers[sink_p->count ++] = *text_p;
+		mbinit(text_p);
+	}
+
+	if (sink_p->length >= SINKSIZE) {
+		return sinkflush(sink_p);
+	}
+	return 0;
+}
+
+/* sinkflush
+ * - writes the output collected so far
+ * in:	sink_p - sink
+ * out:	zero if ok, nonzero if output could not be written
+ */
+int sinkflush(sink_t *sink_p)
+{
+	int				i, rc = 0;
+#ifdef __EMX__
+	membuf_t		*buf_p;
+
+	for (i = 0; 0 == rc && i < sink_p->count; i ++) {
+		buf_p = &sink_p->buffers[i];
+		if (fwrite(buf_p->data_p, 1, buf_p->length, sink_p->file_p)
+		    != buf_p->length) {
+			rc = -1;
+		}
+	}
+	if (0 == rc && fflush(sink_p->file_p)) {
+		rc = -1;
+	}
+#else
+	struct iovec	iov[SINKBUFFERS];
+
+	/* Write all buffers at once */
+	for (i = 0; i < sink_p->count; i ++) {
+		iov[i].iov_base = sink_p->buffers[i].data_p;
+		iov[i].iov_len = sink_p->buffers[i].length;
+	}
+	rc = sinkwritev(sink_p->fd, iov, sink_p->count);
+#endif
+
+	for (i = 0; i < sink_p->count; i ++) {
+		mbfree(&sink_p->buffers[i]);
+	}
+	sink_p->count = 0;
+	sink_p->length = 0;
+	return rc;
+}
+
+/* sinkclose
+ * - writes the remaining output and closes the file of a sink
+ * in:	sink_p - sink
+ * out:	zero if ok, nonzero if output could not be written
+ */
+int sinkclose(sink_t *sink_p)
+{
+	int	rc;
+
+	if (sink_p->memory_p) {
+		sink_p->memory_p = NULL;
+		return 0;
+	}
+
+	rc = sinkflush(sink_p);
+#ifdef __EMX__
+	if (sink_p->file_p != stdout && fclose(sink_p->file_p)) {
+		rc = -1;
+	}
+#else
+	if (sink_p->fd != STDOUT_FILENO && close(sink_p->fd)) {
+		rc = -1;
+	}
+#endif
+	return rc;
+}
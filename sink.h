@@ -0,0 +1,53 @@
+/* sink.h
+ * $Id$
+ */
+
+#ifndef __SINK_H
+#define __SINK_H
+
+#include <stdio.h>
+#ifndef __EMX__
+# include <sys/uio.h>
+#endif
+
+#include "membuf.h"
+
+/* Amount of output collected before it is written */
+#define SINKSIZE (1024 * 1024)
+
+/* Number of buffers collected before they are written, all of them
+ * with a single vectored write
+ */
+#define SINKBUFFERS 16
+
+/* Texts smaller than this are copied onto the end of the previous buffer
+ * instead of being collected separately
+ */
+#define SINKSMALL 4096
+
+/* Output sink
+ * - collects text output in memory and writes it to standard output, a
+ *   file or a memory buffer in large writes
+ */
+typedef struct sink_s {
+#ifdef __EMX__
+	FILE		*file_p;		/* file to write to, NULL for memory */
+#else
+	int			fd;				/* file to write to, -1 for memory */
+#endif
+	membuf_t	*memory_p;		/* buffer to write to, for memory */
+	membuf_t	buffers[SINKBUFFERS];	/* output waiting to be written */
+	int			count;			/* number of buffers in use */
+	size_t		length;			/* amount of output waiting */
+} sink_t;
+
+int sinkopen(sink_t *sink_p, const char *filename);
+void sinkmemory(sink_t *sink_p, membuf_t *memory_p);
+int sinkput(sink_t *sink_p, membuf_t *text_p);
+int sinkflush(sink_t *sink_p);
+int sinkclose(sink_t *sink_p);
+#ifndef __EMX__
+int sinkwritev(int fd, struct iovec *iov_p, int count);
+#endif
+
+#endif
@@ -0,0 +1,149 @@
+/* stats.c
+ * - statistics of conversions, for the --stats option
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "tokens.h"
+#include "membuf.h"
+
+/* Names of the phases in the statistics output */
+static const char *phasenames[NUMPHASES] = {
+	"read", "scan", "convert", "write"
+};
+
+/* initstats
+ * - clears statistics, without timing the phases
+ * in:	stats_p - statistics to clear
+ * out:	none
+ */
+void initstats(stats_t *stats_p)
+{
+	memset(stats_p, 0, sizeof(stats_t));
+}
+
+/* addstats
+ * - adds statistics to a total
+ * in:	total_p - total to add to
+ *		stats_p - statistics to add
+ * out:	none
+ */
+void addstats(stats_t *total_p, const stats_t *stats_p)
+{
+	int	i;
+
+	for (i = 0; i < NUMPHASES; i ++) {
+		total_p->seconds[i] += stats_p->seconds[i];
+	}
+	total_p->bytesin += stats_p->bytesin;
+	total_p->bytesout += stats_p->bytesout;
+	total_p->lines += stats_p->lines;
+	total_p->programs += stats_p->programs;
+	total_p->escapes += stats_p->escapes;
+	total_p->errors += stats_p->errors;
+	total_p->cachehits += stats_p->cachehits;
+	total_p->cachemisses += stats_p->cachemisses;
+	for (i = 0; i < NUMTOKENTABLES; i ++) {
+		total_p->tokens[i] += stats_p->tokens[i];
+	}
+}
+
+/* starttimer
+ * - starts timing a phase
+ * in:	stats_p - statistics, NULL if none are collected
+ * out:	start time, to give to stoptimer
+ */
+double starttimer(const stats_t *stats_p)
+{
+#ifdef __EMX__
+	return (stats_p && stats_p->timing) ? (double) clock() / CLOCKS_PER_SEC
+	                                    : 0.0;
+#else
+	struct timespec	now;
+
+	if (!stats_p || !stats_p->timing)	return 0.0;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+/* stoptimer
+ * - adds the time spent since starttimer to a phase
+ * in:	stats_p - statistics, NULL if none are collected
+ *		phase - phase to add the time to
+ *		start - time returned by starttimer
+ * out:	none
+ */
+void stoptimer(stats_t *stats_p, phase_t phase, double start)
+{
+	if (stats_p && stats_p->timing) {
+		stats_p->seconds[phase] += starttimer(stats_p) - start;
+	}
+}
+
+/* writestring
+ * - writes a string as a JSON string
+ * in:	output - buffer to write to
+ *		text_p - string to write
+ * out:	none
+ */
+static void writestring(membuf_t *output, const char *text_p)
+{
+	mbputc(output, '"');
+	for (; *text_p; text_p ++) {
+		if ('"' == *text_p || '\\' == *text_p) {
+			mbputc(output, '\\');
+			mbputc(output, *text_p);
+		}
+		else if ((unsigned char) *text_p < 32) {
+			mbprintf(output, "\\u%04x", (unsigned char) *text_p);
+		}
+		else {
+			mbputc(output, *text_p);
+		}
+	}
+	mbputc(output, '"');
+}
+
+/* writestats
+ * - writes statistics as a JSON object
+ * in:	output - buffer to write to
+ *		file_p - name of the input file, NULL for a total
+ *		stats_p - statistics to write
+ * out:	none
+ */
+void writestats(membuf_t *output, const char *file_p, const stats_t *stats_p)
+{
+	int	i;
+
+	mbputc(output, '{');
+	if (file_p) {
+		mbputs(output, "\"file\": ");
+		writestring(output, file_p);
+		mbputs(output, ", ");
+	}
+
+	mbputs(output, "\"seconds\": {");
+	for (i = 0; i < NUMPHASES; i ++) {
+		mbprintf(output, "%s\"%s\": %.6f", i ? ", " : "", phasenames[i],
+		         stats_p->seconds[i]);
+	}
+
+	mbprintf(output, "}, \"bytes\": {\"in\": %lu, \"out\": %lu}, "
+	                 "\"lines\": %lu, \"programs\": %lu, \"escapes\": %lu, "
+	                 "\"errors\": %lu, "
+	                 "\"cache\": {\"hits\": %lu, \"misses\": %lu}, "
+	                 "\"tokens\": {",
+	         stats_p->bytesin, stats_p->bytesout, stats_p->lines,
+	         stats_p->programs, stats_p->escapes, stats_p->errors,
+	         stats_p->cachehits, stats_p->cachemisses);
+	for (i = 0; i < NUMTOKENTABLES; i ++) {
+		mbprintf(output, "%s\"%s\": %lu", i ? ", " : "", tokentablenames[i],
+		         stats_p->tokens[i]);
+	}
+	mbputs(output, "}}");
+}
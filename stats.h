@@ -0,0 +1,46 @@
+/* stats.h
+ * $Id$
+ */
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include "tokenize.h"
+#include "tokens.h"
+#include "membuf.h"
+
+/* Conversion phases that are timed */
+typedef enum phase_e {
+	ReadPhase,				/* reading input files */
+	ScanPhase,				/* looking for headers in text */
+	ConvertPhase,			/* tokenize()/detokenize() */
+	WritePhase,				/* writing output */
+	NUMPHASES
+} phase_t;
+
+/* Statistics of a conversion
+ * - collected when a context points to them, see context.h. The phases
+ *   are only timed when asked for, the counts are always kept
+ */
+typedef struct stats_s {
+	int				timing;				/* flag for timing the phases */
+	double			seconds[NUMPHASES];	/* time spent in each phase */
+	unsigned long	bytesin;			/* bytes of input read */
+	unsigned long	bytesout;			/* bytes of output written */
+	unsigned long	lines;				/* BASIC lines converted */
+	unsigned long	programs;			/* programs converted */
+	unsigned long	escapes;			/* {..} escape sequences */
+	unsigned long	errors;				/* lines and files with errors */
+	unsigned long	cachehits;			/* programs found in the cache */
+	unsigned long	cachemisses;		/* programs not found in it */
+	unsigned long	tokens[NUMTOKENTABLES];	/* tokens, per token table */
+} stats_t;
+
+void initstats(stats_t *stats_p);
+void addstats(stats_t *total_p, const stats_t *stats_p);
+double starttimer(const stats_t *stats_p);
+void stoptimer(stats_t *stats_p, phase_t phase, double start);
+void writestats(membuf_t *output, const char *file_p,
+                const stats_t *stats_p);
+
+#endif
@@ -5,25 +5,29 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "t64.h"
+#include "context.h"
 
 /* checkvalidheader
  * - checks for T64 file header validity
- * in:	header_p: pointer to header structure
+ * in:	ctx_p: context to report errors to
+ *		header_p: pointer to header structure
  *		totalentries_p: pointer to where to fill in the max directory size
  *		usedentries_p: pointer to where to fill in the number of used entries
  * out:	the totalentries and usedentries are filled in
  *      zero for valid header
  *      nonzero for invalid header
  */
-int checkvalidheader(t64header_t *header_p, unsigned int *totalentries_p,
+int checkvalidheader(context_t *ctx_p, t64header_t *header_p,
+                     unsigned int *totalentries_p,
                      unsigned int *usedentries_p, const char *filename)
 {
 	/* Locate the strings "C64" and "tape" in the description header */
 	if (!strstr(header_p->description, "C64") ||
 	    !strstr(header_p->description, "tape")) {
-		fprintf(stderr, "File is not a T64 archive: %s\n", filename);
+		reporterror(ctx_p, "File is not a T64 archive: %s\n", filename);
 		return 1;
 	}
 
@@ -37,9 +41,61 @@ int checkvalidheader(t64header_t *header_p, unsigned int *totalentries_p,
 
 	/* Check for data validity */
 	if (0 == *totalentries_p || *usedentries_p > *totalentries_p) {
-		fprintf(stderr, "Error in T64 archive header: %s\n", filename);
+		reporterror(ctx_p, "Error in T64 archive header: %s\n", filename);
 		return 1;
 	}
 
 	return 0;	/* No error */
-}
\ No newline at end of file
+}
+/* readdirectory
+ * - reads the T64 directory records in one go
+ * in:	ctx_p - context to report errors to
+ *		input - open T64 file
+ *		entries - number of records to read
+ *		filename - name of T64 file, for error messages
+ * out:	allocated array of records, NULL on error
+ *      records missing from a truncated file are returned as free
+ */
+t64record_t *readdirectory(context_t *ctx_p, FILE *input,
+                           unsigned int entries, const char *filename)
+{
+	t64record_t	*records_p;
+
+	records_p = calloc(entries ? entries : 1, sizeof(t64record_t));
+	if (!records_p) {
+		reporterror(ctx_p, "Out of memory reading T64 directory: %s\n",
+		            filename);
+		return NULL;
+	}
+
+	/* The directory follows right after the header */
+	fseek(input, sizeof(t64header_t), SEEK_SET);
+	fread(records_p, sizeof(t64record_t), entries, input);
+
+	return records_p;
+}
+
+/* recordoffset
+ * - retrieves the file offset of the data of a T64 file record
+ * in:	record_p - pointer to file record
+ * out:	file offset
+ */
+long recordoffset(const t64record_t *record_p)
+{
+	return (record_p->offset[0]      ) | (record_p->offset[1] << 8 ) |
+	       (record_p->offset[2] << 16) | ((long) record_p->offset[3] << 24);
+}
+
+/* makeoffset
+ * - enters the file offset of the data of a T64 file record
+ * in:	record_p - pointer to file record
+ *		offset - file offset
+ * out:	none
+ */
+void makeoffset(t64record_t *record_p, long offset)
+{
+	record_p->offset[0] = offset & 0xFF;			/* low */
+	record_p->offset[1] = (offset >> 8) & 0xFF;
+	record_p->offset[2] = (offset >> 16) & 0xFF;
+	record_p->offset[3] = (offset >> 24) & 0xFF;	/* high */
+}
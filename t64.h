@@ -11,11 +11,18 @@
  * is little-endian).
  */
 
+#include <stdio.h>
+
+#include "context.h"
+
 #pragma pack(1)
 
 /* Default number of entries */
 #define STD_DIRSIZE 30
 
+/* Largest number of entries (maxfiles is a word) */
+#define MAX_DIRSIZE 0xFFFF
+
 /* T64 archive header, 64 bytes */
 typedef struct t64header_s {
 	char			description[32];	/* "C64 tape image"+EOF+nulls */
@@ -42,13 +49,21 @@ typedef struct t64record_s {
 	char			filename[16];		/* Filename (PETSCII), space padded */
 } t64record_t;
 
+/* Back to the default packing, for the headers included after this one */
+#pragma pack()
+
 /* T64 file layout:
  * 0       t64header_t
  * 64      t64record_t[t64header_t.maxfiles]
  * 64+32*n start of file data
  */
 
-int checkvalidheader(t64header_t *header_p, unsigned int *totalentries_p,
+int checkvalidheader(context_t *ctx_p, t64header_t *header_p,
+                     unsigned int *totalentries_p,
                      unsigned int *usedentries_p, const char *filename);
+t64record_t *readdirectory(context_t *ctx_p, FILE *input,
+                           unsigned int entries, const char *filename);
+long recordoffset(const t64record_t *record_p);
+void makeoffset(t64record_t *record_p, long offset);
 
 #endif
\ No newline at end of file
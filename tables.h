@@ -0,0 +1,106 @@
+/* tables.h
+ * - lookup tables generated by mktables from the tables in tokens.c
+ * $Id$
+ */
+
+#ifndef __TABLES_H
+#define __TABLES_H
+
+/* Keyword tries
+ * Each BASIC dialect has a trie of its keywords, walked with the
+ * (uppercased) input characters. Keywords are numbered in the order in
+ * which they are tried (see dialects[] in tokens.c), so that the lowest
+ * numbered keyword found along the walk is the one to use.
+ */
+
+/* Keyword number for "no keyword" */
+#define KW_NONE 0xFFFF
+
+/* Values for kwterm_t.flags */
+#define KW_NOTOKENIZE 1			/* REM/DATA, rest of line not tokenized */
+
+/* Keyword, as found in a trie */
+typedef struct kwterm_s {
+	unsigned char	length;			/* length of keyword text */
+	unsigned char	bytes;			/* number of token bytes (1 or 2) */
+	unsigned char	token[2];		/* token bytes */
+	unsigned char	flags;			/* KW_ flags */
+	unsigned char	table;			/* token table it is counted in, index
+									   into tokentables[] */
+} kwterm_t;
+
+/* Trie edge */
+typedef struct kwedge_s {
+	unsigned char	ch;				/* uppercase character */
+	unsigned short	node;			/* node reached */
+} kwedge_t;
+
+/* Trie node */
+typedef struct kwnode_s {
+	unsigned short	edge;			/* index of first edge */
+	unsigned char	edges;			/* number of edges */
+	unsigned short	term;			/* keyword ending here, or KW_NONE */
+	unsigned short	below;			/* lowest keyword further down */
+} kwnode_t;
+
+/* Keyword trie of a BASIC dialect */
+typedef struct kwtrie_s {
+	const unsigned short	*root_p;	/* node for each first character,
+										   0 for none */
+	const kwnode_t			*nodes_p;
+	const kwedge_t			*edges_p;
+	const kwterm_t			*terms_p;
+} kwtrie_t;
+
+/* Indexed by basic_t */
+extern const kwtrie_t kwtries[];
+
+/* PETSCII escape names
+ * The names in petscii[] (and the "space" alias) are hashed in lowercase,
+ * with linear probing. A name lists the characters it may stand for in
+ * table order; uppercase and lowercase letters must match with case.
+ * The texts are kept in one pool, the name of each character as written
+ * in petscii[] followed by the lowercase names that differ from them, so
+ * that they are compared by length and offset without strlen.
+ */
+
+/* Number of hash slots, power of two */
+#define PET_HASHSIZE 512
+
+/* Hash function step, applied to each lowercased character */
+#define PET_HASHSTEP(hash, ch) ((hash) * 31 + (unsigned char) (ch))
+
+/* Character an escape name may stand for */
+typedef struct petchar_s {
+	unsigned char	ch;				/* PETSCII value */
+	unsigned char	exact;			/* nonzero if case must match */
+} petchar_t;
+
+/* Escape name */
+typedef struct petname_s {
+	unsigned short	name;			/* offset of lowercase name in petpool */
+	unsigned char	length;			/* length of name */
+	unsigned short	first;			/* index of first character */
+	unsigned char	count;			/* number of characters */
+} petname_t;
+
+extern const unsigned short	pethash[PET_HASHSIZE];	/* petnames[] index + 1,
+													   0 for empty slot */
+extern const petname_t		petnames[];
+extern const petchar_t		petchars[];
+extern const char			petpool[];			/* texts, not null
+												   terminated */
+extern const unsigned short	petoffsets[256];	/* offset in petpool of the
+												   name of each character */
+extern const unsigned char	petlengths[256];	/* length of that name */
+
+/* Plain text maps
+ * The PETSCII byte each ASCII character is tokenized to inside quotes
+ * (quotedmap) and in the text after REM and DATA (plainmap), 0 for the
+ * characters that need more than a mapping: quotes, the start of
+ * escapes, and characters that are not allowed there.
+ */
+extern const unsigned char	quotedmap[256];
+extern const unsigned char	plainmap[256];
+
+#endif
@@ -6,43 +6,220 @@
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
+/* The vector code only pays off when the compiler keeps the vectors in
+ * registers, that is when optimizing
+ */
+#if defined(__SSE2__) && defined(__OPTIMIZE__)
+# define USESSE2
+# include <emmintrin.h>
+#endif
 
 #include "tokenize.h"
 #include "tokens.h"
+#include "tables.h"
+#include "context.h"
 
 #define FALSE 0
 #define TRUE 1
 
-#ifdef __EMX__
-#define strcasecmp stricmp
-#define strncasecmp strnicmp
-#endif
-
 /* The bytestream buffer used in the function (output) is from the line
  * number up to the ending null character. The "next line" pointer is
  * not included
  */
 
+/* matchkeyword
+ * - finds the keyword that a string starts with
+ * in:	trie_p - keyword trie of the BASIC version
+ *		input_p - pointer to string to match
+ * out:	keyword found, NULL if none
+ */
+static const kwterm_t *matchkeyword(const kwtrie_t *trie_p,
+                                    const char *input_p)
+{
+	const kwnode_t	*node_p;
+	const kwedge_t	*edge_p, *last_p;
+	unsigned		best = KW_NONE;		/* lowest numbered keyword found */
+	unsigned		node;
+	int				ch;
+
+	node = trie_p->root_p[(unsigned char) *input_p];
+	while (node) {
+		/* Keywords are tried in order, so a keyword ending here is only
+		 * used if no keyword tried before it matched a shorter string, and
+		 * we can stop once nothing further down would be tried earlier
+		 */
+		node_p = &trie_p->nodes_p[node];
+		if (node_p->term < best)	best = node_p->term;
+		if (node_p->below >= best)	break;
+
+		/* Follow the edge for the next (uppercased) character */
+		ch = (unsigned char) *(++ input_p);
+		if (ch >= 'a' && ch <= 'z')	ch -= 32;
+		edge_p = &trie_p->edges_p[node_p->edge];
+		last_p = edge_p + node_p->edges;
+		node = 0;
+		for (; edge_p < last_p; edge_p ++) {
+			if (edge_p->ch == ch) {
+				node = edge_p->node;
+				break;
+			} /* if */
+		} /* for */
+	} /* while */
+
+	return (KW_NONE == best) ? NULL : &trie_p->terms_p[best];
+}
+
+/* copyrun
+ * - copies a run of plain text, mapping each character through quotedmap
+ *   or plainmap, up to the first character that needs more than that.
+ *   With SSE2, sixteen characters are classified and mapped at a time
+ * in:	output_p - pointer to bytestream to copy to
+ *		input_p - pointer to text to copy
+ *		end_p - end of text
+ *		quoted - flag for text inside quotes, else text after REM/DATA
+ * out:	number of characters copied
+ */
+static size_t copyrun(char *output_p, const char *input_p,
+                      const char *end_p, int quoted)
+{
+	const unsigned char	*map_p = quoted ? quotedmap : plainmap;
+	const char			*start_p = input_p;
+	unsigned char		map;
+
+#ifdef USESSE2
+	/* The ranges here must agree with the maps made by mktables. Bytes
+	 * from 128 up are negative, and fall outside all of the ranges
+	 */
+	__m128i	text, same, upper, lower, ok;
+	int		mask;
+
+#define INRANGE(v, low, high) \
+	_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((low) - 1)), \
+	              _mm_cmplt_epi8(v, _mm_set1_epi8((high) + 1)))
+#define ISCHAR(v, ch) _mm_cmpeq_epi8(v, _mm_set1_epi8(ch))
+
+	while (end_p - input_p >= 16) {
+		text = _mm_loadu_si128((const __m128i *) input_p);
+		if (quoted) {
+			same = _mm_or_si128(INRANGE(text, 32, 64),
+			                    _mm_or_si128(ISCHAR(text, 91),
+			                                 INRANGE(text, 93, 94)));
+			upper = INRANGE(text, 65, 90);
+			lower = INRANGE(text, 97, 122);
+		}
+		else {
+			same = _mm_or_si128(INRANGE(text, 32, 91), ISCHAR(text, 93));
+			upper = _mm_setzero_si128();
+			lower = INRANGE(text, 96, 122);
+		}
+		same = _mm_andnot_si128(ISCHAR(text, '"'), same);
+		ok = _mm_or_si128(same, _mm_or_si128(upper, lower));
+		mask = _mm_movemask_epi8(ok);
+
+		/* Uppercase gets bit 7 set, lowercase bit 5 cleared */
+		text = _mm_or_si128(text, _mm_and_si128(upper,
+		                                        _mm_set1_epi8((char) 0x80)));
+		text = _mm_andnot_si128(_mm_and_si128(lower, _mm_set1_epi8(0x20)),
+		                        text);
+		if (0xFFFF == mask) {
+			_mm_storeu_si128((__m128i *) output_p, text);
+			input_p += 16;
+			output_p += 16;
+		}
+		else {
+			/* Copy up to the first character that needs more */
+			while (mask & 1) {
+				*(output_p ++) = map_p[(unsigned char) *(input_p ++)];
+				mask >>= 1;
+			}
+			return input_p - start_p;
+		}
+	}
+
+#undef INRANGE
+#undef ISCHAR
+#endif
+
+	/* The rest one character at a time */
+	while (input_p < end_p &&
+	       0 != (map = map_p[(unsigned char) *input_p])) {
+		*(output_p ++) = map;
+		input_p ++;
+	}
+
+	return input_p - start_p;
+}
+
+/* lookuppetscii
+ * - finds the PETSCII character for a special character name
+ * in:	name_p - special character name
+ *		length - length of name
+ * out:	PETSCII character, 0 if none
+ */
+static int lookuppetscii(const char *name_p, int length)
+{
+	const petname_t	*petname_p;
+	const petchar_t	*petchar_p;
+	char			lower[17];	/* name in lowercase */
+	unsigned		hash = 0;
+	int				i;
+
+	/* Names are hashed in lowercase */
+	for (i = 0; i < length; i ++) {
+		lower[i] = name_p[i];
+		if (lower[i] >= 'A' && lower[i] <= 'Z')	lower[i] += 32;
+		hash = PET_HASHSTEP(hash, lower[i]);
+	} /* for */
+
+	for (hash &= PET_HASHSIZE - 1; pethash[hash];
+	     hash = (hash + 1) & (PET_HASHSIZE - 1)) {
+		petname_p = &petnames[pethash[hash] - 1];
+		if (petname_p->length == length &&
+		    0 == memcmp(&petpool[petname_p->name], lower, length)) {
+			/* Use the first character that this name stands for,
+			 * upper-/lowercase PETSCII must be matched with case also
+			 * (otherwise 'e' would match 'E')
+			 */
+			petchar_p = &petchars[petname_p->first];
+			for (i = 0; i < petname_p->count; i ++, petchar_p ++) {
+				if (!petchar_p->exact ||
+				    0 == memcmp(&petpool[petoffsets[petchar_p->ch]],
+				                name_p, length)) {
+					return petchar_p->ch;
+				} /* if */
+			} /* for */
+			return 0;
+		} /* if */
+	} /* for */
+
+	return 0;
+}
+
 /* tokenize
  * - tokenizes a C64/C128 BASIC (in tok64 pseudocode) line
- * in:	input_p - pointer to string to tokenize
+ * in:	ctx_p - context to report problems to
+ *		input_p - pointer to string to tokenize
  *		output_p - pointer to bytestream to put results in, MUST BE ALLOCATED
  *		length_p - pointer to integer to write length counter to
  *      mode - BASIC version to tokenize
  * out:	nonzero on error
  */
-int tokenize(const char *input_p, char *output_p, int *length_p, basic_t mode)
+int tokenize(context_t *ctx_p, const char *input_p, char *output_p,
+             int *length_p, basic_t mode)
 {
 	int	quotemode = FALSE;		/* flag for quote mode */
 	unsigned short i;			/* loop counter */
 	unsigned linenumber;		/* line number */
-	int inputleft = strlen(input_p);	/* amount left of line to tokenize */
-	int tokenlen;				/* length of current token */
 	int match;					/* match found flag */
 	int notokenize = FALSE;		/* REM/DATA no tokenize flag */
 	int rc = 0;					/* return code */
-	char buf[16];				/* buffer for special character match */
+	char buf[17];				/* buffer for special character match */
 	char *start_p = output_p;	/* pointer to input */
+	const kwterm_t *term_p;		/* keyword found */
+	const kwtrie_t *trie_p = &kwtries[mode];	/* keywords of the dialect */
+	const char *end_p;			/* end of input */
+	size_t run;					/* length of run of plain text */
+	stats_t *stats_p = ctx_p ? ctx_p->stats_p : NULL;	/* statistics */
 
 	/* Skip any initial whitespace */
 	while (' ' == *input_p || '\t' == *input_p)	input_p ++;
@@ -56,7 +233,7 @@ int tokenize(const char *input_p, char *output_p, int *length_p, basic_t mode)
 
 	if (linenumber >= 64000) {
 		rc = 1;
-		fprintf(stderr, "* Illegal line number: %u\n", linenumber);
+		report(ctx_p, "* Illegal line number: %u\n", linenumber);
 	} /* if */
 
 	/* Insert line number in byte stream */
@@ -65,6 +242,7 @@ int tokenize(const char *input_p, char *output_p, int *length_p, basic_t mode)
 	
 	/* Kill off any extraneous spaces */
 	while (' ' == *input_p) input_p ++;
+	end_p = input_p + strlen(input_p);
 
 	/* Now process the rest of the line */
 	while (*input_p) {			/* while string isn't ended */
@@ -89,46 +267,32 @@ int tokenize(const char *input_p, char *output_p, int *length_p, basic_t mode)
 			/* Check for error condition */
 			if (*input_p != '*' && *input_p != '}') {
 				rc = 1;
-				fprintf(stderr, "* Special character sequence incorrect: '{%s'"
-				                " at line %u\n",
-				        buf, linenumber);
+				report(ctx_p, "* Special character sequence incorrect: '{%s'"
+				              " at line %u\n",
+				       buf, linenumber);
 			} /* if */
 			else {
 				/* It seems to be ok, so look it up */
 				match = FALSE;
 
 				/* Threedigit numeric? */
-				if (strlen(buf) == 3 &&
+				if (3 == i &&
 				    isdigit(buf[0]) && isdigit(buf[1]) && isdigit(buf[2])) {
-					sscanf(buf, "%d", &match);
+					match = (buf[0] - '0') * 100 + (buf[1] - '0') * 10 +
+					        (buf[2] - '0');
 				}
 
-				/* Look it up in the PETSCII table */
-				for (i = 1; i <= 255 && !match; i ++) {
-					if ((i & 0x7f) >= 0x41 && (i & 0x7f) <= 0x5A) {
-						/* Upper-/lowercase PETSCII must be matched with
-						 * case also (otherwise 'e' would match 'E')
-						 */
-						if (0 == strcmp(petscii[i], buf))
-							match = i;		/* match */
-					} /* if */
-					else {
-						if (0 == strcasecmp(petscii[i], buf))
-							match = i;		/* match */
-					} /* else */
-				} /* for */
-
-				/* Special condition: space (32) can be repeated, and
-				 * is then called 'space', which is not in the petscii
-				 * table
+				/* Look it up in the PETSCII table (this includes the
+				 * 'space' name for space (32), which can be repeated)
 				 */
-
-				if (!match && 0 == strcasecmp("space", buf)) {
-					match = ' ';
-				} /* if */
+				if (!match) {
+					match = lookuppetscii(buf, i);
+				}
 
 				/* Now check whether or not we got a match */
 				if (match) {
+					if (stats_p)	stats_p->escapes ++;
+
 					/* We have found which PETSCII character was meant,
 					 * now we check whether or not we wanted more than one
 					 * character of this kind ("{char*n}")
@@ -146,9 +310,9 @@ int tokenize(const char *input_p, char *output_p, int *length_p, basic_t mode)
 						if ('}' != *input_p || i == 0 || i > 255) {
 							rc = 1;
 							i = 0;
-							fprintf(stderr, "* Illegal character count at line "
-							                "%u\n",
-							        linenumber);
+							report(ctx_p, "* Illegal character count at line "
+							              "%u\n",
+							       linenumber);
 						} /* if */
 					} /* if */
 
@@ -167,15 +331,25 @@ int tokenize(const char *input_p, char *output_p, int *length_p, basic_t mode)
 				} /* if */
 				else {
 					rc = 1;
-					fprintf(stderr, "* Illegal special character: {%s} at "
-					                "line %u\n",
-					        buf, linenumber);
+					report(ctx_p, "* Illegal special character: {%s} at "
+					              "line %u\n",
+					       buf, linenumber);
 				} /* else */
 			} /* else */
 		} /* if */
 		else if (!quotemode) {	/* check for token */
 			match = FALSE;
 
+			/* Text after REM/DATA is copied in runs */
+			if (notokenize) {
+				run = copyrun(output_p, input_p, end_p, FALSE);
+				if (run) {
+					input_p += run;
+					output_p += run;
+					continue;
+				} /* if */
+			} /* if */
+
 			/* Skip tokenization attempt if:
 			 *  . No tokenization flag is set
 			 *  . Input string starts with numeral or space
@@ -184,132 +358,24 @@ int tokenize(const char *input_p, char *output_p, int *length_p, basic_t mode)
 			if (notokenize || ' ' == *input_p || isdigit(*input_p))
 				goto skiptokenize;		/* Looks better than nested if */
 
-			/* C64 BASIC */
-			for (i = 0; i <= 75 && !match; i ++) {
-				tokenlen = strlen(c64tokens[i]);	/* -=TODO:=- table lookup */
-				if (inputleft >= tokenlen &&
-				    0 == strncasecmp(input_p, c64tokens[i], tokenlen)) {
-					/* token match found */
-					match = TRUE;
-					(*output_p ++) = i + 128;	/* write token */
-					input_p += tokenlen;		/* skip token */
-					inputleft -= tokenlen;
-
-					if (15 == i || 3 == i) {	/* REM & DATA */
-						notokenize = TRUE;
-					}
+			/* Look up the keyword in the dialect's keyword trie */
+			term_p = matchkeyword(trie_p, input_p);
+			if (term_p) {
+				/* token match found */
+				match = TRUE;
+				(*output_p ++) = term_p->token[0];	/* write token */
+				if (2 == term_p->bytes) {
+					(*output_p ++) = term_p->token[1];
 				} /* if */
-			} /* for */
-
-			/* C128 BASIC 7.0/7.1 */
-			if (!match && (Basic7 == mode || Basic71 == mode)) {
-				for (i = 2; i <= ((mode == Basic7) ? 38 : 55) && !match;
-				     i ++) {
-					tokenlen = strlen(c128FEtokens[i]);	/* as above */
-					if (tokenlen && inputleft >= tokenlen &&
-					    0 == strncasecmp(input_p, c128FEtokens[i], tokenlen)) {
-						/* token match found */
-						match = TRUE;
-						(*output_p ++) = 0xFE;		/* token escape */
-						(*output_p ++) = i;			/* write token */
-						input_p += tokenlen;		/* skip token */
-						inputleft -= tokenlen;
-					} /* if */
-				} /* for */
-
-				if (match) goto skipover;	/* nicer than nested ifs */
-
-				for (i = 2; i <= 9 && !match; i ++) {
-					tokenlen = strlen(c128CEtokens[i]);	/* as above */
-					if (tokenlen && inputleft >= tokenlen &&
-					    0 == strncasecmp(input_p, c128CEtokens[i], tokenlen)) {
-						/* token match found */
-						match = TRUE;
-						(*output_p ++) = 0xCE;		/* token escape */
-						(*output_p ++) = i;			/* write token */
-						input_p += tokenlen;		/* skip token */
-						inputleft -= tokenlen;
-					} /* if */
-				} /* for */
-skipover:;
-			} /* if */
+				input_p += term_p->length;		/* skip token */
 
-			if (!match && (Basic7 == mode || Basic71 == mode ||
-			               Basic35 == mode)) {
-				for (i = 0; i <= 49 && !match; i ++) {
-					if (0xCE == i && Basic35 != mode) i ++;
-						/* skip prefix 0xCE in BASIC 7.0/7.1 */
-					tokenlen = strlen(c128tokens[i]);	/* as above */
-					if (tokenlen && inputleft >= tokenlen &&
-					    0 == strncasecmp(input_p, c128tokens[i], tokenlen)) {
-						/* token match found */
-						match = TRUE;
-						(*output_p ++) = i + 204;	/* write token */
-						input_p += tokenlen;		/* skip token */
-						inputleft -= tokenlen;
-					} /* if */
-				} /* for */
-			} /* if */
-
-			/* TFC3 */
-			if (!match && TFC3 == mode) {
-				for (i = 0; i <= 28 && !match; i ++) {
-					tokenlen = strlen(tfc3tokens[i]);	/* as above */
-					if (inputleft >= tokenlen &&
-					    0 == strncasecmp(input_p, tfc3tokens[i], tokenlen)) {
-						/* token match found */
-						match = TRUE;
-						(*output_p ++) = i + 204;	/* write token */
-						input_p += tokenlen;		/* skip token */
-						inputleft -= tokenlen;
-					} /* if */
-				} /* for */
-			} /* if */
-
-			/* Graphics52 */
-			if (!match && Graphics52 == mode) {
-				for (i = 0; i <= 50 && !match; i ++) {
-					tokenlen = strlen(graphics52tokens[i]);	/* as above */
-					if (inputleft >= tokenlen &&
-					    0 == strncasecmp(input_p, graphics52tokens[i],
-					                     tokenlen)) {
-						/* token match found */
-						match = TRUE;
-						(*output_p ++) = i + 204;	/* write token */
-						input_p += tokenlen;		/* skip token */
-						inputleft -= tokenlen;
-					} /* if */
-				} /* for */
-			} /* if */
-
-			/* PET BASIC 4.0/C64 BASIC 4.0 extension */
-			if (!match && Basic4 == mode) {
-				for (i = 0; i <= 23 && !match; i ++) {
-					tokenlen = strlen(basic4tokens[i]); /* as above */
-					if (inputleft >= tokenlen &&
-					    0 == strncasecmp(input_p, basic4tokens[i], tokenlen)) {
-						/* token match found */
-						match = TRUE;
-						(*output_p ++) = i + 204;	/* write token */
-						input_p += tokenlen;		/* skip token */
-						inputleft -= tokenlen;
-					} /* if */
-				} /* for */
-			} /* if */
+				if (stats_p && term_p->table < NUMTOKENTABLES) {
+					stats_p->tokens[term_p->table] ++;
+				} /* if */
 
-			/* VIC Super Extender BASIC extension */
-			if (!match && VicSuper == mode) {
-				for (i = 0; i <= 17 && !match; i ++) {
-					tokenlen = strlen(supertokens[i]); /* as above */
-					if (inputleft >= tokenlen &&
-					    0 == strncasecmp(input_p, supertokens[i], tokenlen)) {
-						/* token match found */
-						match = TRUE;
-						(*output_p ++) = i + 204;	/* write token */
-						input_p += tokenlen;		/* skip token */
-						inputleft -= tokenlen;
-					} /* if */
-				} /* for */
+				if (term_p->flags & KW_NOTOKENIZE) {	/* REM & DATA */
+					notokenize = TRUE;
+				} /* if */
 			} /* if */
 
 skiptokenize:
@@ -332,24 +398,32 @@ skiptokenize:
 						quotemode = !quotemode;		/* invert quotemode */
 					} /* if */
 					input_p ++;
-					inputleft --;
 				} /* if */
 				else if (*input_p >= 96 && *input_p <= 122) {
 					/* lowercase ASCII, convert to lowercase PETSCII) */
 					*(output_p ++) = *input_p - 32;
 					input_p ++;
-					inputleft --;
 				} /* if */
 				else {			/* illegal character */
-					fprintf(stderr, "* Illegal character in input (nonquoted): "
-					                "%c (%hu) at line %u\n",
-					        *input_p, (unsigned short) *input_p, linenumber);
+					report(ctx_p, "* Illegal character in input (nonquoted): "
+					              "%c (%hu) at line %u\n",
+					       *input_p, (unsigned short) *input_p, linenumber);
 					input_p ++;
 					rc = 1;
 				} /* else */
 			} /* if */
 		} /* else */
 		else if (quotemode) {	/* non-special character quoted */
+			/* Strings are copied in runs, up to the closing quote or an
+			 * escape
+			 */
+			run = copyrun(output_p, input_p, end_p, TRUE);
+			if (run) {
+				input_p += run;
+				output_p += run;
+				continue;
+			} /* if */
+
 			/* Map special characters (32-64) on themselves
 			 *     uppercase ASCII    (65-90) on uppercase PETSCII (193-228)
 			 *     lowercase ASCII   (97-122) on lowercase PETSCII  (65-90)
@@ -363,23 +437,20 @@ skiptokenize:
 					quotemode = !quotemode;		/* invert quotemode */
 				} /* if */
 				input_p ++;
-				inputleft --;
 			} /* if */
 			else if (*input_p >= 65 && *input_p <= 90) {
 				*(output_p ++) = *input_p | 128;
 				input_p ++;
-				inputleft --;
 			} /* if */
 			else if (*input_p >= 97 && *input_p <= 122) {
 				*(output_p ++) = *input_p & (~32);
 				input_p ++;
-				inputleft --;
 			} /* if */
 			else {
 				/* Unknown character */
-				fprintf(stderr, "* Illegal character in input (quoted): "
-				                "%c (%hu) at line %u\n",
-				        *input_p, (unsigned short) *input_p, linenumber);
+				report(ctx_p, "* Illegal character in input (quoted): "
+				              "%c (%hu) at line %u\n",
+				       *input_p, (unsigned short) *input_p, linenumber);
 				input_p ++;
 				rc = 1;
 			} /* else */
@@ -10,7 +10,18 @@ typedef enum basic_e {
 	Any, Basic2, Graphics52, TFC3, Basic7, Basic71, Basic35, Basic4, VicSuper
 } basic_t;
 
-int tokenize(const char *input_p, char *output_p, int *length_p, basic_t mode);
-int detokenize(const char *input_p, char *output_p, basic_t mode, int strict);
+/* Largest number of bytes tokenize writes for an input line of the given
+ * length: the line number, at most 37 bytes per character ("{a*255}"
+ * gives 255 bytes from 7 characters), and the terminating null
+ */
+#define TOKENIZEDSIZE(length) (2 + 37 * (length) + 1)
+
+struct context_s;
+
+int tokenize(struct context_s *ctx_p, const char *input_p, char *output_p,
+             int *length_p, basic_t mode);
+int detokenize(struct context_s *ctx_p, const char *input_p, char *output_p,
+               basic_t mode, int strict);
+void initdetokenize(void);
 
 #endif
\ No newline at end of file
@@ -4,6 +4,8 @@
  * $Id$
  */
 
+#include <stddef.h>
+
 #include "tokens.h"
 
 /* C64/VIC20 BASIC 2.0 (base for all versions)
@@ -386,6 +388,134 @@ const char *supertokens[] = {
 	"RDOT"				/* 221 */	/* 0xDD */
 };
 
+/* Keyword segments of the BASIC dialects
+ * The order of the segments is the order in which the keywords are tried
+ * when tokenizing, the first matching keyword is used.
+ */
+
+static const tokenseg_t basic2segs[] = {
+	{ c64tokens,         0, 75, 0,    128 },
+	{ NULL }
+};
+
+static const tokenseg_t graphics52segs[] = {
+	{ c64tokens,         0, 75, 0,    128 },
+	{ graphics52tokens,  0, 49, 0,    204 },
+	{ NULL }
+};
+
+static const tokenseg_t tfc3segs[] = {
+	{ c64tokens,         0, 75, 0,    128 },
+	{ tfc3tokens,        0, 28, 0,    204 },
+	{ NULL }
+};
+
+static const tokenseg_t basic7segs[] = {
+	{ c64tokens,         0, 75, 0,    128 },
+	{ c128FEtokens,      2, 38, 0xFE, 0   },
+	{ c128CEtokens,      2,  9, 0xCE, 0   },
+	{ c128tokens,        0, 49, 0,    204 },
+	{ NULL }
+};
+
+static const tokenseg_t basic71segs[] = {
+	{ c64tokens,         0, 75, 0,    128 },
+	{ c128FEtokens,      2, 55, 0xFE, 0   },
+	{ c128CEtokens,      2,  9, 0xCE, 0   },
+	{ c128tokens,        0, 49, 0,    204 },
+	{ NULL }
+};
+
+static const tokenseg_t basic35segs[] = {
+	{ c64tokens,         0, 75, 0,    128 },
+	{ c128tokens,        0, 49, 0,    204 },
+	{ NULL }
+};
+
+static const tokenseg_t basic4segs[] = {
+	{ c64tokens,         0, 75, 0,    128 },
+	{ basic4tokens,      0, 23, 0,    204 },
+	{ NULL }
+};
+
+static const tokenseg_t vicsupersegs[] = {
+	{ c64tokens,         0, 75, 0,    128 },
+	{ supertokens,       0, 17, 0,    204 },
+	{ NULL }
+};
+
+const tokenseg_t *dialects[] = {
+	basic2segs,			/* Any */
+	basic2segs,			/* Basic2 */
+	graphics52segs,		/* Graphics52 */
+	tfc3segs,			/* TFC3 */
+	basic7segs,			/* Basic7 */
+	basic71segs,		/* Basic71 */
+	basic35segs,		/* Basic35 */
+	basic4segs,			/* Basic4 */
+	vicsupersegs		/* VicSuper */
+};
+
+/* Token tables, and the names they are reported by in statistics */
+const char **tokentables[NUMTOKENTABLES] = {
+	c64tokens, graphics52tokens, tfc3tokens, c128tokens, c128CEtokens,
+	c128FEtokens, basic4tokens, supertokens
+};
+
+const char *tokentablenames[NUMTOKENTABLES] = {
+	"c64", "graphics52", "tfc3", "c128", "c128ce", "c128fe", "basic4",
+	"super"
+};
+
+/* findtokentable
+ * - finds the token table that a token of a BASIC dialect comes from
+ * in:	mode - BASIC version
+ *		prefix - prefix byte (0xCE/0xFE), 0 for none
+ *		token - token byte
+ * out:	index into tokentables[], -1 if the token is not a keyword
+ */
+int findtokentable(basic_t mode, int prefix, int token)
+{
+	const tokenseg_t	*seg_p;
+	int					i;
+
+	for (seg_p = dialects[mode]; seg_p->table_p; seg_p ++) {
+		if (seg_p->prefix == prefix &&
+		    token >= seg_p->first + seg_p->offset &&
+		    token <= seg_p->last + seg_p->offset &&
+		    *seg_p->table_p[token - seg_p->offset]) {
+			for (i = 0; i < NUMTOKENTABLES; i ++) {
+				if (tokentables[i] == seg_p->table_p)	return i;
+			}
+		}
+	}
+
+	return -1;
+}
+
+/* findkeyword
+ * - finds the keyword of a token of a BASIC dialect
+ * in:	mode - BASIC version
+ *		prefix - prefix byte (0xCE/0xFE), 0 for none
+ *		token - token byte
+ * out:	keyword, NULL if the token is not a keyword
+ */
+const char *findkeyword(basic_t mode, int prefix, int token)
+{
+	const tokenseg_t	*seg_p;
+
+	for (seg_p = dialects[mode]; seg_p->table_p; seg_p ++) {
+		if (seg_p->prefix == prefix &&
+		    token >= seg_p->first + seg_p->offset &&
+		    token <= seg_p->last + seg_p->offset &&
+		    *seg_p->table_p[token - seg_p->offset]) {
+			return seg_p->table_p[token - seg_p->offset];
+		}
+	}
+
+	return NULL;
+}
+
 /* petscii conversion tables
  * singlebyte => characters
  * multibyte => escape sequences (written as {sequence} in the text format)
@@ -5,6 +5,8 @@
 #ifndef __TOKENS_H
 #define __TOKENS_H
 
+#include "tokenize.h"
+
 /* C64 BASIC 2.0 */
 extern const char *c64tokens[];
 
@@ -31,6 +33,30 @@ extern const char *basic4tokens[];
  */
 extern const char *supertokens[];
 
+/* Keyword table segment
+ * - a range of one of the token tables above, making up a part of the
+ *   keyword set of a BASIC dialect
+ */
+typedef struct tokenseg_s {
+	const char	**table_p;		/* token table */
+	int			first, last;	/* range of table indices used */
+	int			prefix;			/* prefix byte (0xCE/0xFE), 0 for none */
+	int			offset;			/* token value of table index 0 */
+} tokenseg_t;
+
+/* Keyword segments of each BASIC dialect, in matching order
+ * indexed by basic_t, each list ends with a null table pointer
+ */
+extern const tokenseg_t *dialects[];
+
+/* The token tables above, and their names
+ */
+#define NUMTOKENTABLES 8
+extern const char **tokentables[NUMTOKENTABLES];
+extern const char *tokentablenames[NUMTOKENTABLES];
+int findtokentable(basic_t mode, int prefix, int token);
+const char *findkeyword(basic_t mode, int prefix, int token);
+
 /* PETSCII */
 extern const char *petscii[];
 int nontok64compatible(int petscii);
@@ -0,0 +1,501 @@
+/* xlate.c
+ * - Routines for converting binary programs from one BASIC dialect to
+ *   another, without going through the text format
+ * $Id$
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef __EMX__
+# include <pthread.h>
+#endif
+
+#include "xlate.h"
+#include "outmode.h"
+#include "tokenize.h"
+#include "tokens.h"
+#include "select.h"
+#include "image.h"
+#include "membuf.h"
+#include "context.h"
+
+#define FALSE 0
+#define TRUE 1
+
+/* Most bytes a keyword is translated to */
+#define MAXXLATE 16
+
+/* Translation of one token of the source dialect */
+typedef struct xlatentry_s {
+	const char		*keyword_p;		/* keyword, NULL if the byte is no
+									   token */
+	int				missing;		/* flag for keyword that the target
+									   dialect does not have */
+	int				table;			/* token table to count the token in,
+									   -1 if missing */
+	int				length;			/* number of bytes to write */
+	unsigned char	bytes[MAXXLATE];	/* bytes to write */
+} xlatentry_t;
+
+/* Translation table from one BASIC dialect to another */
+typedef struct xlate_s {
+	xlatentry_t	tokens[3][256];		/* tokens, unprefixed/0xCE/0xFE */
+	int			prefixed;			/* flag for source dialect with 0xCE/
+									   0xFE prefixed tokens */
+} xlate_t;
+
+/* Translation tables, built on first use of each pair of dialects and
+ * shared by all conversions
+ */
+static xlate_t *xlates[VicSuper + 1][VicSuper + 1];
+#ifndef __EMX__
+static pthread_mutex_t xlatelock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Usual start address of the programs of each BASIC dialect, indexed by
+ * basic_t. Programs keep their address if it does not change
+ */
+static const int startadrs[] = {
+	0x0801, 0x0801, 0x0801, 0x0801, 0x1C01, 0x1C01, 0x1001, 0x0401, 0x1001
+};
+
+/* buildxlate
+ * - builds the translation table between two BASIC dialects. Each keyword
+ *   of the source dialect is tokenized by itself in the target dialect, so
+ *   that it gets the bytes the text format would give it; those that do
+ *   not come out as the same keyword are missing from the target
+ * in:	xlate_p - translation table to fill in
+ *		from - BASIC version of the program
+ *		to - BASIC version to translate to
+ * out:	none
+ */
+static void buildxlate(xlate_t *xlate_p, basic_t from, basic_t to)
+{
+	static const int	prefixes[3] = { 0, 0xCE, 0xFE };
+	xlatentry_t			*entry_p;
+	const char			*keyword_p;
+	char				text[32], buf[TOKENIZEDSIZE(32)];
+	int					set, token, length, table = -1;
+
+	xlate_p->prefixed = FALSE;
+	for (set = 0; set < 3; set ++) {
+		for (token = 0; token < 256; token ++) {
+			entry_p = &xlate_p->tokens[set][token];
+			entry_p->keyword_p = findkeyword(from, prefixes[set], token);
+			entry_p->missing = FALSE;
+			entry_p->table = -1;
+			entry_p->length = 0;
+			if (!entry_p->keyword_p)	continue;
+			if (set)	xlate_p->prefixed = TRUE;
+
+			/* Tokenize it on a line of its own, and leave out the line
+			 * number and the terminating null
+			 */
+			sprintf(text, "0 %.24s", entry_p->keyword_p);
+			tokenize(NULL, text, buf, &length, to);
+			length -= 3;
+			if (length > MAXXLATE)	length = MAXXLATE;
+			memcpy(entry_p->bytes, buf + 2, length);
+			entry_p->length = length;
+
+			/* Check that the bytes are a token of the same keyword */
+			keyword_p = NULL;
+			if (1 == length) {
+				keyword_p = findkeyword(to, 0, entry_p->bytes[0]);
+				table = findtokentable(to, 0, entry_p->bytes[0]);
+			}
+			else if (2 == length &&
+			         (0xCE == entry_p->bytes[0] || 0xFE == entry_p->bytes[0])) {
+				keyword_p = findkeyword(to, entry_p->bytes[0],
+				                        entry_p->bytes[1]);
+				table = findtokentable(to, entry_p->bytes[0],
+				                       entry_p->bytes[1]);
+			}
+			entry_p->missing = !keyword_p ||
+			                   strcmp(keyword_p, entry_p->keyword_p);
+			if (!entry_p->missing)	entry_p->table = table;
+		}
+	}
+}
+
+/* getxlate
+ * - gets the translation table between two BASIC dialects, building it
+ *   the first time it is needed
+ * in:	from - BASIC version of the program
+ *		to - BASIC version to translate to
+ * out:	translation table, NULL if out of memory
+ */
+static const xlate_t *getxlate(basic_t from, basic_t to)
+{
+	xlate_t	*xlate_p;
+
+#ifndef __EMX__
+	pthread_mutex_lock(&xlatelock);
+#endif
+	xlate_p = xlates[from][to];
+	if (!xlate_p) {
+		xlate_p = malloc(sizeof(xlate_t));
+		if (xlate_p) {
+			buildxlate(xlate_p, from, to);
+			xlates[from][to] = xlate_p;
+		}
+	}
+#ifndef __EMX__
+	pthread_mutex_unlock(&xlatelock);
+#endif
+	return xlate_p;
+}
+
+/* xlateline
+ * - translates the tokens of a line onto the end of a program file image.
+ *   Strings, REM text and DATA text are copied as they are
+ * in:	ctx_p - context to report missing keywords to
+ *		xlate_p - translation table
+ *		line_p - line, starting with the line number
+ *		end_p - end of line data, if it is not null terminated before
+ *		output - buffer to write to
+ * out:	number of keywords missing from the target dialect
+ */
+static int xlateline(context_t *ctx_p, const xlate_t *xlate_p,
+                     const unsigned char *line_p,
+                     const unsigned char *end_p, membuf_t *output)
+{
+	const xlatentry_t	*entry_p;
+	const unsigned char	*run_p, *token_p;
+	unsigned			linenumber;
+	int					quotemode = FALSE, datamode = FALSE, remmode = FALSE;
+	int					missing = 0;
+	int					set, ch;
+	stats_t				*stats_p = ctx_p->stats_p;
+
+	/* The bytes between the tokens, starting with the line number, are
+	 * copied a run at a time
+	 */
+	linenumber = line_p[0] | (line_p[1] << 8);
+	run_p = line_p;
+
+	for (line_p += 2; line_p < end_p && *line_p; line_p ++) {
+		ch = *line_p;
+		if (remmode) {
+			/* REM text is left alone */
+		}
+		else if (quotemode) {
+			if (34 == ch)	quotemode = FALSE;
+		}
+		else if (34 == ch) {
+			quotemode = TRUE;
+		}
+		else if (datamode) {
+			if (':' == ch)	datamode = FALSE;
+		}
+		else {
+			/* C128 BASIC 7.0/7.1 CE and FE prefixes, if the following byte
+			 * is a valid token
+			 */
+			set = 0;
+			token_p = line_p;
+			if (xlate_p->prefixed && (0xCE == ch || 0xFE == ch) &&
+			    line_p + 1 < end_p &&
+			    xlate_p->tokens[0xCE == ch ? 1 : 2][line_p[1]].keyword_p) {
+				set = (0xCE == ch) ? 1 : 2;
+				ch = *(++ line_p);
+			}
+
+			entry_p = &xlate_p->tokens[set][ch];
+			if (entry_p->keyword_p) {
+				if (entry_p->missing) {
+					report(ctx_p, "* Keyword not in target BASIC: %s at "
+					       "line %u\n", entry_p->keyword_p, linenumber);
+					missing ++;
+				}
+				else if (stats_p) {
+					stats_p->tokens[entry_p->table] ++;
+				}
+				mbwrite(output, run_p, token_p - run_p);
+				mbwrite(output, entry_p->bytes, entry_p->length);
+				run_p = line_p + 1;
+
+				if (!set && 0x8F == ch)			remmode = TRUE;		/* REM */
+				else if (!set && 0x83 == ch)	datamode = TRUE;	/* DATA */
+			}
+		}
+	}
+
+	/* Line is ended by a null */
+	mbwrite(output, run_p, line_p - run_p);
+	mbputc(output, 0);
+	return missing;
+}
+
+/* xlateprg
+ * - translates a BASIC program into another BASIC dialect, byte by byte,
+ *   and links its lines for a new start address
+ * in:	ctx_p - conversion context
+ *		prg_p - pointer to BASIC program, following the start address
+ *		length - length of BASIC program
+ *		adr - address of BASIC start
+ *		from - BASIC version of the program
+ *		to - BASIC version to translate to
+ *		newadr - address of BASIC start of the translated program
+ *		output - buffer to append the program file image to
+ * out:	last address of translated program, -1 if out of memory
+ */
+int xlateprg(context_t *ctx_p, const unsigned char *prg_p, size_t length,
+             int adr, basic_t from, basic_t to, int newadr,
+             membuf_t *output)
+{
+	const xlate_t	*xlate_p;
+	size_t			pos = 0, end, start;
+	int				nextadr;
+	unsigned		linenumber, errors = 0;
+	stats_t			*stats_p = ctx_p->stats_p;
+	double			timer;
+
+	timer = starttimer(stats_p);
+	xlate_p = getxlate(from, to);
+	if (!xlate_p) {
+		reporterror(ctx_p, "Out of memory\n");
+		return -1;
+	}
+
+	/* Start address */
+	mbputc(output, newadr & 0xFF);		/* low */
+	mbputc(output, newadr >> 8);		/* high */
+
+	/* A BASIC 7.1 extension bound to the program is left out, as in
+	 * inconvert
+	 */
+	if (0x132D == adr) {
+		pos = 0x1C01 - 0x132D;
+		adr = 0x1C01;
+	}
+
+	/* Walk the lines the way inconvert does. The address to the next line
+	 * is null when the program is ended, must be higher than the current
+	 * address, and the line cannot be longer than 256 bytes
+	 */
+	for (;;) {
+		nextadr = (pos + 1 < length) ? prg_p[pos] | (prg_p[pos + 1] << 8)
+		                             : -1;
+		if (nextadr <= adr || nextadr - adr >= 256 || pos + 4 > length) {
+			break;
+		}
+
+		end = pos + (nextadr - adr);
+		if (end > length)	end = length;
+
+		/* Translate the line behind its next-line pointer, and fill that
+		 * in when the length is known
+		 */
+		start = output->length;
+		mbputc(output, 0);
+		mbputc(output, 0);
+		if (xlateline(ctx_p, xlate_p, prg_p + pos + 2, prg_p + end, output)) {
+			errors ++;
+		}
+		linenumber = prg_p[pos + 2] | (prg_p[pos + 3] << 8);
+		if (output->length - start >= 256) {
+			report(ctx_p, "* Line too long in target BASIC: %u\n",
+			       linenumber);
+			errors ++;
+		}
+		if (newadr + (output->length - start) > 0xFFFE) {
+			/* The line and the end of the program would not fit in memory
+			 * at the new address, so the program ends before it
+			 */
+			report(ctx_p, "* Program too long for new start address, ended "
+			       "before line %u\n", linenumber);
+			output->length = start;
+			errors ++;
+			nextadr = 0;
+			break;
+		}
+		newadr += output->length - start;
+		output->data_p[start] = newadr & 0xFF;		/* low */
+		output->data_p[start + 1] = newadr >> 8;	/* high */
+		if (stats_p)	stats_p->lines ++;
+
+		pos = end;
+		adr = nextadr;
+	}
+
+	/* If nextadr != null, then the program was invalid */
+	if (nextadr != 0) {
+		report(ctx_p, "Invalid BASIC file, translated up to address %04x\n",
+		       adr);
+		errors ++;
+	}
+	if (stats_p)	stats_p->errors += errors;
+
+	/* The program is ended by having a null nextline pointer */
+	mbputc(output, 0);
+	mbputc(output, 0);
+	stoptimer(stats_p, ConvertPhase, timer);
+
+	/* newadr points to last line pointer, which contains two nulls, so the
+	 * last used address is newadr+1
+	 */
+	return newadr + 1;
+}
+
+/* prg2prg
+ * - translates a binary file image into the BASIC dialect forced in the
+ *   context. The dialect of the program is selected as in input mode
+ * in:	ctx_p - conversion context
+ *		image_p - file image, starting with the start address
+ *		length - length of file image
+ *		title - file name of the translated program
+ *		programs_pp - pointer to where to put the translated program
+ * out:	zero if the program was translated
+ */
+int prg2prg(context_t *ctx_p, const unsigned char *image_p, size_t length,
+            const char *title, program_t **programs_pp)
+{
+	program_t	*program_p;
+	int			adr, newadr;
+	basic_t		from, to;
+
+	*programs_pp = NULL;
+
+	/* Check for valid BASIC file */
+	adr = (length >= 2) ? image_p[0] | (image_p[1] << 8) : -1;
+	if (length < 2 ||
+	    !(ctx_p->allfiles || 0x0401 == adr || 0x0801 == adr ||
+	      0x1c01 == adr || 0x4001 == adr || 0x132D == adr)) {
+		report(ctx_p, "Invalid BASIC start address: %04x (%d)\n", adr, adr);
+		return 1;
+	}
+
+	from = selectbasic(ctx_p, adr);
+	if (ctx_p->detect) {
+		from = detectbasic(ctx_p, image_p + 2, length - 2, adr, from,
+		                   FALSE);
+	}
+	to = (Any == ctx_p->force) ? from : ctx_p->force;
+
+	/* The program moves to the usual address of the target dialect if it
+	 * runs on another machine
+	 */
+	newadr = (0x132D == adr) ? 0x1C01 : adr;
+	if (startadrs[from] != startadrs[to])	newadr = startadrs[to];
+
+	report(ctx_p, "Translating: %s\n", title);
+
+	program_p = malloc(sizeof(program_t));
+	if (!program_p) {
+		reporterror(ctx_p, "Out of memory\n");
+		return 1;
+	}
+	program_p->next_p = NULL;
+	strncpy(program_p->filename, title, sizeof(program_p->filename) - 1);
+	program_p->filename[sizeof(program_p->filename) - 1] = 0;
+	program_p->adr = newadr;
+	program_p->unchanged = FALSE;
+	mbinit(&program_p->data);
+
+	program_p->endadr = xlateprg(ctx_p, image_p + 2, length - 2, adr, from,
+	                             to, newadr, &program_p->data);
+	if (program_p->endadr < 0) {
+		freeprograms(program_p);
+		return 1;
+	}
+	if (ctx_p->stats_p)	ctx_p->stats_p->programs ++;
+
+	*programs_pp = program_p;
+	return 0;
+}
+
+/* samefile
+ * - checks whether two file names name the same existing file
+ * in:	name1 - first file name
+ *		name2 - second file name
+ * out:	TRUE / FALSE
+ */
+static int samefile(const char *name1, const char *name2)
+{
+	struct stat	info1, info2;
+
+	if (stat(name1, &info1) || stat(name2, &info2))	return FALSE;
+#ifdef __EMX__
+	/* No inode numbers, compare the names */
+	return 0 == stricmp(name1, name2);
+#else
+	return info1.st_dev == info2.st_dev && info1.st_ino == info2.st_ino;
+#endif
+}
+
+/* bas2bas
+ * - translates a binary file into the BASIC dialect forced in the context,
+ *   to be written under the same name, in the output directory of the
+ *   context, by writebundle. The input file is never written over
+ * in:	ctx_p - conversion context
+ *		infile - file name of file to read
+ *		programs_pp - pointer to where to put the translated program
+ * out:	zero if the file could be read and translated
+ */
+int bas2bas(context_t *ctx_p, const char *infile, program_t **programs_pp)
+{
+	image_t		input;
+	const char	*title_p;
+	membuf_t	outname;
+	double		start;
+	int			rc;
+
+	/* First, load the input file */
+	*programs_pp = NULL;
+	start = starttimer(ctx_p->stats_p);
+	if (loadimage(infile, &input)) {
+		reporterror(ctx_p, "Unable to open input file: %s\n", infile);
+		return 1;
+	}
+	stoptimer(ctx_p->stats_p, ReadPhase, start);
+	if (ctx_p->stats_p)	ctx_p->stats_p->bytesin += input.length;
+
+	/* Name to write to is the last part of the file name */
+#ifdef __EMX__
+	title_p = strrchr(infile, '\\');
+#else
+	title_p = strrchr(infile, '/');
+#endif
+	if (title_p) {	/* Found, make pointer point past the slash */
+		title_p ++;
+	}
+	else {	/* Not found, point to the whole file name */
+		title_p = infile;
+	}
+
+	/* Separate program files go to the output directory, T64 archive
+	 * entries are named by the title alone
+	 */
+	mbinit(&outname);
+	if (ctx_p->outdir && !ctx_p->t64name) {
+		mbprintf(&outname, "%s/%s", ctx_p->outdir, title_p);
+	}
+	else {
+		mbprintf(&outname, "%s", title_p);
+	}
+
+	/* Translate it */
+	rc = prg2prg(ctx_p, input.data_p, input.length, outname.data_p,
+	             programs_pp);
+
+	/* The translation may have lost keywords, so the program it came
+	 * from must be kept
+	 */
+	if (0 == rc && !ctx_p->t64name && samefile(infile, outname.data_p)) {
+		reporterror(ctx_p, "Output file would replace the input file: %s\n",
+		            infile);
+		freeprograms(*programs_pp);
+		*programs_pp = NULL;
+		rc = 1;
+	}
+
+	/* Release the file */
+	mbfree(&outname);
+	freeimage(&input);
+	return rc;
+}
@@ -0,0 +1,22 @@
+/* xlate.h
+ * $Id$
+ */
+
+#ifndef __XLATE_H
+#define __XLATE_H
+
+#include <stddef.h>
+
+#include "tokenize.h"
+#include "outmode.h"
+#include "membuf.h"
+#include "context.h"
+
+int xlateprg(context_t *ctx_p, const unsigned char *prg_p, size_t length,
+             int adr, basic_t from, basic_t to, int newadr,
+             membuf_t *output);
+int prg2prg(context_t *ctx_p, const unsigned char *image_p, size_t length,
+            const char *title, program_t **programs_pp);
+int bas2bas(context_t *ctx_p, const char *infile, program_t **programs_pp);
+
+#endif